@@ -0,0 +1,175 @@
+/*
+ *prune_bench.cpp*
+ Micro-benchmark of the two top-k selections of BeamCKYParser::beam_prune
+ (src/Linearalifold.cpp): quickselect followed by an erase per dropped key, and
+ histogram_select (-Dis_histogram_pruning) followed by one compacting sweep.
+
+ For each beam size a set of unordered_map beams of 4*beam states with normally
+ distributed integer scores (mean -50000, sd 15000, mt19937 seed 1) is pruned by
+ both, and the average time per call is printed, with whether both kept the same
+ number of states. The selections are copies of the ones in the engine, over the
+ unordered_map beams the engine used when histogram pruning was added.
+
+ make bench && ./bin/prune_bench
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#define HISTOGRAM_BINS 1024 // as in src/Linearalifold.h
+
+using namespace std;
+
+typedef int value_type;
+#define VALUE_MIN std::numeric_limits<int>::lowest()
+
+struct State
+{
+    value_type score;
+    int manner;
+    int trace[2];
+};
+
+vector<pair<value_type, int>> scores;
+vector<unsigned long> histogram;
+vector<value_type> bin_scores;
+
+unsigned long quickselect_partition(vector<pair<value_type, int>> &scores, unsigned long lower, unsigned long upper)
+{
+    value_type pivot = scores[upper].first;
+    while (lower < upper)
+    {
+        while (scores[lower].first < pivot)
+            ++lower;
+        while (scores[upper].first > pivot)
+            --upper;
+        if (scores[lower].first == scores[upper].first)
+            ++lower;
+        else if (lower < upper)
+            swap(scores[lower], scores[upper]);
+    }
+    return upper;
+}
+
+value_type quickselect(vector<pair<value_type, int>> &scores, unsigned long lower, unsigned long upper, unsigned long k)
+{
+    if (lower == upper)
+        return scores[lower].first;
+    unsigned long split = quickselect_partition(scores, lower, upper);
+    unsigned long length = split - lower + 1;
+    if (length == k)
+        return scores[split].first;
+    else if (k < length)
+        return quickselect(scores, lower, split - 1, k);
+    else
+        return quickselect(scores, split + 1, upper, k - length);
+}
+
+value_type histogram_select(unsigned long k)
+{
+    value_type lo = std::numeric_limits<value_type>::max(), hi = VALUE_MIN;
+    unsigned long n_min = 0;
+    for (auto &p : scores)
+    {
+        if (p.first == VALUE_MIN)
+            ++n_min;
+        else
+        {
+            lo = min(lo, p.first);
+            hi = max(hi, p.first);
+        }
+    }
+    if (scores.size() - n_min < k)
+        return VALUE_MIN;
+
+    long range = (long)hi - lo;
+    int shift = 0;
+    while ((range >> shift) >= HISTOGRAM_BINS)
+        ++shift;
+    histogram.assign((range >> shift) + 1, 0);
+    for (auto &p : scores)
+        if (p.first != VALUE_MIN)
+            ++histogram[((long)p.first - lo) >> shift];
+
+    long bin = histogram.size() - 1;
+    unsigned long above = 0;
+    while (above + histogram[bin] < k)
+        above += histogram[bin--];
+    if (shift == 0)
+        return lo + bin;
+
+    bin_scores.clear();
+    for (auto &p : scores)
+        if (p.first != VALUE_MIN && (((long)p.first - lo) >> shift) == bin)
+            bin_scores.push_back(p.first);
+    unsigned long r = k - above;
+    nth_element(bin_scores.begin(), bin_scores.begin() + (r - 1), bin_scores.end(), std::greater<value_type>());
+    return bin_scores[r - 1];
+}
+
+// prunes beamstep to beam states as beam_prune does, by quickselect or by histogram
+void prune(unordered_map<int, State> &beamstep, unsigned long beam, bool use_histogram)
+{
+    scores.clear();
+    for (auto &item : beamstep)
+        scores.push_back(make_pair(item.second.score, item.first));
+    if (scores.size() <= beam)
+        return;
+
+    if (!use_histogram)
+    {
+        value_type threshold = quickselect(scores, 0, scores.size() - 1, scores.size() - beam);
+        for (auto &p : scores)
+            if (p.first < threshold)
+                beamstep.erase(p.second);
+    }
+    else
+    {
+        value_type threshold = histogram_select(beam + 1);
+        auto p = scores.begin();
+        for (auto it = beamstep.begin(); it != beamstep.end(); ++p)
+        {
+            if (p->first < threshold)
+                it = beamstep.erase(it);
+            else
+                ++it;
+        }
+    }
+}
+
+int main()
+{
+    mt19937 rng(1);
+    for (int beam : {20, 50, 100, 200, 500, 1000, 2000})
+    {
+        int size = 4 * beam, reps = max(20, 400000 / size);
+        normal_distribution<double> score(-50000, 15000);
+        vector<unordered_map<int, State>> beams(reps);
+        for (auto &beamstep : beams)
+            for (int i = 0; i < size; i++)
+                beamstep[rng() % 100000] = State{(int)score(rng), 0, {0, 0}};
+
+        double seconds[2] = {0, 0};
+        long kept[2] = {0, 0};
+        for (int use_histogram = 0; use_histogram < 2; use_histogram++)
+            for (auto &original : beams)
+            {
+                unordered_map<int, State> beamstep = original;
+                auto start = chrono::steady_clock::now();
+                prune(beamstep, beam, use_histogram);
+                seconds[use_histogram] += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                kept[use_histogram] += beamstep.size();
+            }
+
+        printf("beam %5d  beam size %5d  quickselect+erase %7.2f us  histogram+compact %7.2f us  speedup %.2fx  kept %s\n",
+               beam, size, seconds[0] / reps * 1e6, seconds[1] / reps * 1e6, seconds[0] / seconds[1],
+               kept[0] == kept[1] ? "same" : "DIFF");
+    }
+    return 0;
+}
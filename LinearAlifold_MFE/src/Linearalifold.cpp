@@ -10,22 +10,31 @@
 #include <string>
 #include <map>
 #include <set>
+#include <climits>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <sstream>
 
 #include "Linearalifold.h"
 #include "Utils/utility.h"
 #include "Utils/ribo.h"
+#include "Utils/result_cache.h"
+#include "Utils/alignment_index.h"
+#include "Utils/alignment_reader.h"
+#include "outside.cpp"
 
 // #define SPECIAL_HP
 
 using namespace std;
 
 #ifdef lv
-bool comparefunc(std::pair<int, State> a, std::pair<int, State> b)
+bool comparefunc(const State &a, const State &b)
 {
-    return a.first > b.first;
+    return a.i > b.i;
 }
 
-void BeamCKYParser::sort_keys(std::unordered_map<int, State> &map, std::vector<std::pair<int, State>> &sorted_keys)
+void BeamCKYParser::sort_keys(BeamMap &map, std::vector<State> &sorted_keys)
 {
     sorted_keys.clear();
     for (auto &kv : map)
@@ -180,36 +189,123 @@ value_type quickselect(vector<pair<value_type, int>> &scores, unsigned long lowe
         return quickselect(scores, split + 1, upper, k - length);
 }
 
-value_type BeamCKYParser::beam_prune(std::unordered_map<int, State> &beamstep)
+#if defined(lv) && defined(is_histogram_pruning)
+// k-th largest of scores in linear time: bucket the (integer) scores into at most
+// HISTOGRAM_BINS bins, find the bin holding the k-th largest, and resolve ties
+// inside that bin only. Unlike quickselect, scores keeps the beam's iteration order.
+value_type BeamCKYParser::histogram_select(unsigned long k)
 {
-    scores.clear();
-    for (auto &item : beamstep)
+    value_type lo = std::numeric_limits<value_type>::max(), hi = VALUE_MIN;
+    unsigned long n_min = 0; // VALUE_MIN scores (for _V) sort below everything else
+    for (auto &p : scores)
     {
-        int i = item.first;
-        State &cand = item.second;
-        int k = i - 1;
-        value_type newscore;
-        // lisiz: for _V, avoid -inf-int=+inf
-        if ((k >= 0) && (bestC[k].score == VALUE_MIN))
-            newscore = VALUE_MIN;
+        if (p.first == VALUE_MIN)
+            ++n_min;
         else
-            newscore = (k >= 0 ? bestC[k].score : 0) + cand.score;
-        scores.push_back(make_pair(newscore, i));
+        {
+            lo = min(lo, p.first);
+            hi = max(hi, p.first);
+        }
     }
-    if (scores.size() <= beam)
+    if (scores.size() - n_min < k)
         return VALUE_MIN;
-    value_type threshold = quickselect(scores, 0, scores.size() - 1, scores.size() - beam);
+
+    long range = (long)hi - lo;
+    int shift = 0;
+    while ((range >> shift) >= HISTOGRAM_BINS)
+        ++shift;
+    histogram.assign((range >> shift) + 1, 0);
+    for (auto &p : scores)
+        if (p.first != VALUE_MIN)
+            ++histogram[((long)p.first - lo) >> shift];
+
+    // walk down from the best bin until k states are covered
+    long bin = histogram.size() - 1;
+    unsigned long above = 0;
+    while (above + histogram[bin] < k)
+        above += histogram[bin--];
+    if (shift == 0)
+        return lo + bin;
+
+    bin_scores.clear();
     for (auto &p : scores)
+        if (p.first != VALUE_MIN && (((long)p.first - lo) >> shift) == bin)
+            bin_scores.push_back(p.first);
+    unsigned long r = k - above; // r-th largest within the bin
+    nth_element(bin_scores.begin(), bin_scores.begin() + (r - 1), bin_scores.end(), std::greater<value_type>());
+    return bin_scores[r - 1];
+}
+#endif
+
+value_type BeamCKYParser::beam_prune(BeamMap &beamstep)
+{
+    // a state ranks by prefix + inside
+    auto prune_score = [&](const State &cand) -> value_type {
+        int k = cand.i - 1;
+        // lisiz: for _V, avoid -inf-int=+inf
+        if ((k >= 0) && (bestC[k].score == VALUE_MIN))
+            return VALUE_MIN;
+        return (k >= 0 ? bestC[k].score : 0) + cand.score;
+    };
+
+    scores.clear();
+    value_type best = VALUE_MIN;
+    for (auto &item : beamstep)
     {
-        if (p.first < threshold)
-            beamstep.erase(p.second);
+        value_type newscore = prune_score(item);
+        scores.push_back(make_pair(newscore, (int)item.i));
+        best = max(best, newscore);
     }
 
+    value_type threshold = VALUE_MIN;
+    if (cur_beam > 0 && scores.size() > cur_beam)
+#if defined(lv) && defined(is_histogram_pruning)
+        // same cut as the quickselect below, which keeps the top cur_beam+1 states
+        threshold = histogram_select(cur_beam + 1);
+#else
+        threshold = quickselect(scores, 0, scores.size() - 1, scores.size() - cur_beam);
+#endif
+    // score-margin pruning: nothing further than margin_score below the best candidate survives
+    if (beam_policy == BEAM_MARGIN && best != VALUE_MIN)
+        threshold = max(threshold, best - margin_score);
+    if (threshold == VALUE_MIN)
+        return VALUE_MIN;
+
+    // one compacting sweep; the beam is frozen once its column is done, in both builds
+    size_t before = beamstep.size();
+    beamstep.remove_if([&](const BeamMap::Entry &cand) { return prune_score(cand) < threshold; });
+    beam_stats.pruned += before - beamstep.size();
+
     return threshold;
 }
 
+// BEAM_ADAPTIVE: after each column, rescale the beam by how the time per column we can still
+// afford compares to the time per column we are spending now (a damped proportional controller)
+void BeamCKYParser::adapt_beam(int j, double elapsed)
+{
+    double this_column = elapsed - last_elapsed;
+    last_elapsed = elapsed;
+    column_time = (column_time > 0) ? 0.9 * column_time + 0.1 * this_column : this_column;
+
+    int remaining = seq_length - 1 - j;
+    if (remaining <= 0 || column_time <= 0)
+        return;
+
+    int beam_cap = beam > 0 ? beam : seq_length;
+    double affordable = (time_budget - elapsed) / remaining;
+    if (affordable <= 0)
+        cur_beam_f = ADAPTIVE_BEAM_MIN;
+    else
+    {
+        double ratio = min(max(affordable / column_time, 0.5), 2.0);
+        cur_beam_f *= pow(ratio, 0.25);
+    }
+    cur_beam_f = min(max(cur_beam_f, double(ADAPTIVE_BEAM_MIN)), double(beam_cap));
+    cur_beam = int(cur_beam_f + 0.5);
+}
+
 void BeamCKYParser::sortM(value_type threshold,
-                          std::unordered_map<int, State> &beamstep,
+                          BeamMap &beamstep,
                           std::vector<std::pair<value_type, int>> &sorted_stepM)
 {
     sorted_stepM.clear();
@@ -218,8 +314,8 @@ void BeamCKYParser::sortM(value_type threshold,
         // no beam pruning before, so scores vector not usable
         for (auto &item : beamstep)
         {
-            int i = item.first;
-            State &cand = item.second;
+            int i = item.i;
+            State &cand = item;
             int k = i - 1;
             value_type newscore;
             // lisiz: constraints may cause all VALUE_MIN, sorting has no use
@@ -270,7 +366,7 @@ void BeamCKYParser::prepare(unsigned len)
     scores.reserve(seq_length);
 }
 
-bool check_pairable_ij(vector<int> &SS_fast_i, vector<int> &SS_fast_j, float **ribo, vector<vector<ribo_state>> &pscore, int i, int j)
+bool check_pairable_ij(vector<int> &SS_fast_i, vector<int> &SS_fast_j, float **ribo, SpanTable<ribo_state> &pscore, int i, int j)
 { // it is hc_decompose  = fc->hc->mx[n * i + j]; in mfe.c
 
     // in hard.c, RNAalifold use this to check if column i and column j can be paired, 0 no, 63(VRNA_CONSTRAINT_CONTEXT_ALL_LOOPS = 63) yes
@@ -326,7 +422,7 @@ vector<pair<int, int>> get_pairs(string &structure)
     return results;
 }
 
-BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::string> &MSA, float **ribo, vector<vector<ribo_state>> &pscore, vector<vector<int>> &a2s_fast, vector<vector<int>> &s5_fast, vector<vector<int>> &s3_fast, vector<vector<int>> &SS_fast, vector<float> &smart_gap)
+BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::string> &MSA, float **ribo, SpanTable<ribo_state> &pscore, vector<vector<int>> &a2s_fast, vector<vector<int>> &s5_fast, vector<vector<int>> &s3_fast, vector<vector<int>> &SS_fast, vector<float> &smart_gap)
 {
 
     struct timeval parse_starttime, parse_endtime;
@@ -389,7 +485,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
         }
     }
 
-    auto next_position = init_next_position_only(seq_length);
+    auto next_position = init_next_position_only(seq_length, span);
 
     std::vector<std::string> seq_MSA_no_gap;
     seq_MSA_no_gap.resize(MSA.size());
@@ -432,16 +528,22 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
 
     gettimeofday(&starttime, NULL);
 
+    cur_beam = beam_policy == BEAM_ADAPTIVE && beam <= 0 ? 100 : beam;
+    cur_beam_f = cur_beam;
+    margin_score = value_type(beam_margin * 100 * n_seq);
+    last_elapsed = column_time = 0;
+    beam_stats = {0, 0, 0, INT_MAX, 0, 0, 0};
+
     float smart_gap_threshold = 0.5;
     // from left to right
     for (int j = 0; j < seq_length; ++j)
     {
 
-        unordered_map<int, State> &beamstepH = bestH[j];
-        unordered_map<int, State> &beamstepMulti = bestMulti[j];
-        unordered_map<int, State> &beamstepP = bestP[j];
-        unordered_map<int, State> &beamstepM2 = bestM2[j];
-        unordered_map<int, State> &beamstepM = bestM[j];
+        BeamMap &beamstepH = bestH[j];
+        BeamMap &beamstepMulti = bestMulti[j];
+        BeamMap &beamstepP = bestP[j];
+        BeamMap &beamstepM2 = bestM2[j];
+        BeamMap &beamstepM = bestM[j];
         State &beamstepC = bestC[j];
 
         auto &SS_j = SS_fast[j];
@@ -452,7 +554,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
 
         // beam of H
         {
-            if (beam > 0 && beamstepH.size() > beam)
+            if (need_prune(beamstepH.size()))
                 beam_prune(beamstepH);
 
             if (smart_gap[j] - smart_gap[j - 1] > smart_gap_threshold)
@@ -473,7 +575,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                     for (int s = 0; s < MSA.size(); s++)
                     {
                         auto jnext_temp = next_pair_MSA[s][SS_j[s]][j];
-                        while (jnext_temp - j < 4 && jnext_temp != -1)
+                        while (jnext_temp != -1 && column_distance(j, jnext_temp) < 4)
                             jnext_temp = next_pair_MSA[s][SS_j[s]][jnext_temp];
 
                         if (jnext_temp != -1)
@@ -483,6 +585,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                     if (jnext == jnext_org)
                         jnext = -1;
 
+                    if (!in_span(j, jnext)) jnext = -1;
                     next_position[j][j] = jnext;
                 }
 
@@ -516,6 +619,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                         else
                             jnext = -1;
 
+                        if (!in_span(j, jnext)) jnext = -1;
                         next_position[j][prev_jnext] = jnext;
                     }
                 }
@@ -579,12 +683,12 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                 sort_keys(beamstepH, keys);
                 for (auto &item : keys)
                 {
-                    int i = item.first;
+                    int i = item.i;
                     auto &SS_i = SS_fast[i];
                     auto &s3_i = s3_fast[i];
                     auto &a2s_i = a2s_fast[i];
 
-                    State &state = item.second;
+                    State &state = item;
 
                     // 2. generate p(i, j)
                     // lisiz, change the order because of the constriants
@@ -619,6 +723,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                         jnext = -1;
                     }
 
+                    if (!in_span(i, jnext)) jnext = -1;
                     next_position[i][j] = jnext;
 
                     while (1)
@@ -650,6 +755,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                             else
                                 jnext = -1;
 
+                            if (!in_span(i, jnext)) jnext = -1;
                             next_position[i][prev_jnext] = jnext;
                         }
                     }
@@ -711,7 +817,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
             continue;
         // beam of Multi
         {
-            if (beam > 0 && beamstepMulti.size() > beam)
+            if (need_prune(beamstepMulti.size()))
                 beam_prune(beamstepMulti);
             // for every state in Multi[j]
             //   1. extend (i, j) to (i, jnext)
@@ -719,8 +825,8 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
             sort_keys(beamstepMulti, keys);
             for (auto &item : keys)
             {
-                int i = item.first;
-                State &state = item.second;
+                int i = item.i;
+                State &state = item;
 
                 auto &SS_i = SS_fast[i];
                 auto &s3_i = s3_fast[i];
@@ -773,6 +879,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                         {
                             jnext = -1;
                         }
+                        if (!in_span(i, jnext)) jnext = -1;
                         next_position[i][j] = jnext;
                     }
 
@@ -806,6 +913,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                             else
                                 jnext = -1;
 
+                            if (!in_span(i, jnext)) jnext = -1;
                             next_position[i][prev_jnext] = jnext;
                         }
                     }
@@ -824,7 +932,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
         }
         // beam of P
         {
-            if (beam > 0 && beamstepP.size() > beam)
+            if (need_prune(beamstepP.size()))
                 beam_prune(beamstepP);
 
                 // for every state in P[j]
@@ -841,8 +949,8 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
             sort_keys(beamstepP, keys);
             for (auto &item : keys)
             {
-                int i = item.first;
-                State &state = item.second;
+                int i = item.i;
+                State &state = item;
 
                 auto &s5_i = s5_fast[i];
                 auto &SS_i = SS_fast[i];
@@ -850,7 +958,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                 auto &a2s_j = a2s_fast[j];
 
                 // 2. M = P
-                if (i > 0 && j < seq_length - 1)
+                if (i > 0 && j < seq_length - 1 && in_span(i - 1, j + 1))
                 {
                     value_type newscore;
                     newscore = state.score;
@@ -893,19 +1001,23 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
 #ifndef is_candidate_list
                         for (auto &m : bestM[k])
                         {
-                            int newi = m.first;
+                            int newi = m.i;
+                            if (!in_span(newi - 1, j + 1))
+                                continue;
                             // eq. to first convert P to M1, then M2/M = M + M1
-                            value_type newscore = M1_score + m.second.score;
+                            value_type newscore = M1_score + m.score;
                             update_if_better(beamstepM2[newi], newscore, MANNER_M2_eq_M_plus_P, k);
                         }
 #else
-                        if (bestM2_iter == beamstepM2.end() || M1_score > bestM2_iter->second.score)
+                        if (bestM2_iter == beamstepM2.end() || M1_score > bestM2_iter->score)
                         {
                             for (auto &m : bestM[k])
                             {
-                                int newi = m.first;
+                                int newi = m.i;
+                                if (!in_span(newi - 1, j + 1))
+                                    continue;
                                 // eq. to first convert P to M1, then M2/M = M + M1
-                                value_type newscore = M1_score + m.second.score;
+                                value_type newscore = M1_score + m.score;
                                 update_if_better(beamstepM2[newi], newscore, MANNER_M2_eq_M_plus_P, k);
                             }
                         }
@@ -972,8 +1084,9 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                         tt2[s] = NUM_TO_PAIR(SS_j[s], SS_i[s]);
                     }
 
-                    for (int p = i - 1; p >= std::max(i - SINGLE_MAX_LEN, 0); --p)
+                    for (int p = i - 1; p >= 0 && column_distance(p, i) <= SINGLE_MAX_LEN; --p)
                     {
+                        if (!in_span(p, j + 1)) break;
 
                         auto &SS_p = SS_fast[p];
                         auto &s5_p = s5_fast[p];
@@ -1006,10 +1119,11 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                                 q = -1;
                             }
 
+                            if (!in_span(p, q)) q = -1;
                             next_position[p][j] = q;
                         }
 
-                        while (q != -1 && ((i - p) + (q - j) - 2 <= SINGLE_MAX_LEN))
+                        while (q != -1 && (column_distance(p, i) + column_distance(j, q) - 2 <= SINGLE_MAX_LEN))
                         {
 
                             auto &SS_q = SS_fast[q];
@@ -1108,6 +1222,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                                 else
                                     q = temp_q;
 
+                                if (!in_span(p, q)) q = -1;
                                 next_position[p][prev_q] = q;
                             }
                         }
@@ -1118,7 +1233,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
         }
         // beam of M2
         {
-            if (beam > 0 && beamstepM2.size() > beam)
+            if (need_prune(beamstepM2.size()))
                 beam_prune(beamstepM2);
 
             // for every state in M2[j]
@@ -1128,8 +1243,8 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
             for (auto &item : keys)
             {
 
-                int i = item.first;
-                State &state = item.second;
+                int i = item.i;
+                State &state = item;
 
                 // 2. M = M2
                 {
@@ -1142,6 +1257,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                     auto smart_i = smart_gap[i - 1];
                     for (int p = i - 1; ((smart_i - smart_gap[p]) <= 2 * SINGLE_MAX_LEN) and p >= 0; --p)
                     {
+                        if (!in_span(p, j + 1)) break;
 
                         if (smart_gap[p] - smart_gap[p - 1] < smart_gap_threshold)
                         {
@@ -1175,6 +1291,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                             {
                                 q = -1;
                             }
+                            if (!in_span(p, q)) q = -1;
                             next_position[p][j] = q;
                         }
 
@@ -1208,6 +1325,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
                                 else
                                     q = -1;
 
+                                if (!in_span(p, q)) q = -1;
                                 next_position[p][prev_q] = q;
                             }
                         }
@@ -1228,7 +1346,7 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
         // beam of M
         {
             value_type threshold = VALUE_MIN;
-            if (beam > 0 && beamstepM.size() > beam)
+            if (need_prune(beamstepM.size()))
                 threshold = beam_prune(beamstepM);
 
 #ifdef is_cube_pruning
@@ -1241,9 +1359,9 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
             for (auto &item : keys)
             {
 
-                int i = item.first;
-                State &state = item.second;
-                if (j < seq_length - 1)
+                int i = item.i;
+                State &state = item;
+                if (j < seq_length - 1 && in_span(i - 1, j + 2))
                 {
                     value_type newscore;
                     newscore = state.score;
@@ -1264,11 +1382,35 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
             }
         }
 
+        ++beam_stats.columns;
+        beam_stats.states += beamstepH.size() + beamstepMulti.size() + beamstepP.size() + beamstepM2.size() + beamstepM.size() + 1;
+        beam_stats.beam_sum += cur_beam;
+        beam_stats.beam_lo = min(beam_stats.beam_lo, cur_beam);
+        beam_stats.beam_hi = max(beam_stats.beam_hi, cur_beam);
+
+        // column j takes no more states
+        for (BeamMap *beamstep : {&beamstepH, &beamstepMulti, &beamstepP, &beamstepM2, &beamstepM})
+        {
+            beamstep->freeze();
+            beam_stats.memory += beamstep->memory();
+        }
+
+        if (beam_policy == BEAM_ADAPTIVE)
+        {
+            gettimeofday(&endtime, NULL);
+            adapt_beam(j, endtime.tv_sec - starttime.tv_sec + (endtime.tv_usec - starttime.tv_usec) / 1000000.0);
+        }
+
     } // end of for-loo j
 
     State &viterbi = bestC[seq_length - 1];
     char result[seq_length + 1];
     get_parentheses(result, MSA[0]);
+    if (zuker)
+    {
+        outside(MSA, ribo, pscore, a2s_fast, s5_fast, s3_fast, SS_fast, smart_gap, next_pair_MSA, next_position);
+        zuker_suboptimals(n_seq);
+    }
     gettimeofday(&parse_endtime, NULL);
     double parse_elapsed_time = parse_endtime.tv_sec - parse_starttime.tv_sec + (parse_endtime.tv_usec - parse_starttime.tv_usec) / 1000000.0;
     unsigned long nos_tot = nos_H + nos_P + nos_M2 + nos_Multi + nos_M + nos_C;
@@ -1278,14 +1420,29 @@ BeamCKYParser::DecoderResult BeamCKYParser::parse_alifold(std::vector<std::strin
 
 BeamCKYParser::BeamCKYParser(int beam_size,
                              bool nosharpturn,
-                             bool verbose)
+                             bool verbose,
+                             BeamPolicy policy,
+                             float margin,
+                             float budget,
+                             int max_span,
+                             bool zuker_subopt,
+                             float delta)
     : beam(beam_size),
+      beam_policy(policy),
+      beam_margin(margin),
+      time_budget(budget),
+      span(max_span),
       no_sharp_turn(nosharpturn),
-      is_verbose(verbose)
+      is_verbose(verbose),
+      zuker(zuker_subopt),
+      window_size(2),
+      zuker_energy_delta(delta)
 {
     initialize();
 }
 
+// left out of the Python module (see python/src/mfe_module.cpp)
+#ifndef LINEARALIFOLD_LIBRARY
 int main(int argc, char **argv)
 {
     parseEnergyData("energy_data");
@@ -1297,67 +1454,357 @@ int main(int argc, char **argv)
     int beamsize = 100;
     bool sharpturn = false;
     bool is_verbose = false;
-
-    if (argc >= 1)
-    {
+    string beam_policy = "fixed";
+    float beam_margin = 0.0;
+    float time_budget = 0.0;
+    int span = 0;
+    float gap_fraction = 0.0;
+    bool zuker = false;
+    float zuker_delta = 5.0;
+    string index_file;
+    vector<int> sweep_beams;
+    int sweep_threads = 0;
+    string cache_dir;
+    double cache_size = 1024; // MB
+
+    if (argc > 1)
         beamsize = atoi(argv[1]);
+    if (argc > 2)
         is_verbose = atoi(argv[2]) == 1;
+    if (argc > 3)
+        beam_policy = argv[3];
+    if (argc > 4)
+        beam_margin = atof(argv[4]);
+    if (argc > 5)
+        time_budget = atof(argv[5]);
+    if (argc > 6)
+        span = atoi(argv[6]);
+    if (argc > 7)
+        gap_fraction = atof(argv[7]);
+    if (argc > 8)
+        zuker = atoi(argv[8]) == 1;
+    if (argc > 9)
+        zuker_delta = atof(argv[9]);
+    if (argc > 10)
+        index_file = argv[10];
+    if (argc > 11)
+    {
+        stringstream beams(argv[11]);
+        for (string beam; getline(beams, beam, ',');)
+            if (!beam.empty())
+                sweep_beams.push_back(atoi(beam.c_str()));
+    }
+    if (argc > 12)
+        sweep_threads = atoi(argv[12]);
+    if (argc > 13)
+        cache_dir = argv[13];
+    if (argc > 14)
+        cache_size = atof(argv[14]);
+
+    BeamPolicy policy = BEAM_FIXED;
+    if (beam_policy == "margin")
+        policy = BEAM_MARGIN;
+    else if (beam_policy == "adaptive")
+        policy = BEAM_ADAPTIVE;
+    else if (beam_policy != "fixed")
+    {
+        printf("unknown beam policy %s, use fixed, margin or adaptive\n", beam_policy.c_str());
+        return 1;
+    }
+
+    // --cache: results of alignments folded before (see Utils/result_cache.h), the lines printed
+    // for them; not for --sweep, nor the adaptive policy, which depends on the time taken
+    ResultCache cache;
+    string cache_options;
+    if (!cache_dir.empty())
+    {
+        if (!cache.open(cache_dir, uint64_t(cache_size * 1048576)))
+        {
+            printf("could not open cache directory %s\n", cache_dir.c_str());
+            return 1;
+        }
+        char text[512];
+        snprintf(text, sizeof(text), "linearalifold %s beam=%d sharpturn=%d policy=%d margin=%.9g span=%d gap=%.9g zuker=%d delta=%.9g",
+                 result_cache_checksum(vector<string>(1, "energy_data")).c_str(), beamsize, sharpturn, (int)policy, beam_margin,
+                 span, gap_fraction, zuker, zuker_delta);
+        cache_options = text;
     }
+    bool use_cache = cache.enabled() && sweep_beams.empty() && policy != BEAM_ADAPTIVE;
 
     std::vector<std::string> MSA;
+    std::vector<std::string> names;
+    string id; // #=GF ID of Stockholm
+
+    // the alignments of stdin, in any of the formats of Utils/alignment_reader.h and one after
+    // the other (a batch); the next one is read before one is folded, to tell a batch
+    AlignmentReader reader(0);
+    std::vector<std::string> next_MSA, next_names;
+    string next_id;
+    bool has_next = false;
+
+    // an existing alignment index replaces the input and its preparation (see Utils/alignment_index.h)
+    AlignmentIndex index;
+    bool from_index = false;
+    struct stat index_stat;
+    struct timeval index_starttime, index_endtime;
+    gettimeofday(&index_starttime, NULL);
+    if (!index_file.empty() && stat(index_file.c_str(), &index_stat) == 0)
+    {
+        if (!load_alignment_index(index_file, index))
+        {
+            printf("could not read alignment index %s\n", index_file.c_str());
+            return 1;
+        }
+        if (index.gap_fraction != gap_fraction)
+        {
+            printf("alignment index %s was made with gap fraction %.2f, not %.2f\n", index_file.c_str(), index.gap_fraction, gap_fraction);
+            return 1;
+        }
+        from_index = true;
+        MSA = index.MSA;
+        // an alignment on stdin (none is read from a terminal) must be the one the index was made of
+        if (!isatty(0) && reader.next(next_MSA, next_names) && alignment_index_key(next_MSA) != index.input_key)
+        {
+            printf("alignment index %s was made from another alignment\n", index_file.c_str());
+            return 1;
+        }
+        next_MSA.clear();
+        next_names.clear();
+    }
+    else
+    {
+        if (!reader.next(MSA, names))
+        {
+            printf("could not read the alignment: %s\n", reader.error.empty() ? "no alignment in the input" : reader.error.c_str());
+            return 1;
+        }
+        id = reader.id;
+        // an index is made of the first alignment of the input only
+        has_next = index_file.empty() && reader.next(next_MSA, next_names);
+        next_id = reader.id;
+    }
+    bool batch = has_next;
 
-    for (string seq; getline(cin, seq);)
+    for (int record = 1;; record++)
     {
-        // printf("Input: %s\n", seq.c_str());
-        if (seq.length() == 0)
-            continue;
+        if (record > 1)
+        {
+            if (!has_next)
+                break;
+            MSA.swap(next_MSA);
+            names.swap(next_names);
+            id = next_id;
+            has_next = reader.next(next_MSA, next_names);
+            next_id = reader.id;
+            gettimeofday(&parse_alifold_starttime, NULL);
+        }
+        if (batch)
+            printf(">%s\n", id.empty() ? ("alignment " + to_string(record)).c_str() : id.c_str());
+
+        // the result cache, before anything is prepared; an index's rows are its folded columns,
+        // so its column map goes into the key
+        string key_options = cache_options, cache_key, cached;
+        bool cache_hit = false;
+        if (use_cache)
+        {
+            if (from_index)
+            {
+                CacheKey columns;
+                columns.add(index.column_map.data(), index.column_map.size() * sizeof(int));
+                key_options += " index=" + columns.hex();
+            }
+            cache_key = result_cache_key(key_options, MSA);
+            cache_hit = cache.load(cache_key, key_options, cached);
+        }
+
+        // the ribosum of a hit is only needed for an index to write
+        float **ribo = NULL;
+        if (from_index)
+            ribo = index.ribo;
+        else if (!cache_hit || !index_file.empty())
+            ribo = get_ribosum(MSA, MSA.size(), MSA[0].size());
+
+        // fold without the gappy columns (ribosum from the full alignment), the structure is mapped back below
+        int original_length = from_index ? index.original_seq.size() : MSA[0].size();
+        vector<int> column_map;
+        string original_seq = MSA[0];
+        string input_key = index_file.empty() || from_index ? "" : alignment_index_key(MSA);
+        if (from_index)
+            column_map = index.column_map;
+        else if (gap_fraction > 0)
+            column_map = compress_gap_columns(MSA, gap_fraction);
+
+        if (!index_file.empty() && !from_index)
+        {
+            if (!write_alignment_index(index_file, input_key, names, MSA, original_seq, column_map, gap_fraction, ribo, span))
+                printf("could not write alignment index %s\n", index_file.c_str());
+        }
+        gettimeofday(&index_endtime, NULL);
+        double index_elapsed_time = index_endtime.tv_sec - index_starttime.tv_sec + (index_endtime.tv_usec - index_starttime.tv_usec) / 1000000.0;
 
-        if (seq[0] == ';' || seq[0] == '>')
+        if (cache_hit)
         {
-            // printf("%s\n", seq.c_str());
+            printf("%s", cached.c_str());
+            if (is_verbose)
+                printf("result cache %s from %s\n", cache_key.c_str(), cache_dir.c_str());
+            if (ribo != NULL && !from_index)
+            {
+                for (int i = 0; i < 7; i++)
+                    free(ribo[i]);
+                free(ribo);
+            }
             continue;
         }
 
-        // convert to uppercase
-        transform(seq.begin(), seq.end(), seq.begin(), ::toupper);
+        auto n_seq = MSA.size();
+        auto MSA_seq_length = MSA[0].size();
 
-        // convert T to U
-        replace(seq.begin(), seq.end(), 'T', 'U');
+        if (MSA_seq_length >= MAX_TRACE_LENGTH)
+        {
+            printf("alignment of %d columns is longer than the %d a state can trace back\n", (int)MSA_seq_length, MAX_TRACE_LENGTH - 1);
+            return 1;
+        }
 
-        MSA.push_back(seq);
+        auto pscore = init_pscores_only(MSA_seq_length, span);
+        vector<float> smart_gap;
+        vector<vector<int>> a2s_fast, s5_fast, s3_fast, SS_fast;
+        if (from_index)
+        {
+            index.fill_pscores(pscore);
+            a2s_fast.swap(index.a2s);
+            s5_fast.swap(index.s5);
+            s3_fast.swap(index.s3);
+            SS_fast.swap(index.SS);
+            smart_gap.swap(index.smart_gap);
+        }
+        else
+            a2s_prepare_is(MSA, n_seq, MSA_seq_length, a2s_fast, s5_fast, s3_fast, SS_fast, smart_gap);
 
-        // printf("%s\n", seq.c_str());
-    }
+        // the line of the structure, and its energy per sequence as free energy + covariance
+        auto result_line = [&](BeamCKYParser::DecoderResult &result)
+        {
+            double printscore = (result.score / -100.0);
+            auto result_pairs = get_pairs(result.structure);
+            float pscore_f = 0.;
+            for (auto &pair : result_pairs)
+            {
+                pscore_f += pscore[pair.first][pair.second].ribo_score;
+            }
+            pscore_f = -pscore_f / n_seq / 100.;
 
-    auto n_seq = MSA.size();
-    auto MSA_seq_length = MSA[0].size();
-
-    auto ribo = get_ribosum(MSA, n_seq, MSA_seq_length);
-    auto pscore = init_pscores_only(MSA_seq_length);
-    vector<float> smart_gap;
-    vector<vector<int>> a2s_fast, s5_fast, s3_fast, SS_fast;
-    a2s_prepare_is(MSA, n_seq, MSA_seq_length, a2s_fast, s5_fast, s3_fast, SS_fast, smart_gap);
-    BeamCKYParser parser(beamsize, !sharpturn, is_verbose);
-    BeamCKYParser::DecoderResult result_alifold = parser.parse_alifold(MSA, ribo, pscore, a2s_fast, s5_fast, s3_fast, SS_fast, smart_gap);
-    gettimeofday(&parse_alifold_endtime, NULL);
-    double parse_elapsed_time = parse_alifold_endtime.tv_sec - parse_alifold_starttime.tv_sec + (parse_alifold_endtime.tv_usec - parse_alifold_starttime.tv_usec) / 1000000.0;
-
-    double printscore = (result_alifold.score / -100.0);
-    auto result_pairs = get_pairs(result_alifold.structure);
-    float pscore_f = 0.;
-    for (auto &pair : result_pairs)
-    {
-        pscore_f += pscore[pair.first][pair.second].ribo_score;
-    }
-    pscore_f = -pscore_f / n_seq / 100.;
+            string structure = column_map.empty() ? result.structure : expand_structure(result.structure, column_map, original_length);
+            vector<char> line(structure.size() + 64);
+            snprintf(line.data(), line.size(), "%s (%.2f = %.2f + %.2f)\n", structure.c_str(), printscore / n_seq, printscore / n_seq - pscore_f, pscore_f);
+            return string(line.data());
+        };
 
-    printf("%s (%.2f = %.2f + %.2f)\n", result_alifold.structure.c_str(), printscore / n_seq, printscore / n_seq - pscore_f, pscore_f);
-    if (is_verbose)
+        // sweep: one parse per beam size on worker threads, all on the alignment prepared above;
+        // pscore is filled up front so that the parsers only read it. Largest beams go first.
+        if (!sweep_beams.empty())
+        {
+            make_pscores_all(pscore, SS_fast, ribo);
+
+            int num_beams = sweep_beams.size();
+            vector<int> order(num_beams);
+            for (int k = 0; k < num_beams; ++k)
+                order[k] = k;
+            stable_sort(order.begin(), order.end(), [&](int a, int b)
+                        { return sweep_beams[a] > sweep_beams[b]; });
+
+            vector<BeamCKYParser::DecoderResult> results(num_beams);
+            vector<BeamCKYParser::BeamStats> stats(num_beams);
+            int num_threads = sweep_threads > 0 ? sweep_threads : max(1, (int)thread::hardware_concurrency());
+            num_threads = min(num_threads, num_beams);
+            atomic<int> next_beam(0);
+            vector<thread> threads;
+            for (int t = 0; t < num_threads; ++t)
+            {
+                threads.push_back(thread([&]()
+                                         {
+                    for (int next; (next = next_beam++) < num_beams;)
+                    {
+                        int k = order[next];
+                        BeamCKYParser sweep_parser(sweep_beams[k], !sharpturn, false, policy, beam_margin, time_budget, span);
+                        sweep_parser.column_map = column_map;
+                        results[k] = sweep_parser.parse_alifold(MSA, ribo, pscore, a2s_fast, s5_fast, s3_fast, SS_fast, smart_gap);
+                        stats[k] = sweep_parser.beam_stats;
+                    } }));
+            }
+            for (auto &worker : threads)
+                worker.join();
+
+            for (int k = 0; k < num_beams; ++k)
+            {
+                printf("%s", result_line(results[k]).c_str());
+                printf("beam %d: %lu states, %lu pruned, %.2f seconds\n", sweep_beams[k], stats[k].states, stats[k].pruned, results[k].time);
+            }
+
+            gettimeofday(&parse_alifold_endtime, NULL);
+            double sweep_elapsed_time = parse_alifold_endtime.tv_sec - parse_alifold_starttime.tv_sec + (parse_alifold_endtime.tv_usec - parse_alifold_starttime.tv_usec) / 1000000.0;
+            printf("sweep of %d beams on %d threads: %.2f seconds\n", num_beams, num_threads, sweep_elapsed_time);
+        }
+        else
+        {
+            BeamCKYParser parser(beamsize, !sharpturn, is_verbose, policy, beam_margin, time_budget, span, zuker, zuker_delta);
+            parser.column_map = column_map;
+            BeamCKYParser::DecoderResult result_alifold = parser.parse_alifold(MSA, ribo, pscore, a2s_fast, s5_fast, s3_fast, SS_fast, smart_gap);
+            gettimeofday(&parse_alifold_endtime, NULL);
+            double parse_elapsed_time = parse_alifold_endtime.tv_sec - parse_alifold_starttime.tv_sec + (parse_alifold_endtime.tv_usec - parse_alifold_starttime.tv_usec) / 1000000.0;
+
+            // the lines printed are the results kept by the result cache
+            string printed = result_line(result_alifold);
+            if (zuker)
+            {
+                printed += "Zuker suboptimal structures...\n";
+                for (auto &subopt : parser.suboptimals)
+                {
+                    string structure = column_map.empty() ? subopt.first : expand_structure(subopt.first, column_map, original_length);
+                    vector<char> line(structure.size() + 32);
+                    snprintf(line.data(), line.size(), "%s (%.2f)\n", structure.c_str(), subopt.second / -100.0 / n_seq);
+                    printed += line.data();
+                }
+            }
+            printf("%s", printed.c_str());
+            if (use_cache && !cache.store(cache_key, key_options, printed))
+                printf("could not write to cache directory %s\n", cache_dir.c_str());
+            if (is_verbose)
+            {
+                printf("beam size %d\n", beamsize);
+                auto &stats = parser.beam_stats;
+                if (policy == BEAM_MARGIN)
+                    printf("beam policy margin (%.2f kcal/mol)\n", beam_margin);
+                else if (policy == BEAM_ADAPTIVE)
+                    printf("beam policy adaptive (budget %.2f seconds)\n", time_budget);
+                else
+                    printf("beam policy fixed\n");
+                if (span > 0)
+                    printf("max base pair span %d\n", span);
+                if (!column_map.empty())
+                    printf("folded %d of %d columns (gap fraction < %.2f)\n", (int)MSA_seq_length, original_length, gap_fraction);
+                if (!index_file.empty())
+                    printf("alignment index %s %s in %.2f seconds\n", from_index ? "loaded from" : "written to", index_file.c_str(), index_elapsed_time);
+                printf("beam per column avg %.1f min %d max %d\n", stats.columns ? stats.beam_sum / stats.columns : 0., stats.beam_lo, stats.beam_hi);
+                printf("pruned states %lu\n", stats.pruned);
+                printf("states in the beams %lu\n", stats.states);
+                printf("beam memory %.1f MB, %.1f bytes per state\n", stats.memory / 1048576.0, stats.states ? double(stats.memory) / stats.states : 0.);
+                printf("runtime %.2f seconds\n", parse_elapsed_time);
+            }
+        }
+
+        if (!from_index)
+        {
+            for (int i = 0; i < 7; i++)
+                free(ribo[i]);
+            free(ribo);
+        }
+    }
+    if (!reader.error.empty())
     {
-        printf("beam size %d\n", beamsize);
-        printf("runtime %.2f seconds\n", parse_elapsed_time);
+        printf("could not read the alignment: %s\n", reader.error.c_str());
+        return 1;
     }
 
     freeMemory(); // Free memory for energy data
     return 0;
 }
+#endif
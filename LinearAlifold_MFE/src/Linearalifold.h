@@ -6,12 +6,15 @@
 #include <limits>
 #include <vector>
 #include <unordered_map>
+#include <algorithm>
 
 #include "Utils/energy_model.h"
 // #include <stdint.h>
 using namespace std;
 
 #define MIN_CUBE_PRUNING_SIZE 20
+#define ADAPTIVE_BEAM_MIN 10 // smallest per-column beam the adaptive policy may use
+#define HISTOGRAM_BINS 1024  // bins for histogram pruning (-Dis_histogram_pruning)
 
 // #define lv
 
@@ -43,6 +46,13 @@ enum Manner
     MANNER_C_eq_C_plus_P, // 13: C = C + P
 };
 
+enum BeamPolicy
+{
+    BEAM_FIXED = 0, // 0: keep the top-k states of every beam (k = beam)
+    BEAM_MARGIN,    // 1: top-k, and drop states worse than the best by more than a margin
+    BEAM_ADAPTIVE,  // 2: top-k, with k adjusted per column to fit a runtime budget
+};
+
 enum BestTypes
 {
     TYPE_C = 0,
@@ -74,31 +84,67 @@ struct hash_pair
     }
 };
 
+// L x L table that keeps, for row i, only the columns i .. i+width-1 (pairs spanning
+// at most width columns), in one L*width block; t[i][j] reads as for vector<vector<T>>
+template <typename T>
+class SpanTable
+{
+public:
+    SpanTable() : width(0){};
+    SpanTable(int n, int w, const T &init = T()) { resize(n, w, init); };
+
+    void resize(int n, int w, const T &init = T())
+    {
+        width = w;
+        data.assign((size_t)n * w, init);
+    };
+
+    T *operator[](int i) { return data.data() + (size_t)i * (width - 1); };
+    const T *operator[](int i) const { return data.data() + (size_t)i * (width - 1); };
+
+    int width;
+
+private:
+    std::vector<T> data;
+};
+
 struct ribo_state
 {
     int ribo_score;
     ribo_state() : ribo_score(VALUE_MIN){};
 };
 
+// whether columns i and j may pair (pscore above the RNAalifold threshold); fills pscore[i][j] on first use
+bool check_pairable_ij(std::vector<int> &SS_fast_i, std::vector<int> &SS_fast_j, float **ribo, SpanTable<ribo_state> &pscore, int i, int j);
+
+// score, manner, left end and trace in 12 bytes with -Dlv: the manner in one byte, the left end
+// i in the 24 bits after it (the key of the state in its BeamMap), and the trace, either a split
+// (-1 for an empty prefix) or the unpaired columns around an inner pair, l1 on the left and l2
+// on the right. Neither is bounded by SINGLE_MAX_LEN (the multiloop skips gappy columns by
+// smart_gap and jumps to the next pairable column), so they keep 16 bits each and alignments
+// stay under MAX_TRACE_LENGTH columns
+#define MAX_TRACE_LENGTH (1 << 16)
+
 struct State
 {
     value_type score;
-    Manner manner;
+    Manner manner : 8;
+    unsigned i : 24;
 
     union TraceInfo
     {
         int split;
         struct
         {
-            int l1;
-            int l2;
+            unsigned l1 : 16;
+            unsigned l2 : 16;
         } paddings;
     };
 
     TraceInfo trace;
 
-    State() : manner(MANNER_NONE), score(VALUE_MIN){};
-    State(value_type s, Manner m) : score(s), manner(m){};
+    State() : score(VALUE_MIN), manner(MANNER_NONE), i(0){};
+    State(value_type s, Manner m) : score(s), manner(m), i(0){};
 
     void set(value_type score_, Manner manner_)
     {
@@ -122,10 +168,126 @@ struct State
     }
 };
 
+// the states of one beam by their left end i (State::i), with the parts of the unordered_map
+// interface the parser uses, iterating over the states themselves. While the beam still takes
+// new states they are kept in insertion order with an open-addressing index on i; freeze()
+// sorts them by i and drops the index once the column is done, leaving sizeof(State) bytes per
+// state, and lookups become binary searches.
+class BeamMap
+{
+public:
+    typedef State Entry;
+    typedef std::vector<Entry>::iterator iterator;
+
+    BeamMap() : frozen(false){};
+
+    iterator begin() { return entries.begin(); };
+    iterator end() { return entries.end(); };
+    size_t size() const { return entries.size(); };
+    bool empty() const { return entries.empty(); };
+
+    iterator find(int i)
+    {
+        if (frozen)
+        {
+            iterator it = lower_bound(i);
+            return (it != entries.end() && it->i == i) ? it : entries.end();
+        }
+        if (slots.empty())
+            return entries.end();
+        for (size_t s = slot_of(i);; s = (s + 1) & (slots.size() - 1))
+        {
+            if (slots[s] < 0)
+                return entries.end();
+            if (entries[slots[s]].i == i)
+                return entries.begin() + slots[s];
+        }
+    };
+
+    State &operator[](int i)
+    {
+        if (frozen)
+        {
+            // only the backtrace reads a frozen beam this way, and it finds its states
+            iterator it = lower_bound(i);
+            if (it == entries.end() || it->i != i)
+                it = entries.insert(it, keyed(i));
+            return *it;
+        }
+        if (2 * (entries.size() + 1) > slots.size())
+            rehash(max(size_t(16), 2 * slots.size()));
+        size_t s = slot_of(i);
+        for (; slots[s] >= 0; s = (s + 1) & (slots.size() - 1))
+            if (entries[slots[s]].i == i)
+                return entries[slots[s]];
+        slots[s] = entries.size();
+        entries.push_back(keyed(i));
+        return entries.back();
+    };
+
+    // drop the states drop(entry) is true for, keeping the others in order
+    template <typename Pred>
+    void remove_if(Pred drop)
+    {
+        entries.erase(std::remove_if(entries.begin(), entries.end(), drop), entries.end());
+        if (!frozen && !slots.empty())
+            rehash(slots.size());
+    };
+
+    void freeze()
+    {
+        if (frozen)
+            return;
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.i < b.i; });
+        std::vector<Entry>(entries).swap(entries);
+        std::vector<int>().swap(slots);
+        frozen = true;
+    };
+
+    // bytes held by the beam
+    size_t memory() const { return sizeof(BeamMap) + entries.capacity() * sizeof(Entry) + slots.capacity() * sizeof(int); };
+
+private:
+    std::vector<Entry> entries;
+    std::vector<int> slots; // power-of-two table of indices into entries, -1 if empty
+    bool frozen;
+
+    size_t slot_of(int i) const { return (unsigned(i) * 2654435761u) & (slots.size() - 1); };
+
+    static Entry keyed(int i)
+    {
+        Entry entry;
+        entry.i = i;
+        return entry;
+    };
+
+    void rehash(size_t n)
+    {
+        slots.assign(n, -1);
+        for (size_t k = 0; k < entries.size(); ++k)
+        {
+            size_t s = slot_of(entries[k].i);
+            while (slots[s] >= 0)
+                s = (s + 1) & (slots.size() - 1);
+            slots[s] = k;
+        }
+    };
+
+    iterator lower_bound(int i)
+    {
+        return std::lower_bound(entries.begin(), entries.end(), i, [](const Entry &a, int key) { return (int)a.i < key; });
+    };
+};
+
 class BeamCKYParser
 {
 public:
     int beam;
+    BeamPolicy beam_policy;
+    float beam_margin; // kcal/mol per sequence, for BEAM_MARGIN
+    float time_budget; // seconds for the whole parse, for BEAM_ADAPTIVE
+    int span;          // > 0: local folding, only pairs (i, j) with j - i < span
+    std::vector<int> column_map; // original column of every folded one, if gappy columns were left out (compress_gap_columns)
 
     bool no_sharp_turn;
     bool is_verbose;
@@ -144,25 +306,54 @@ public:
         double time;
     };
 
+    // what beam_prune did over one parse
+    struct BeamStats
+    {
+        unsigned long pruned;  // states removed from the beams
+        unsigned long columns; // columns processed
+        double beam_sum;       // sum of the per-column beam, for the average
+        int beam_lo, beam_hi;  // smallest and largest per-column beam
+        unsigned long states;  // states left in the beams after pruning
+        unsigned long memory;  // bytes held by the beams (BeamMap::memory) once their columns are done
+    };
+
+    BeamStats beam_stats;
+
     BeamCKYParser(int beam_size = 100,
                   bool nosharpturn = true,
-                  bool is_verbose = false);
+                  bool is_verbose = false,
+                  BeamPolicy policy = BEAM_FIXED,
+                  float margin = 0.0,
+                  float budget = 0.0,
+                  int max_span = 0,
+                  bool zuker_subopt = false,
+                  float delta = 5.0);
 
     DecoderResult parse(std::string &seq, std::vector<int> *cons);
 
-    DecoderResult parse_alifold(std::vector<std::string> &MSA, float **ribo, std::vector<std::vector<ribo_state>> &pscore, std::vector<std::vector<int>> &a2s_fast, std::vector<std::vector<int>> &s5_fast, std::vector<std::vector<int>> &s3_fast, std::vector<std::vector<int>> &SS_fast, vector<float> &smart_gap);
+    DecoderResult parse_alifold(std::vector<std::string> &MSA, float **ribo, SpanTable<ribo_state> &pscore, std::vector<std::vector<int>> &a2s_fast, std::vector<std::vector<int>> &s5_fast, std::vector<std::vector<int>> &s3_fast, std::vector<std::vector<int>> &SS_fast, vector<float> &smart_gap);
 
-    void outside(std::vector<int> next_pair[]); // for zuker subopt
+    // Viterbi outside scores of the states left in the beams, into bestX_beta (for zuker subopt)
+    void outside(std::vector<std::string> &MSA, float **ribo, SpanTable<ribo_state> &pscore, std::vector<std::vector<int>> &a2s_fast, std::vector<std::vector<int>> &s5_fast, std::vector<std::vector<int>> &s3_fast, std::vector<std::vector<int>> &SS_fast, vector<float> &smart_gap, std::vector<std::vector<int>> next_pair_MSA[], SpanTable<int> &next_position);
+
+    // zuker: suboptimal structures and their scores, best first, filled by parse_alifold
+    std::vector<std::pair<std::string, value_type>> suboptimals;
 
 private:
     void get_parentheses(char *result, std::string &seq);
 
-    std::pair<std::string, std::string> get_parentheses_outside_real_backtrace(int i, int j, State &state_beta, std::map<std::tuple<BestTypes, int, int>, std::pair<std::string, std::string>> &global_visited_outside, std::map<std::tuple<BestTypes, int, int>, std::string> &global_visited_inside, std::set<std::pair<int, int>> &window_visited);
+    std::pair<std::string, std::string> get_parentheses_outside_real_backtrace(int i, int j, State &state_beta, BestTypes type, std::map<std::tuple<BestTypes, int, int>, std::pair<std::string, std::string>> &global_visited_outside, std::map<std::tuple<BestTypes, int, int>, std::string> &global_visited_inside, std::set<std::pair<int, int>> &window_visited);
+    void window_fill(std::set<std::pair<int, int>> &window_visited, int i, int j);
+    void zuker_suboptimals(int n_seq);
     std::string get_parentheses_inside_real_backtrace(int i, int j, State &state, std::map<std::tuple<BestTypes, int, int>, std::string> &global_visited_inside, std::set<std::pair<int, int>> &window_visited);
 
     int seq_length;
 
-    std::vector<std::unordered_map<int, State>> bestH, bestP, bestM2, bestMulti, bestM;
+    std::vector<BeamMap> bestH, bestP, bestM2, bestMulti, bestM;
+
+    // outside scores from outside(); manner is the hyperedge to the best parent
+    std::vector<BeamMap> bestH_beta, bestP_beta, bestM2_beta, bestMulti_beta, bestM_beta;
+    std::vector<State> bestC_beta;
 
     std::vector<int> if_tetraloops;
     std::vector<int> if_hexaloops;
@@ -172,13 +363,13 @@ private:
     std::vector<std::vector<std::pair<value_type, int>>> sorted_bestM;
 
     // hzhang: sort keys in each beam to avoid randomness
-    std::vector<std::pair<int, State>> keys;
+    std::vector<State> keys;
 
     // hzhang: sort keys in each beam to avoid randomness
-    void sort_keys(std::unordered_map<int, State> &map, std::vector<std::pair<int, State>> &sorted_keys);
+    void sort_keys(BeamMap &map, std::vector<State> &sorted_keys);
 
     void sortM(value_type threshold,
-               std::unordered_map<int, State> &beamstep,
+               BeamMap &beamstep,
                std::vector<std::pair<value_type, int>> &sorted_stepM);
 
     std::vector<State> bestC;
@@ -205,10 +396,56 @@ private:
             state.set(newscore, manner, l1, l2);
     };
 
-    value_type beam_prune(std::unordered_map<int, State> &beamstep);
+    value_type beam_prune(BeamMap &beamstep);
+
+    // the beam used in the current column; equals beam unless the policy is BEAM_ADAPTIVE
+    int cur_beam;
+    double cur_beam_f;
+    // BEAM_MARGIN threshold in score units (beam_margin scaled by the number of sequences)
+    value_type margin_score;
+    // BEAM_ADAPTIVE controller state
+    double last_elapsed, column_time;
+
+    bool need_prune(size_t size)
+    {
+        return (cur_beam > 0 && size > cur_beam) || (beam_policy == BEAM_MARGIN && size > 1);
+    };
+
+    void adapt_beam(int j, double elapsed);
+
+    // (also for the column just outside either end, which the span limits ask about)
+    int original_index(int i)
+    {
+        if (column_map.empty())
+            return i;
+        if (i < 0)
+            return column_map[0] + i;
+        if (i >= (int)column_map.size())
+            return column_map.back() + i - (int)column_map.size() + 1;
+        return column_map[i];
+    };
+
+    // j - i in original columns: the hairpin, interior loop and span limits count the columns
+    // left out too, so that leaving out all-gap columns gives the result of folding them
+    int column_distance(int i, int j)
+    {
+        return original_index(j) - original_index(i);
+    };
+
+    bool in_span(int i, int j)
+    {
+        return span <= 0 || column_distance(i, j) < span;
+    };
 
     // vector to store the scores at each beam temporarily for beam pruning
     std::vector<std::pair<value_type, int>> scores;
+
+#if defined(lv) && defined(is_histogram_pruning)
+    // top-k selection for beam_prune by score histogram instead of quickselect
+    value_type histogram_select(unsigned long k);
+    std::vector<unsigned long> histogram;
+    std::vector<value_type> bin_scores;
+#endif
 };
 
 #endif // FASTCKY_BEAMCKYPAR_H
@@ -0,0 +1,253 @@
+// alignment index: an alignment prepared for folding (the columns after compress_gap_columns,
+// the ribosum matrix, a2s / s5 / s3 / SS, smart_gap and the covariation score of every pair that
+// can pair) in one binary file. It is written once and mapped back with mmap on later runs, so that
+// refolding the same alignment (other beams, MEA / ThreshKnot, either engine) skips reading
+// and preparing it. The same file works for bin/linearalifold and bin/linearalifold_p.
+// The header keeps a hash of the rows it was made of (CacheKey of Utils/result_cache.h), so that
+// an alignment given with an existing index can be checked to be the same.
+//
+// layout, in host byte order, every section padded to 4 bytes:
+//   AlignmentIndexHeader
+//   names       names_size bytes, the '>' / ';' lines of the input, one per line
+//   MSA         n_seq rows of length columns
+//   original    the first row before compress_gap_columns (original_length columns)
+//   column_map  int32[length] if original_length != length
+//   ribo        float[7][7]
+//   a2s s5 s3 SS int32[length][n_seq] each
+//   smart_gap   float[length]
+//   pair offsets uint32[length + 1], the pairs of row i are pairs offsets[i] .. offsets[i+1]-1
+//   pairs       int32 j, int32 make_pscores_ij(i, j) for the j = i+1 .. i+width-1 (< length)
+//               with a score of at least ALIGNMENT_INDEX_MIN_SCORE, row by row
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ALIGNMENT_INDEX_MAGIC "LAFINDEX"
+#define ALIGNMENT_INDEX_VERSION 2
+#define ALIGNMENT_INDEX_MIN_SCORE -200 // min_score of check_pairable_ij
+
+struct AlignmentIndexHeader {
+    char magic[8];
+    int32_t version;
+    int32_t n_seq;
+    int32_t length;          // folded columns
+    int32_t original_length; // columns of the input
+    float gap_fraction;      // of compress_gap_columns, 0 if every column is folded
+    int32_t width;           // pair scores kept per row (see SpanTable)
+    int32_t names_size;
+    char input_key[32];      // alignment_index_key of the rows read
+};
+
+// the hash of an alignment's rows as the reader normalised them, before compress_gap_columns
+static inline string alignment_index_key(const vector<string> & MSA) {
+    return result_cache_key("alignment index", MSA);
+}
+
+struct AlignmentIndex {
+    vector<string> names;
+    vector<string> MSA;
+    string original_seq;
+    vector<int> column_map; // empty if every column is folded
+    float gap_fraction;
+    string input_key;
+    float ** ribo; // owned by the index
+    vector<vector<int>> a2s, s5, s3, SS;
+    vector<float> smart_gap;
+
+    // the pair scores stay in the mapping
+    int width;
+    const uint32_t * pair_offsets;
+    const int32_t * pairs;
+    void * map_base;
+    size_t map_size;
+
+    AlignmentIndex(): ribo(NULL), width(0), pair_offsets(NULL), pairs(NULL), map_base(NULL), map_size(0) {};
+    ~AlignmentIndex() {
+        if (map_base != NULL) munmap(map_base, map_size);
+        if (ribo != NULL) {
+            for (int i = 0; i < 7; i++) free(ribo[i]);
+            free(ribo);
+        }
+    };
+
+    // the stored scores into pscore (rows of any width): the other pairs within the index's width
+    // get a score below ALIGNMENT_INDEX_MIN_SCORE, which only check_pairable_ij reads, and pairs
+    // beyond it stay unscored and are scored by the engine on first use as without an index
+    template <typename T>
+    void fill_pscores(SpanTable<T> & pscore) {
+        int length = MSA[0].size();
+        for (int i = 0; i < length; i++) {
+            int kept = min(width, min(pscore.width, length - i));
+            for (int d = 0; d < kept; d++)
+                pscore[i][i + d].ribo_score = ALIGNMENT_INDEX_MIN_SCORE - 1;
+            for (uint32_t k = pair_offsets[i]; k < pair_offsets[i + 1]; k++) {
+                int j = pairs[2 * k];
+                if (j - i < kept) pscore[i][j].ribo_score = pairs[2 * k + 1];
+            }
+        }
+    };
+};
+
+static inline size_t alignment_index_pad(size_t size) {
+    return (size + 3) & ~(size_t)3;
+}
+
+// prepare MSA (compressed already if column_map is not empty; input_key the alignment_index_key of
+// the rows read) and write it to path
+bool write_alignment_index(const string & path, const string & input_key, const vector<string> & names, vector<string> & MSA, const string & original_seq, const vector<int> & column_map, float gap_fraction, float ** ribo, int width) {
+    int n_seq = MSA.size();
+    int length = MSA[0].size();
+    if (width <= 0 || width > length) width = length;
+
+    vector<float> smart_gap;
+    vector<vector<int>> a2s, s5, s3, SS;
+    a2s_prepare_is(MSA, n_seq, length, a2s, s5, s3, SS, smart_gap);
+
+    FILE * fptr = fopen(path.c_str(), "wb");
+    if (fptr == NULL) return false;
+
+    string names_blob;
+    for (auto & name : names) names_blob += name + "\n";
+
+    AlignmentIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ALIGNMENT_INDEX_MAGIC, 8);
+    header.version = ALIGNMENT_INDEX_VERSION;
+    header.n_seq = n_seq;
+    header.length = length;
+    header.original_length = original_seq.size();
+    header.gap_fraction = gap_fraction;
+    header.width = width;
+    header.names_size = names_blob.size();
+    memcpy(header.input_key, input_key.data(), min(input_key.size(), sizeof(header.input_key)));
+
+    const char zeros[4] = {0, 0, 0, 0};
+    auto write_padded = [&](const void * data, size_t size) {
+        fwrite(data, 1, size, fptr);
+        fwrite(zeros, 1, alignment_index_pad(size) - size, fptr);
+    };
+
+    fwrite(&header, sizeof(header), 1, fptr);
+    write_padded(names_blob.data(), names_blob.size());
+    for (auto & row : MSA) write_padded(row.data(), length);
+    write_padded(original_seq.data(), original_seq.size());
+    if (header.original_length != length) {
+        vector<int32_t> map32(column_map.begin(), column_map.end());
+        fwrite(map32.data(), sizeof(int32_t), length, fptr);
+    }
+    for (int i = 0; i < 7; i++) fwrite(ribo[i], sizeof(float), 7, fptr);
+    for (auto table : {&a2s, &s5, &s3, &SS})
+        for (auto & column : *table) {
+            vector<int32_t> column32(column.begin(), column.end());
+            fwrite(column32.data(), sizeof(int32_t), n_seq, fptr);
+        }
+    fwrite(smart_gap.data(), sizeof(float), length, fptr);
+
+    vector<uint32_t> offsets(1, 0);
+    vector<int32_t> pairs;
+    bool ok = true;
+    for (int i = 0; i < length; i++) {
+        for (int j = i + 1; j < min(i + width, length); j++) {
+            int score = make_pscores_ij(SS[i], SS[j], ribo);
+            if (score < ALIGNMENT_INDEX_MIN_SCORE) continue;
+            pairs.push_back(j);
+            pairs.push_back(score);
+        }
+        ok = ok && pairs.size() / 2 <= UINT32_MAX;
+        offsets.push_back(pairs.size() / 2);
+    }
+    fwrite(offsets.data(), sizeof(uint32_t), length + 1, fptr);
+    fwrite(pairs.data(), sizeof(int32_t), pairs.size(), fptr);
+
+    ok = ok && !ferror(fptr);
+    return fclose(fptr) == 0 && ok;
+}
+
+// map path and read it into index; false if it is not an alignment index of this version
+bool load_alignment_index(const string & path, AlignmentIndex & index) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(AlignmentIndexHeader)) {
+        close(fd);
+        return false;
+    }
+    void * base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return false;
+    index.map_base = base;
+    index.map_size = st.st_size;
+
+    const char * cursor = (const char *)base;
+    const char * end = cursor + st.st_size;
+    AlignmentIndexHeader header;
+    memcpy(&header, cursor, sizeof(header));
+    cursor += sizeof(header);
+    if (memcmp(header.magic, ALIGNMENT_INDEX_MAGIC, 8) != 0 || header.version != ALIGNMENT_INDEX_VERSION) return false;
+
+    int n_seq = header.n_seq, length = header.length;
+    if (n_seq <= 0 || length <= 0 || header.width <= 0 || header.width > length) return false;
+
+    // everything up to the pairs, which must fill the rest of the file
+    size_t expected = sizeof(header) + alignment_index_pad(header.names_size) + (size_t)n_seq * alignment_index_pad(length)
+        + alignment_index_pad(header.original_length) + (header.original_length != length ? (size_t)length * 4 : 0)
+        + 49 * sizeof(float) + 4 * (size_t)length * n_seq * 4 + (size_t)length * 4 + ((size_t)length + 1) * 4;
+    if (expected > (size_t)st.st_size) return false;
+    const uint32_t * offsets = (const uint32_t *)((const char *)base + expected - ((size_t)length + 1) * 4);
+    for (int i = 0; i < length; i++)
+        if (offsets[i + 1] < offsets[i]) return false;
+    if (offsets[0] != 0 || expected + (size_t)offsets[length] * 8 != (size_t)st.st_size) return false;
+
+    auto next = [&](size_t size) {
+        const char * data = cursor;
+        cursor += alignment_index_pad(size);
+        return data;
+    };
+
+    string names_blob(next(header.names_size), header.names_size);
+    index.names.clear();
+    for (size_t start = 0, stop; start < names_blob.size(); start = stop + 1) {
+        stop = names_blob.find('\n', start);
+        index.names.push_back(names_blob.substr(start, stop - start));
+    }
+
+    index.MSA.resize(n_seq);
+    for (auto & row : index.MSA) row.assign(next(length), length);
+    index.original_seq.assign(next(header.original_length), header.original_length);
+
+    index.column_map.clear();
+    if (header.original_length != length) {
+        const int32_t * map32 = (const int32_t *)next((size_t)length * 4);
+        index.column_map.assign(map32, map32 + length);
+    }
+    index.gap_fraction = header.gap_fraction;
+    index.input_key.assign(header.input_key, sizeof(header.input_key));
+
+    const float * ribo = (const float *)next(49 * sizeof(float));
+    index.ribo = (float **)vrna_alloc(7 * sizeof(float *));
+    for (int i = 0; i < 7; i++) {
+        index.ribo[i] = (float *)vrna_alloc(7 * sizeof(float));
+        memcpy(index.ribo[i], ribo + 7 * i, 7 * sizeof(float));
+    }
+
+    for (auto table : {&index.a2s, &index.s5, &index.s3, &index.SS}) {
+        const int32_t * values = (const int32_t *)next((size_t)length * n_seq * 4);
+        table->resize(length);
+        for (int i = 0; i < length; i++)
+            (*table)[i].assign(values + (size_t)i * n_seq, values + (size_t)(i + 1) * n_seq);
+    }
+    const float * smart_gap = (const float *)next((size_t)length * 4);
+    index.smart_gap.assign(smart_gap, smart_gap + length);
+
+    index.width = header.width;
+    index.pair_offsets = (const uint32_t *)next(((size_t)length + 1) * 4);
+    index.pairs = (const int32_t *)cursor;
+    for (int i = 0; i < length; i++)
+        for (uint32_t k = offsets[i]; k < offsets[i + 1]; k++)
+            if (index.pairs[2 * k] <= i || index.pairs[2 * k] >= min(i + header.width, length)) return false;
+    return cursor + (size_t)offsets[length] * 8 == end;
+}
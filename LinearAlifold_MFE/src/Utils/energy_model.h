@@ -2,6 +2,7 @@
 #define ENERGY_MODEL_H
 
 #include <string>
+#include <cmath>
 
 #define VIE_INF 10000000
 #define NUCS_NUM 5
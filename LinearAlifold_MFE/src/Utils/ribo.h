@@ -1451,6 +1451,51 @@ tuple<vector<vector<int>>, vector<vector<int>>, vector<vector<int>>, vector<vect
 
 }
 
+
+// the gap characters an alignment may hold: '-', and '.' and '~', which the readers turn into '-'
+inline bool is_gap(char c){
+  return c == '-' || c == '.' || c == '~';
+}
+
+// drop the columns with a gap fraction of at least max_gap_fraction (1.0: only all-gap
+// columns, which can never pair) before folding; returns the original index of every kept column
+vector<int> compress_gap_columns(vector<std::string> &MSA, float max_gap_fraction){
+
+  int n_seq = MSA.size();
+  int MSA_seq_length = MSA[0].size();
+
+  vector<int> column_map;
+  for (int i = 0; i < MSA_seq_length; i++){
+    int gaps = 0;
+    for (int s = 0; s < n_seq; s++)
+      if (is_gap(MSA[s][i])) gaps++;
+
+    if (float(gaps) / n_seq < max_gap_fraction) column_map.push_back(i);
+  }
+
+  if (column_map.empty()) column_map.push_back(0); // keep something to fold
+
+  for (int s = 0; s < n_seq; s++){
+    std::string compressed(column_map.size(), '-');
+    for (int k = 0; k < column_map.size(); k++)
+      compressed[k] = MSA[s][column_map[k]];
+    MSA[s] = compressed;
+  }
+
+  return column_map;
+}
+
+
+// dot-bracket structure of the compressed alignment back in the original columns
+std::string expand_structure(const std::string &structure, const vector<int> &column_map, int MSA_seq_length){
+
+  std::string expanded(MSA_seq_length, '.');
+  for (int k = 0; k < structure.size(); k++)
+    expanded[column_map[k]] = structure[k];
+
+  return expanded;
+}
+
 // enum AUCG_pair_type {
 //     "CG" = 1,
 //     "GC",
@@ -1490,31 +1535,16 @@ int AUCG_pair_type(char & l, char & r){
 }
 
 
-vector<vector<ribo_state>> init_pscores_only(int MSA_seq_length){
-    vector<vector<ribo_state>> pscore;
-
-    pscore.resize(MSA_seq_length);
-
-    for (int i = 0; i< MSA_seq_length; i++){
-        pscore[i].resize(MSA_seq_length);
-    }
-    return pscore;
+// span > 0 keeps only pairs (i, j) with j - i < span, see SpanTable
+SpanTable<ribo_state> init_pscores_only(int MSA_seq_length, int span = 0){
+    int width = (span > 0 && span < MSA_seq_length) ? span : MSA_seq_length;
+    return SpanTable<ribo_state>(MSA_seq_length, width);
 }
 
 
-
-
-vector<vector<int>> init_next_position_only(int MSA_seq_length){
-    vector<vector<int>> next_position;
-
-    next_position.resize(MSA_seq_length);
-
-    for (int i = 0; i< MSA_seq_length; i++){
-        next_position[i].resize(MSA_seq_length);
-    }
-
-    return next_position;
-
+SpanTable<int> init_next_position_only(int MSA_seq_length, int span = 0){
+    int width = (span > 0 && span < MSA_seq_length) ? span : MSA_seq_length;
+    return SpanTable<int>(MSA_seq_length, width, 0);
 }
 
 // ACGU
@@ -1615,3 +1645,11 @@ int make_pscores_ij(vector<int> & SS_fast_i, vector<int> & SS_fast_j, float ** r
     }
     return 100 * score / n_seq - 100 * (pfreq[0] + pfreq[7] * 0.25);
 }
+
+// score every pair the table keeps up front, so that parsers on several threads only read it
+void make_pscores_all(SpanTable<ribo_state> & pscore, vector<vector<int>> & SS, float ** ribo){
+    int n = SS.size();
+    for (int i = 0; i < n; i++)
+        for (int j = i; j < n && j - i < pscore.width; j++)
+            pscore[i][j].ribo_score = make_pscores_ij(SS[i], SS[j], ribo);
+}
@@ -0,0 +1,788 @@
+
+#include <stdio.h>
+#include <algorithm>
+#include "Linearalifold.h"
+
+using namespace std;
+
+// Viterbi outside: for every state left in the beams after parse_alifold, the best score of
+// everything outside of it, i.e. the best complete structure through the state minus its score.
+// Same hypergraph as the inside pass, walked from right to left (cf. outside_alifold in the
+// partition version) with max instead of log-sum-exp. The manner of each beta state is the
+// hyperedge to its best parent, for the outside backtrace.
+void BeamCKYParser::outside(std::vector<std::string> &MSA, float **ribo, SpanTable<ribo_state> &pscore, vector<vector<int>> &a2s_fast, vector<vector<int>> &s5_fast, vector<vector<int>> &s3_fast, vector<vector<int>> &SS_fast, vector<float> &smart_gap, vector<vector<int>> next_pair_MSA[], SpanTable<int> &next_position)
+{
+    struct timeval outside_starttime, outside_endtime;
+    gettimeofday(&outside_starttime, NULL);
+
+    int n_seq = MSA.size();
+    float smart_gap_threshold = 0.5;
+
+    bestH_beta.clear();
+    bestH_beta.resize(seq_length);
+    bestP_beta.clear();
+    bestP_beta.resize(seq_length);
+    bestM2_beta.clear();
+    bestM2_beta.resize(seq_length);
+    bestM_beta.clear();
+    bestM_beta.resize(seq_length);
+    bestMulti_beta.clear();
+    bestMulti_beta.resize(seq_length);
+    bestC_beta.clear();
+    bestC_beta.resize(seq_length);
+
+    bestC_beta[seq_length - 1].set(0, MANNER_NONE);
+
+    auto beta_of = [](BeamMap &beamstep_beta, int i) -> value_type {
+        auto it = beamstep_beta.find(i);
+        return it == beamstep_beta.end() ? VALUE_MIN : it->score;
+    };
+
+    auto &a2s_seq_length_1 = a2s_fast[seq_length - 1];
+
+    // from right to left
+    for (int j = seq_length - 1; j >= 0; --j)
+    {
+        BeamMap &beamstepH = bestH[j];
+        BeamMap &beamstepMulti = bestMulti[j];
+        BeamMap &beamstepP = bestP[j];
+        BeamMap &beamstepM2 = bestM2[j];
+        BeamMap &beamstepM = bestM[j];
+        State &beamstepC_beta = bestC_beta[j];
+
+        auto &SS_j = SS_fast[j];
+        auto &s3_j = s3_fast[j];
+        auto &s5_j = s5_fast[j];
+        auto &a2s_j = a2s_fast[j];
+
+        // beam of C
+        {
+            // C = C + U
+            if (j < seq_length - 1 && bestC_beta[j + 1].score != VALUE_MIN)
+                update_if_better(beamstepC_beta, bestC_beta[j + 1].score, MANNER_C_eq_C_plus_U);
+        }
+
+        // beam of M
+        {
+            // M = M + U
+            if (j < seq_length - 1)
+            {
+                for (auto &item : beamstepM)
+                {
+                    int i = item.i;
+                    value_type parent_beta = beta_of(bestM_beta[j + 1], i);
+                    if (parent_beta != VALUE_MIN)
+                        update_if_better(bestM_beta[j][i], parent_beta, MANNER_M_eq_M_plus_U);
+                }
+            }
+        }
+
+        // beam of M2
+        {
+            for (auto &item : beamstepM2)
+            {
+                int i = item.i;
+
+                // 2. M = M2
+                {
+                    value_type parent_beta = beta_of(bestM_beta[j], i);
+                    if (parent_beta != VALUE_MIN)
+                        update_if_better(bestM2_beta[j][i], parent_beta, MANNER_M_eq_M2);
+                }
+
+                // 1. multi-loop
+                {
+                    auto smart_i = smart_gap[i - 1];
+                    for (int p = i - 1; ((smart_i - smart_gap[p]) <= 2 * SINGLE_MAX_LEN) and p >= 0; --p)
+                    {
+                        if (!in_span(p, j + 1)) break;
+                        if (smart_gap[p] - smart_gap[p - 1] < smart_gap_threshold)
+                            continue;
+
+                        auto &SS_p = SS_fast[p];
+
+                        int q;
+
+                        if (next_position[p][j] != 0)
+                            q = next_position[p][j];
+                        else
+                        {
+                            q = jnext_org;
+                            for (int s = 0; s < n_seq; s++)
+                            {
+                                auto jnext_temp = next_pair_MSA[s][SS_p[s]][j];
+                                if (jnext_temp != -1)
+                                    q = min(q, jnext_temp);
+                            }
+
+                            if (q == jnext_org)
+                                q = -1;
+                            if (!in_span(p, q)) q = -1;
+                            next_position[p][j] = q;
+                        }
+
+                        while (1)
+                        {
+                            if (q == -1)
+                                break;
+                            if (check_pairable_ij(SS_p, SS_fast[q], ribo, pscore, p, q))
+                                break;
+
+                            if (next_position[p][q] != 0)
+                                q = next_position[p][q];
+                            else
+                            {
+                                auto prev_q = q;
+                                int jnext_min = jnext_org;
+
+                                for (int s = 0; s < n_seq; s++)
+                                {
+                                    auto jnext_temp = next_pair_MSA[s][SS_p[s]][q];
+                                    if (jnext_temp != -1)
+                                        jnext_min = min(jnext_min, jnext_temp);
+                                }
+
+                                if (jnext_min != jnext_org)
+                                    q = jnext_min;
+                                else
+                                    q = -1;
+
+                                if (!in_span(p, q)) q = -1;
+                                next_position[p][prev_q] = q;
+                            }
+                        }
+
+                        if (q != -1)
+                        {
+                            value_type parent_beta = beta_of(bestMulti_beta[q], p);
+                            if (parent_beta != VALUE_MIN)
+                                update_if_better(bestM2_beta[j][i], parent_beta, MANNER_MULTI, (i - p), q - j);
+                        }
+                    }
+                }
+            }
+        }
+
+        // beam of P
+        {
+            for (auto &item : beamstepP)
+            {
+                int i = item.i;
+                State &state = item;
+
+                auto &s5_i = s5_fast[i];
+                auto &SS_i = SS_fast[i];
+                auto &a2s_i = a2s_fast[i];
+
+                // 1. P2P generate new helix / single_branch
+                if (i > 0 && j < seq_length - 1)
+                {
+                    auto &a2s_i_1 = a2s_fast[i - 1];
+
+                    int *tt2;
+                    tt2 = (int *)vrna_alloc(sizeof(int) * n_seq);
+                    for (int s = 0; s < n_seq; s++)
+                        tt2[s] = NUM_TO_PAIR(SS_j[s], SS_i[s]);
+
+                    for (int p = i - 1; p >= 0 && column_distance(p, i) <= SINGLE_MAX_LEN; --p)
+                    {
+                        if (!in_span(p, j + 1)) break;
+                        auto &SS_p = SS_fast[p];
+                        auto &s3_p = s3_fast[p];
+                        auto &a2s_p = a2s_fast[p];
+
+                        int q;
+
+                        if (next_position[p][j] != 0)
+                            q = next_position[p][j];
+                        else
+                        {
+                            q = jnext_org;
+                            for (int s = 0; s < n_seq; s++)
+                            {
+                                auto jnext_temp = next_pair_MSA[s][SS_p[s]][j];
+                                if (jnext_temp != -1)
+                                    q = min(q, jnext_temp);
+                            }
+
+                            if (q == jnext_org)
+                                q = -1;
+
+                            if (!in_span(p, q)) q = -1;
+                            next_position[p][j] = q;
+                        }
+
+                        while (q != -1 && (column_distance(p, i) + column_distance(j, q) - 2 <= SINGLE_MAX_LEN))
+                        {
+                            auto &SS_q = SS_fast[q];
+                            auto &s5_q = s5_fast[q];
+
+                            value_type parent_beta;
+                            if (check_pairable_ij(SS_p, SS_q, ribo, pscore, p, q) && (parent_beta = beta_of(bestP_beta[q], p)) != VALUE_MIN)
+                            {
+                                int nucp, nucq, nucp1, nucq_1, nuci_1, nucj1, u1_local, u2_local, type;
+                                value_type newscore = parent_beta + pscore[p][q].ribo_score;
+
+                                if (p == i - 1 && q == j + 1)
+                                {
+                                    // helix
+                                    for (int s = 0; s < n_seq; s++)
+                                    {
+                                        nucp = SS_p[s];
+                                        nucq = SS_q[s];
+                                        nucp1 = s3_p[s];
+                                        nucq_1 = s5_q[s];
+                                        nuci_1 = s5_i[s];
+                                        nucj1 = s3_j[s];
+
+                                        type = NUM_TO_PAIR(nucp, nucq);
+                                        newscore += -score_single_alifold(0, 0, type, tt2[s], nucp1, nucq_1, nuci_1, nucj1);
+                                    }
+
+                                    update_if_better(bestP_beta[j][i], newscore, MANNER_HELIX);
+                                }
+                                else
+                                {
+                                    // single branch
+                                    auto &a2s_q_1 = a2s_fast[q - 1];
+                                    for (int s = 0; s < n_seq; s++)
+                                    {
+                                        nucp = SS_p[s];
+                                        nucq = SS_q[s];
+                                        nucp1 = s3_p[s];
+                                        nucq_1 = s5_q[s];
+                                        nuci_1 = s5_i[s];
+                                        nucj1 = s3_j[s];
+
+                                        u1_local = a2s_i_1[s] - a2s_p[s];
+                                        u2_local = a2s_q_1[s] - a2s_j[s];
+
+                                        type = NUM_TO_PAIR(nucp, nucq);
+                                        newscore += -score_single_alifold(u1_local, u2_local, type, tt2[s], nucp1, nucq_1, nuci_1, nucj1);
+                                    }
+
+                                    update_if_better(bestP_beta[j][i], newscore, MANNER_SINGLE, (i - p), q - j);
+                                }
+                            }
+
+                            if (next_position[p][q] != 0)
+                                q = next_position[p][q];
+                            else
+                            {
+                                auto prev_q = q;
+                                int temp_q = jnext_org;
+
+                                for (int s = 0; s < n_seq; s++)
+                                {
+                                    auto jnext_temp = next_pair_MSA[s][SS_p[s]][q];
+                                    if (jnext_temp != -1)
+                                        temp_q = min(temp_q, jnext_temp);
+                                }
+
+                                if (temp_q == jnext_org)
+                                    q = -1;
+                                else
+                                    q = temp_q;
+
+                                if (!in_span(p, q)) q = -1;
+                                next_position[p][prev_q] = q;
+                            }
+                        }
+                    }
+
+                    free(tt2);
+                }
+
+                // 2. M = P
+                if (i > 0 && j < seq_length - 1)
+                {
+                    value_type parent_beta = beta_of(bestM_beta[j], i);
+                    if (parent_beta != VALUE_MIN)
+                    {
+                        value_type newscore = parent_beta;
+                        int new_nuci_1, new_nuci, new_nucj, new_nucj1;
+
+                        for (int s = 0; s < n_seq; s++)
+                        {
+                            new_nuci_1 = ((i - 1) > -1) ? s5_i[s] : -1;
+                            new_nuci = SS_i[s];
+                            new_nucj = SS_j[s];
+                            new_nucj1 = (j + 1) < seq_length ? s3_j[s] : -1;
+                            newscore += -score_M1(-1, -1, -1, new_nuci_1, new_nuci, new_nucj, new_nucj1, -1);
+                        }
+                        update_if_better(bestP_beta[j][i], newscore, MANNER_M_eq_P);
+                    }
+                }
+
+                // 3. M2 = M + P
+                // every M x P hyperedge, also the ones the candidate list skipped on the way in
+                {
+                    int k = i - 1;
+                    if (k > 0 && !bestM[k].empty())
+                    {
+                        value_type M1_score = 0;
+                        int new_nuci_1, new_nuci, new_nucj, new_nucj1;
+
+                        for (int s = 0; s < n_seq; s++)
+                        {
+                            new_nuci_1 = s5_i[s];
+                            new_nuci = SS_i[s];
+                            new_nucj = SS_j[s];
+                            new_nucj1 = (j + 1) < seq_length ? s3_j[s] : -1;
+                            M1_score += -score_M1(-1, -1, -1, new_nuci_1, new_nuci, new_nucj, new_nucj1, -1);
+                        }
+
+                        for (auto &m : bestM[k])
+                        {
+                            int newi = m.i;
+                            value_type parent_beta = beta_of(bestM2_beta[j], newi);
+                            if (parent_beta == VALUE_MIN)
+                                continue;
+                            update_if_better(bestP_beta[j][i], parent_beta + m.score + M1_score, MANNER_M2_eq_M_plus_P, newi);
+                            update_if_better(bestM_beta[k][newi], parent_beta + state.score + M1_score, MANNER_M2_eq_M_plus_P, j);
+                        }
+                    }
+                }
+
+                // 4. C = C + P
+                if (beamstepC_beta.score != VALUE_MIN)
+                {
+                    int k = i - 1;
+                    if (k >= 0)
+                    {
+                        State &prefix_C = bestC[k];
+                        if (prefix_C.manner != MANNER_NONE)
+                        {
+                            value_type newscore = beamstepC_beta.score;
+                            int new_nuck, new_nuck1, new_nucj, new_nucj1;
+
+                            for (int s = 0; s < n_seq; s++)
+                            {
+                                new_nuck = (a2s_i[s] > 0) ? s5_i[s] : -1; // external.c line 1165, weird
+                                new_nuck1 = SS_i[s];
+                                new_nucj = SS_j[s];
+                                new_nucj1 = (a2s_j[s] < a2s_seq_length_1[s]) ? s3_j[s] : -1; // external.c line 1165, weird
+                                newscore += -score_external_paired(-1, -1, new_nuck, new_nuck1, new_nucj, new_nucj1, -1);
+                            }
+
+                            update_if_better(bestP_beta[j][i], newscore + prefix_C.score, MANNER_C_eq_C_plus_P, k);
+                            update_if_better(bestC_beta[k], newscore + state.score, MANNER_C_eq_C_plus_P, j);
+                        }
+                    }
+                    else
+                    {
+                        value_type newscore = beamstepC_beta.score;
+                        int new_nuck1, new_nucj, new_nucj1;
+
+                        for (int s = 0; s < n_seq; s++)
+                        {
+                            new_nuck1 = SS_i[s];
+                            new_nucj = SS_j[s];
+                            new_nucj1 = (a2s_j[s] < a2s_seq_length_1[s]) ? s3_j[s] : -1; // external.c line 1165, weird
+                            newscore += -score_external_paired(0, j, -1, new_nuck1, new_nucj, new_nucj1, -1);
+                        }
+                        update_if_better(bestP_beta[j][i], newscore, MANNER_C_eq_C_plus_P, -1);
+                    }
+                }
+            }
+        }
+
+        // beam of Multi
+        {
+            for (auto &item : beamstepMulti)
+            {
+                int i = item.i;
+
+                auto &SS_i = SS_fast[i];
+                auto &s3_i = s3_fast[i];
+
+                // 2. generate P (i, j)
+                {
+                    value_type parent_beta = beta_of(bestP_beta[j], i);
+                    if (parent_beta != VALUE_MIN)
+                    {
+                        value_type newscore = parent_beta + pscore[i][j].ribo_score;
+                        int new_nuci, new_nuci1, new_nucj_1, new_nucj;
+
+                        for (int s = 0; s < n_seq; s++)
+                        {
+                            new_nuci = SS_i[s];
+                            new_nuci1 = s3_i[s];
+                            new_nucj_1 = s5_j[s];
+                            new_nucj = SS_j[s];
+                            newscore += -score_multi(-1, -1, new_nuci, new_nuci1, new_nucj_1, new_nucj, -1);
+                        }
+                        update_if_better(bestMulti_beta[j][i], newscore, MANNER_P_eq_MULTI);
+                    }
+                }
+
+                // 1. extend (i, j) to (i, jnext)
+                {
+                    int jnext;
+
+                    if (next_position[i][j] != 0)
+                        jnext = next_position[i][j];
+                    else
+                    {
+                        jnext = jnext_org;
+                        for (int s = 0; s < n_seq; s++)
+                        {
+                            auto jnext_temp = next_pair_MSA[s][SS_i[s]][j];
+                            if (jnext_temp != -1)
+                                jnext = min(jnext, jnext_temp);
+                        }
+
+                        if (jnext == jnext_org)
+                            jnext = -1;
+                        if (!in_span(i, jnext)) jnext = -1;
+                        next_position[i][j] = jnext;
+                    }
+
+                    while (1)
+                    {
+                        if (jnext == -1)
+                            break;
+                        if (check_pairable_ij(SS_i, SS_fast[jnext], ribo, pscore, i, jnext))
+                            break;
+
+                        if (next_position[i][jnext] != 0)
+                            jnext = next_position[i][jnext];
+                        else
+                        {
+                            auto prev_jnext = jnext;
+                            int jnext_min = jnext_org;
+
+                            for (int s = 0; s < n_seq; s++)
+                            {
+                                auto jnext_temp = next_pair_MSA[s][SS_i[s]][jnext];
+                                if (jnext_temp != -1)
+                                    jnext_min = min(jnext_min, jnext_temp);
+                            }
+
+                            if (jnext_min != jnext_org)
+                                jnext = jnext_min;
+                            else
+                                jnext = -1;
+
+                            if (!in_span(i, jnext)) jnext = -1;
+                            next_position[i][prev_jnext] = jnext;
+                        }
+                    }
+
+                    if (jnext != -1)
+                    {
+                        value_type parent_beta = beta_of(bestMulti_beta[jnext], i);
+                        if (parent_beta != VALUE_MIN)
+                            update_if_better(bestMulti_beta[j][i], parent_beta, MANNER_MULTI_eq_MULTI_plus_U, jnext);
+                    }
+                }
+            }
+        }
+
+        // beam of H
+        {
+            for (auto &item : beamstepH)
+            {
+                int i = item.i;
+                // 2. generate p(i, j)
+                value_type parent_beta = beta_of(bestP_beta[j], i);
+                if (parent_beta != VALUE_MIN)
+                    update_if_better(bestH_beta[j][i], parent_beta, MANNER_HAIRPIN);
+            }
+        }
+
+        // outside column j takes no more states either
+        for (BeamMap *beamstep_beta : {&bestH_beta[j], &bestMulti_beta[j], &bestP_beta[j], &bestM2_beta[j], &bestM_beta[j]})
+            beamstep_beta->freeze();
+    } // end of for-loo j
+
+    gettimeofday(&outside_endtime, NULL);
+    double outside_elapsed_time = outside_endtime.tv_sec - outside_starttime.tv_sec + (outside_endtime.tv_usec - outside_starttime.tv_usec) / 1000000.0;
+    if (is_verbose)
+        printf("outside runtime %.2f seconds\n", outside_elapsed_time);
+    fflush(stdout);
+}
+
+// mark the pairs within window_size (original) columns of (i, j) in both directions, so that no
+// later suboptimal structure is built around a pair next to one already used
+void BeamCKYParser::window_fill(set<pair<int, int>> &window_visited, int i, int j)
+{
+    int i_lo = i, i_hi = i, j_lo = j, j_hi = j;
+    while (i_lo > 0 && column_distance(i_lo - 1, i) <= window_size)
+        --i_lo;
+    while (i_hi < seq_length - 1 && column_distance(i, i_hi + 1) <= window_size)
+        ++i_hi;
+    while (j_lo > 0 && column_distance(j_lo - 1, j) <= window_size)
+        --j_lo;
+    while (j_hi < seq_length - 1 && column_distance(j, j_hi + 1) <= window_size)
+        ++j_hi;
+    for (int ii = i_lo; ii <= i_hi; ++ii)
+        for (int jj = j_lo; jj <= j_hi; ++jj)
+            if (ii < jj)
+                window_visited.insert(make_pair(ii, jj));
+}
+
+// best structure of the span of an inside state, as in get_parentheses; the type of the state
+// follows from its manner. Multi(i, j) stands for the loop between its closing pair, i.e. the
+// columns i + 1 to j - 1. Every state is backtraced once and shared by all suboptimals.
+std::string BeamCKYParser::get_parentheses_inside_real_backtrace(int i, int j, State &state, map<tuple<BestTypes, int, int>, string> &global_visited_inside, set<pair<int, int>> &window_visited)
+{
+    BestTypes type;
+    switch (state.manner)
+    {
+    case MANNER_HAIRPIN:
+    case MANNER_SINGLE:
+    case MANNER_HELIX:
+    case MANNER_P_eq_MULTI:
+        type = TYPE_P;
+        break;
+    case MANNER_MULTI:
+    case MANNER_MULTI_eq_MULTI_plus_U:
+        type = TYPE_Multi;
+        break;
+    case MANNER_M2_eq_M_plus_P:
+        type = TYPE_M2;
+        break;
+    case MANNER_M_eq_M2:
+    case MANNER_M_eq_M_plus_U:
+    case MANNER_M_eq_P:
+        type = TYPE_M;
+        break;
+    case MANNER_C_eq_C_plus_U:
+    case MANNER_C_eq_C_plus_P:
+        type = TYPE_C;
+        break;
+    default:
+        printf("wrong manner at %d, %d: manner %d\n", i, j, state.manner);
+        fflush(stdout);
+        assert(false);
+    }
+
+    auto key = make_tuple(type, i, j);
+    auto visited = global_visited_inside.find(key);
+    if (visited != global_visited_inside.end())
+        return visited->second;
+
+    string result;
+    int k, p, q;
+    switch (state.manner)
+    {
+    case MANNER_HAIRPIN:
+        window_fill(window_visited, i, j);
+        result = "(" + string(j - i - 1, '.') + ")";
+        break;
+    case MANNER_SINGLE:
+        window_fill(window_visited, i, j);
+        p = i + state.trace.paddings.l1;
+        q = j - state.trace.paddings.l2;
+        result = "(" + string(p - i - 1, '.') + get_parentheses_inside_real_backtrace(p, q, bestP[q][p], global_visited_inside, window_visited) + string(j - q - 1, '.') + ")";
+        break;
+    case MANNER_HELIX:
+        window_fill(window_visited, i, j);
+        result = "(" + get_parentheses_inside_real_backtrace(i + 1, j - 1, bestP[j - 1][i + 1], global_visited_inside, window_visited) + ")";
+        break;
+    case MANNER_P_eq_MULTI:
+        window_fill(window_visited, i, j);
+        result = "(" + get_parentheses_inside_real_backtrace(i, j, bestMulti[j][i], global_visited_inside, window_visited) + ")";
+        break;
+    case MANNER_MULTI:
+    case MANNER_MULTI_eq_MULTI_plus_U:
+        p = i + state.trace.paddings.l1;
+        q = j - state.trace.paddings.l2;
+        result = string(p - i - 1, '.') + get_parentheses_inside_real_backtrace(p, q, bestM2[q][p], global_visited_inside, window_visited) + string(j - q - 1, '.');
+        break;
+    case MANNER_M2_eq_M_plus_P:
+        k = state.trace.split;
+        result = get_parentheses_inside_real_backtrace(i, k, bestM[k][i], global_visited_inside, window_visited) + get_parentheses_inside_real_backtrace(k + 1, j, bestP[j][k + 1], global_visited_inside, window_visited);
+        break;
+    case MANNER_M_eq_M2:
+        result = get_parentheses_inside_real_backtrace(i, j, bestM2[j][i], global_visited_inside, window_visited);
+        break;
+    case MANNER_M_eq_M_plus_U:
+        result = get_parentheses_inside_real_backtrace(i, j - 1, bestM[j - 1][i], global_visited_inside, window_visited) + ".";
+        break;
+    case MANNER_M_eq_P:
+        result = get_parentheses_inside_real_backtrace(i, j, bestP[j][i], global_visited_inside, window_visited);
+        break;
+    case MANNER_C_eq_C_plus_U:
+        k = j - 1;
+        result = (k != -1 ? get_parentheses_inside_real_backtrace(0, k, bestC[k], global_visited_inside, window_visited) : "") + ".";
+        break;
+    case MANNER_C_eq_C_plus_P:
+        k = state.trace.split;
+        result = (k != -1 ? get_parentheses_inside_real_backtrace(0, k, bestC[k], global_visited_inside, window_visited) : "") + get_parentheses_inside_real_backtrace(k + 1, j, bestP[j][k + 1], global_visited_inside, window_visited);
+        break;
+    default:
+        break;
+    }
+
+    global_visited_inside[key] = result;
+    return result;
+}
+
+// best structure outside of a state, from the parent hyperedges left by outside(): the columns
+// left of i and right of j (for Multi(i, j) including its closing pair at i and j). C states
+// span from the first column, so only their right part is non-empty.
+std::pair<std::string, std::string> BeamCKYParser::get_parentheses_outside_real_backtrace(int i, int j, State &state_beta, BestTypes type, map<tuple<BestTypes, int, int>, pair<string, string>> &global_visited_outside, map<tuple<BestTypes, int, int>, string> &global_visited_inside, set<pair<int, int>> &window_visited)
+{
+    auto key = make_tuple(type, i, j);
+    auto visited = global_visited_outside.find(key);
+    if (visited != global_visited_outside.end())
+        return visited->second;
+
+    pair<string, string> result, parent;
+    int k, p, q;
+    switch (type)
+    {
+    case TYPE_C:
+        switch (state_beta.manner)
+        {
+        case MANNER_NONE: // the whole alignment
+            break;
+        case MANNER_C_eq_C_plus_U:
+            parent = get_parentheses_outside_real_backtrace(0, j + 1, bestC_beta[j + 1], TYPE_C, global_visited_outside, global_visited_inside, window_visited);
+            result.second = "." + parent.second;
+            break;
+        case MANNER_C_eq_C_plus_P:
+            k = state_beta.trace.split;
+            parent = get_parentheses_outside_real_backtrace(0, k, bestC_beta[k], TYPE_C, global_visited_outside, global_visited_inside, window_visited);
+            result.second = get_parentheses_inside_real_backtrace(j + 1, k, bestP[k][j + 1], global_visited_inside, window_visited) + parent.second;
+            break;
+        default:
+            assert(false);
+        }
+        break;
+    case TYPE_P:
+        switch (state_beta.manner)
+        {
+        case MANNER_HELIX:
+            window_fill(window_visited, i - 1, j + 1);
+            parent = get_parentheses_outside_real_backtrace(i - 1, j + 1, bestP_beta[j + 1][i - 1], TYPE_P, global_visited_outside, global_visited_inside, window_visited);
+            result = make_pair(parent.first + "(", ")" + parent.second);
+            break;
+        case MANNER_SINGLE:
+            p = i - state_beta.trace.paddings.l1;
+            q = j + state_beta.trace.paddings.l2;
+            window_fill(window_visited, p, q);
+            parent = get_parentheses_outside_real_backtrace(p, q, bestP_beta[q][p], TYPE_P, global_visited_outside, global_visited_inside, window_visited);
+            result = make_pair(parent.first + "(" + string(i - p - 1, '.'), string(q - j - 1, '.') + ")" + parent.second);
+            break;
+        case MANNER_M_eq_P:
+            result = get_parentheses_outside_real_backtrace(i, j, bestM_beta[j][i], TYPE_M, global_visited_outside, global_visited_inside, window_visited);
+            break;
+        case MANNER_M2_eq_M_plus_P:
+            k = state_beta.trace.split;
+            parent = get_parentheses_outside_real_backtrace(k, j, bestM2_beta[j][k], TYPE_M2, global_visited_outside, global_visited_inside, window_visited);
+            result = make_pair(parent.first + get_parentheses_inside_real_backtrace(k, i - 1, bestM[i - 1][k], global_visited_inside, window_visited), parent.second);
+            break;
+        case MANNER_C_eq_C_plus_P:
+            k = state_beta.trace.split;
+            parent = get_parentheses_outside_real_backtrace(0, j, bestC_beta[j], TYPE_C, global_visited_outside, global_visited_inside, window_visited);
+            result = make_pair(k != -1 ? get_parentheses_inside_real_backtrace(0, k, bestC[k], global_visited_inside, window_visited) : "", parent.second);
+            break;
+        default:
+            assert(false);
+        }
+        break;
+    case TYPE_M:
+        switch (state_beta.manner)
+        {
+        case MANNER_M_eq_M_plus_U:
+            parent = get_parentheses_outside_real_backtrace(i, j + 1, bestM_beta[j + 1][i], TYPE_M, global_visited_outside, global_visited_inside, window_visited);
+            result = make_pair(parent.first, "." + parent.second);
+            break;
+        case MANNER_M2_eq_M_plus_P:
+            k = state_beta.trace.split;
+            parent = get_parentheses_outside_real_backtrace(i, k, bestM2_beta[k][i], TYPE_M2, global_visited_outside, global_visited_inside, window_visited);
+            result = make_pair(parent.first, get_parentheses_inside_real_backtrace(j + 1, k, bestP[k][j + 1], global_visited_inside, window_visited) + parent.second);
+            break;
+        default:
+            assert(false);
+        }
+        break;
+    case TYPE_M2:
+        switch (state_beta.manner)
+        {
+        case MANNER_M_eq_M2:
+            result = get_parentheses_outside_real_backtrace(i, j, bestM_beta[j][i], TYPE_M, global_visited_outside, global_visited_inside, window_visited);
+            break;
+        case MANNER_MULTI:
+            p = i - state_beta.trace.paddings.l1;
+            q = j + state_beta.trace.paddings.l2;
+            parent = get_parentheses_outside_real_backtrace(p, q, bestMulti_beta[q][p], TYPE_Multi, global_visited_outside, global_visited_inside, window_visited);
+            result = make_pair(parent.first + string(i - p - 1, '.'), string(q - j - 1, '.') + parent.second);
+            break;
+        default:
+            assert(false);
+        }
+        break;
+    case TYPE_Multi:
+        switch (state_beta.manner)
+        {
+        case MANNER_P_eq_MULTI:
+            window_fill(window_visited, i, j);
+            parent = get_parentheses_outside_real_backtrace(i, j, bestP_beta[j][i], TYPE_P, global_visited_outside, global_visited_inside, window_visited);
+            result = make_pair(parent.first + "(", ")" + parent.second);
+            break;
+        case MANNER_MULTI_eq_MULTI_plus_U:
+            k = state_beta.trace.split;
+            parent = get_parentheses_outside_real_backtrace(i, k, bestMulti_beta[k][i], TYPE_Multi, global_visited_outside, global_visited_inside, window_visited);
+            result = make_pair(parent.first, string(k - j, '.') + parent.second);
+            break;
+        default:
+            assert(false);
+        }
+        break;
+    default:
+        assert(false);
+    }
+
+    global_visited_outside[key] = result;
+    return result;
+}
+
+// Zuker suboptimals (cf. LinearFold -zuker): for every pair (i, j) left in the beams, the best
+// structure containing it scores inside(P(i, j)) + outside(P(i, j)). Pairs within
+// zuker_energy_delta (kcal/mol per sequence) of the MFE are taken best first, and each gives
+// its structure unless a pair within window_size of (i, j) was already used by an earlier one.
+void BeamCKYParser::zuker_suboptimals(int n_seq)
+{
+    value_type threshold = bestC[seq_length - 1].score - zuker_energy_delta * 100 * n_seq;
+
+    vector<tuple<value_type, int, int>> candidates;
+    for (int j = 0; j < seq_length; ++j)
+    {
+        for (auto &item : bestP[j])
+        {
+            int i = item.i;
+            auto beta = bestP_beta[j].find(i);
+            if (beta == bestP_beta[j].end() || beta->score == VALUE_MIN)
+                continue;
+            value_type score = item.score + beta->score;
+            if (score >= threshold)
+                candidates.push_back(make_tuple(score, i, j));
+        }
+    }
+    sort(candidates.begin(), candidates.end(), [](const tuple<value_type, int, int> &a, const tuple<value_type, int, int> &b) {
+        return get<0>(a) > get<0>(b) || (get<0>(a) == get<0>(b) && make_pair(get<1>(a), get<2>(a)) < make_pair(get<1>(b), get<2>(b)));
+    });
+
+    map<tuple<BestTypes, int, int>, string> global_visited_inside;
+    map<tuple<BestTypes, int, int>, pair<string, string>> global_visited_outside;
+    set<pair<int, int>> window_visited;
+    set<string> printed;
+
+    suboptimals.clear();
+    for (auto &candidate : candidates)
+    {
+        int i = get<1>(candidate), j = get<2>(candidate);
+        if (window_visited.find(make_pair(i, j)) != window_visited.end())
+            continue;
+
+        string inside = get_parentheses_inside_real_backtrace(i, j, bestP[j][i], global_visited_inside, window_visited);
+        pair<string, string> outside = get_parentheses_outside_real_backtrace(i, j, bestP_beta[j][i], TYPE_P, global_visited_outside, global_visited_inside, window_visited);
+        string structure = outside.first + inside + outside.second;
+        if (printed.insert(structure).second)
+            suboptimals.push_back(make_pair(structure, get<0>(candidate)));
+    }
+}
@@ -0,0 +1,364 @@
+// alignment reader: the alignments of a stream, read line by line through zlib (so gzip
+// compressed input is read as is) with the rows normalised (upper case, U for T, '-' for the
+// gaps '.' and '~') as they are read. The format is told by the first line of each alignment:
+//   Stockholm  "# STOCKHOLM 1.0", then "name row" lines in one or more blocks and "#" markup
+//   Clustal    "CLUSTAL ..." (or "MUSCLE ..."), then blocks of "name row [count]" lines and
+//              conservation lines (which start with a space)
+//   FASTA      ">name" or ";name" lines, each followed by its row over one or more lines; lines
+//              before any name are a row each
+//   A2M        FASTA whose rows differ in length only by insert columns (lower case letters and
+//              '.'), which are left out
+// An alignment ends with a "//" line (as every Stockholm record does) or with the stream, so
+// one stream can hold several. A plain (not compressed) regular file is mapped with mmap instead
+// and read in place; its FASTA alignments are split into rows in parallel and each row is
+// normalised straight from the mapped bytes into its string, so that reading a deep alignment
+// takes little more memory than its rows. The same file is used by bin/linearalifold and
+// bin/linearalifold_p.
+
+#include <zlib.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <map>
+#include <thread>
+
+class AlignmentReader {
+public:
+    // reads fd (not closed)
+    AlignmentReader(int fd): format(""), in(NULL), map_base(NULL), map_size(0), pos(0), end(0), at_end(false) {
+        struct stat st;
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0 && st.st_size > offset) {
+            void * base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (base != MAP_FAILED) {
+                const unsigned char * start = (const unsigned char *)base + offset;
+                if (st.st_size - offset >= 2 && start[0] == 0x1f && start[1] == 0x8b) munmap(base, st.st_size); // gzip
+                else {
+                    madvise(base, st.st_size, MADV_SEQUENTIAL);
+                    map_base = base;
+                    map_size = st.st_size;
+                    map_pos = (const char *)start;
+                    map_end = (const char *)base + st.st_size;
+                    return;
+                }
+            }
+        }
+        in = gzdopen(dup(fd), "rb");
+        if (in != NULL) gzbuffer(in, 1 << 17);
+    };
+    ~AlignmentReader() {
+        if (map_base != NULL) munmap(map_base, map_size);
+        if (in != NULL) gzclose(in);
+    };
+
+    // the next alignment into MSA and names (the name lines, as '>' lines for Stockholm and
+    // Clustal); false at the end of the stream, or on an error (see error)
+    bool next(vector<string> & MSA, vector<string> & names) {
+        MSA.clear();
+        names.clear();
+        id.clear();
+        error.clear();
+        format = "";
+        if (in == NULL && map_base == NULL) {
+            error = "could not read the input";
+            return false;
+        }
+
+        string line;
+        // the first line of the alignment
+        while (true) {
+            if (!read_line(line)) return false;
+            if (!blank(line) && line != "//") break;
+        }
+
+        if (line.compare(0, 11, "# STOCKHOLM") == 0) read_blocks(MSA, names, false);
+        else if (line.compare(0, 7, "CLUSTAL") == 0 || line.compare(0, 6, "MUSCLE") == 0) read_blocks(MSA, names, true);
+        else if (map_base != NULL && (line[0] == '>' || line[0] == ';')) read_mapped_fasta(MSA, names);
+        else read_fasta(line, MSA, names);
+        if (!error.empty()) return false;
+
+        if (MSA.empty()) error = "no rows in the alignment";
+        for (auto & row : MSA)
+            if (error.empty() && row.size() != MSA[0].size()) error = "rows of different lengths";
+        if (error.empty() && MSA[0].empty()) error = "no columns in the alignment";
+        return error.empty();
+    };
+
+    string error;
+    const char * format; // of the last alignment: "FASTA", "A2M", "Stockholm" or "Clustal"
+    string id;           // of the last alignment: #=GF ID of Stockholm, empty otherwise
+
+private:
+    gzFile in;
+    void * map_base;              // the mapped input, or NULL if read through in
+    size_t map_size;
+    const char * map_pos, * map_end;
+    const char * line_begin;      // of the last line read, in the mapping
+    char buffer[1 << 16];
+    int pos, end;
+    bool at_end;
+
+    // next line without the newline (or \r\n); false at the end of the stream
+    bool read_line(string & line) {
+        line.clear();
+        if (map_base != NULL) {
+            if (map_pos == map_end) return false;
+            const char * newline = (const char *)memchr(map_pos, '\n', map_end - map_pos);
+            line_begin = map_pos;
+            line.assign(map_pos, newline == NULL ? map_end : newline);
+            map_pos = newline == NULL ? map_end : newline + 1;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            return true;
+        }
+        while (true) {
+            if (pos == end) {
+                if (at_end) return !line.empty();
+                end = gzread(in, buffer, sizeof(buffer));
+                pos = 0;
+                if (end <= 0) {
+                    end = 0;
+                    at_end = true;
+                    int status;
+                    gzerror(in, &status);
+                    if (status != Z_OK && status != Z_STREAM_END) error = "could not decompress the input";
+                    continue;
+                }
+            }
+            char * newline = (char *)memchr(buffer + pos, '\n', end - pos);
+            int stop = newline == NULL ? end : newline - buffer;
+            line.append(buffer + pos, stop - pos);
+            pos = stop;
+            if (newline != NULL) {
+                pos++;
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                return true;
+            }
+        }
+    };
+
+    static bool blank(const string & line) {
+        for (char c : line)
+            if (!isspace((unsigned char)c)) return false;
+        return true;
+    };
+
+    // the residues of [begin, end) appended to row, normalised; with keep_case, lower case
+    // letters and '.' are kept for read_fasta to tell A2M insertions; true if there were any
+    static bool append_row(string & row, const char * begin, const char * end, bool keep_case) {
+        bool inserts = false;
+        for (const char * c = begin; c != end; ++c) {
+            char x = *c;
+            if (isspace((unsigned char)x)) continue;
+            if (x >= 'a' && x <= 'z') {
+                if (keep_case) inserts = true;
+                else x -= 'a' - 'A';
+            }
+            else if (x == '.') {
+                if (keep_case) inserts = true;
+                else x = '-';
+            }
+            if (x == 'T') x = 'U';
+            else if (x == 't') x = 'u';
+            else if (x == '~') x = '-';
+            row += x;
+        }
+        return inserts;
+    };
+
+    void read_fasta(string & line, vector<string> & MSA, vector<string> & names) {
+        bool inserts = false;
+        bool named = false; // the last line was a name, so the next lines are its row
+        format = "FASTA";
+        do {
+            if (line == "//") break;
+            if (blank(line)) continue;
+            if (line[0] == '>' || line[0] == ';') {
+                names.push_back(line);
+                MSA.push_back("");
+                named = true;
+                continue;
+            }
+            if (!named) MSA.push_back("");
+            inserts |= append_row(MSA.back(), line.data(), line.data() + line.size(), true);
+        } while (read_line(line));
+
+        resolve_inserts(MSA, names, inserts);
+    };
+
+    // read_fasta from the name line just read, on the mapping: the name lines of the alignment
+    // are found by parallel scans of its bytes, then the rows between them are normalised in
+    // parallel, each straight into its string (append_row skips the line breaks)
+    void read_mapped_fasta(vector<string> & MSA, vector<string> & names) {
+        format = "FASTA";
+        const char * begin = line_begin;
+        const char * stop = map_end;
+        map_pos = map_end;
+        for (const char * c = begin; (c = (const char *)memmem(c, map_end - c, "\n//", 3)) != NULL; c += 3) {
+            const char * after = c + 3;
+            if (after < map_end && *after == '\r') after++;
+            if (after == map_end || *after == '\n') {
+                stop = c + 1;
+                map_pos = after == map_end ? map_end : after + 1;
+                break;
+            }
+        }
+
+        size_t size = stop - begin;
+        int num_threads = max(1, min((int)thread::hardware_concurrency(), (int)(size >> 22)));
+        vector<vector<const char *>> found(num_threads);
+        vector<thread> threads;
+        for (int t = 0; t < num_threads; t++)
+            threads.push_back(thread([&, t]() {
+                const char * a = begin + size * t / num_threads;
+                const char * b = begin + size * (t + 1) / num_threads;
+                const char * c = a;
+                if (c != begin && c[-1] != '\n') {
+                    c = (const char *)memchr(c, '\n', b - c);
+                    c = c == NULL ? b : c + 1;
+                }
+                while (c < b) {
+                    if (*c == '>' || *c == ';') found[t].push_back(c);
+                    c = (const char *)memchr(c, '\n', b - c);
+                    c = c == NULL ? b : c + 1;
+                }
+            }));
+        for (auto & t : threads) t.join();
+        release(begin, stop);
+        vector<const char *> name_lines;
+        for (auto & f : found) name_lines.insert(name_lines.end(), f.begin(), f.end());
+
+        int n_rows = name_lines.size();
+        MSA.resize(n_rows);
+        names.resize(n_rows);
+        num_threads = min(num_threads, n_rows);
+        vector<char> inserts(num_threads, false);
+        threads.clear();
+        for (int t = 0; t < num_threads; t++)
+            threads.push_back(thread([&, t]() {
+                const char * released = NULL;
+                for (int k = (long)n_rows * t / num_threads; k < (long)n_rows * (t + 1) / num_threads; k++) {
+                    const char * name_end = (const char *)memchr(name_lines[k], '\n', stop - name_lines[k]);
+                    const char * row_begin = name_end == NULL ? stop : name_end + 1;
+                    const char * row_end = k + 1 < n_rows ? name_lines[k + 1] : stop;
+                    if (name_end == NULL) name_end = stop;
+                    if (name_end > name_lines[k] && name_end[-1] == '\r') name_end--;
+                    names[k].assign(name_lines[k], name_end);
+                    MSA[k].clear();
+                    MSA[k].reserve(row_end - row_begin);
+                    if (append_row(MSA[k], row_begin, row_end, true)) inserts[t] = true;
+                    if (released == NULL) released = name_lines[k];
+                    if (row_end - released >= 1 << 20) {
+                        release(released, row_end);
+                        released = row_end;
+                    }
+                }
+            }));
+        for (auto & t : threads) t.join();
+        resolve_inserts(MSA, names, find(inserts.begin(), inserts.end(), true) != inserts.end());
+    };
+
+    // the pages of the mapping within [a, b) out of memory, once read (they are read back from the
+    // file if needed again), so that the mapped input does not add to the rows' memory
+    static void release(const char * a, const char * b) {
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t first = ((uintptr_t)a + page - 1) / page * page, last = (uintptr_t)b / page * page;
+        if (first < last) madvise((void *)first, last - first, MADV_DONTNEED);
+    };
+
+    // the rows of a FASTA alignment as read: empty rows of name lines without one (e.g.
+    // comments) dropped with their names, and the lower case letters and '.' either left out
+    // (A2M: the rows differ in length but every row has as many match columns, upper case
+    // letters and '-') or folded, so that rows of one length are read as aligned whatever
+    // their case and gap character
+    void resolve_inserts(vector<string> & MSA, vector<string> & names, bool inserts) {
+        bool named = names.size() == MSA.size();
+        size_t kept = 0;
+        for (size_t k = 0; k < MSA.size(); k++) {
+            if (MSA[k].empty()) continue;
+            if (kept != k) {
+                MSA[kept].swap(MSA[k]);
+                if (named) names[kept].swap(names[k]);
+            }
+            kept++;
+        }
+        MSA.resize(kept);
+        if (named) names.resize(kept);
+        if (!inserts) return;
+
+        bool ragged = false;
+        for (auto & row : MSA)
+            if (row.size() != MSA[0].size()) ragged = true;
+        if (!ragged) return fold_case(MSA);
+
+        // an alignment all in lower case has no match columns to keep
+        bool upper = false;
+        size_t matches = 0;
+        for (auto & row : MSA) {
+            size_t count = 0;
+            for (char c : row)
+                if (!islower((unsigned char)c) && c != '.') {
+                    count++;
+                    if (c != '-') upper = true;
+                }
+            if (&row == &MSA[0]) matches = count;
+            else if (count != matches) return fold_case(MSA);
+        }
+        if (!upper) return fold_case(MSA);
+        format = "A2M";
+        for (auto & row : MSA)
+            row.erase(remove_if(row.begin(), row.end(), [](char c) { return islower((unsigned char)c) || c == '.'; }), row.end());
+    };
+
+    // the lower case letters and '.' kept by read_fasta as for the other formats
+    static void fold_case(vector<string> & MSA) {
+        for (auto & row : MSA)
+            for (auto & c : row) {
+                if (c == '.') c = '-';
+                else c = toupper((unsigned char)c);
+            }
+    };
+
+    // Stockholm or Clustal: "name row" lines, the rows of a name over the blocks in order
+    void read_blocks(vector<string> & MSA, vector<string> & names, bool clustal) {
+        format = clustal ? "Clustal" : "Stockholm";
+        map<string, int> row_of;
+        string line;
+        while (read_line(line)) {
+            if (line == "//") break;
+            if (blank(line)) continue;
+            if (line[0] == '#') {
+                if (line.compare(0, 8, "#=GF ID ") == 0) {
+                    id = line.substr(8);
+                    id.erase(0, id.find_first_not_of(" \t"));
+                }
+                continue;
+            }
+            if (clustal && isspace((unsigned char)line[0])) continue; // conservation line
+
+            const char * text = line.c_str();
+            const char * name_end = text;
+            while (*name_end != 0 && !isspace((unsigned char)*name_end)) name_end++;
+            const char * row_begin = name_end;
+            while (*row_begin != 0 && isspace((unsigned char)*row_begin)) row_begin++;
+            const char * row_end = text + line.size();
+            if (clustal) {
+                // a trailing residue count
+                const char * last = row_end;
+                while (last > row_begin && isdigit((unsigned char)last[-1])) last--;
+                if (last < row_end && last > row_begin && isspace((unsigned char)last[-1])) row_end = last;
+            }
+
+            string name(text, name_end);
+            auto found = row_of.find(name);
+            if (found == row_of.end()) {
+                found = row_of.insert(make_pair(name, (int)MSA.size())).first;
+                MSA.push_back("");
+                names.push_back(">" + name);
+            }
+            append_row(MSA[found->second], row_begin, row_end, false);
+        }
+    };
+};
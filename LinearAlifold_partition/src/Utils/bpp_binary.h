@@ -0,0 +1,175 @@
+// binary base pair probabilities (--bpp_format binary / binary16): the pairs of an alignment as
+// a sparse matrix, written and loaded without formatting or parsing text. A file is one record
+// per alignment (records are appended in -o mode, as the text matrices are); a record can be
+// skipped without reading it and, within a record, the pairs of a row are found from its offset.
+//
+// record layout, in host byte order, every section padded to 8 bytes:
+//   BPPRecordHeader
+//   names        names_size bytes, the '>' / ';' lines of the input, one per line
+//   row offsets  uint64[length + 1]: the pairs (i, j) of row i (1-based) are the entries
+//                row_offsets[i - 1] .. row_offsets[i] - 1
+//   j            uint32[num_pairs], 1-based, by i then j
+//   prob         float32[num_pairs], or uint16[num_pairs] of round(prob * 65535) with
+//                BPP_QUANTISED (at most 7.7e-6 off)
+// Columns are those of the input, also with --compress_gaps. python/linearalifold/bpp.py reads
+// the same files.
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BPP_BINARY_MAGIC "LAFBPP\0\0"
+#define BPP_BINARY_VERSION 1
+#define BPP_QUANTISED 1
+
+struct BPPRecordHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;       // BPP_QUANTISED
+    uint32_t length;      // columns
+    uint32_t names_size;
+    uint64_t num_pairs;
+    uint64_t record_size; // bytes, header included: the next record starts there
+};
+
+static inline size_t bpp_binary_pad(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+// one record of pairs ((i, j), prob), 1-based and sorted by i then j, appended to out
+template <typename Prob>
+void append_binary_bpp(string & out, const vector<pair<pair<int, int>, Prob>> & pairs, int length, const vector<string> & names, bool quantised) {
+    string names_blob;
+    for (auto & name : names) names_blob += name + "\n";
+
+    size_t num_pairs = pairs.size();
+    vector<uint64_t> row_offsets(length + 1, 0);
+    vector<uint32_t> j(num_pairs);
+    for (size_t e = 0; e < num_pairs; e++) {
+        row_offsets[pairs[e].first.first]++;
+        j[e] = pairs[e].first.second;
+    }
+    for (int i = 1; i <= length; i++) row_offsets[i] += row_offsets[i - 1];
+
+    vector<float> prob32;
+    vector<uint16_t> prob16;
+    if (quantised) {
+        prob16.resize(num_pairs);
+        for (size_t e = 0; e < num_pairs; e++) prob16[e] = (uint16_t)lround(min(1.0, max(0.0, (double)pairs[e].second)) * 65535);
+    }
+    else {
+        prob32.resize(num_pairs);
+        for (size_t e = 0; e < num_pairs; e++) prob32[e] = pairs[e].second;
+    }
+    size_t prob_size = num_pairs * (quantised ? sizeof(uint16_t) : sizeof(float));
+
+    BPPRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BPP_BINARY_MAGIC, 8);
+    header.version = BPP_BINARY_VERSION;
+    header.flags = quantised ? BPP_QUANTISED : 0;
+    header.length = length;
+    header.names_size = names_blob.size();
+    header.num_pairs = num_pairs;
+    header.record_size = sizeof(header) + bpp_binary_pad(names_blob.size()) + (length + 1) * sizeof(uint64_t)
+        + bpp_binary_pad(num_pairs * sizeof(uint32_t)) + bpp_binary_pad(prob_size);
+
+    out.reserve(out.size() + header.record_size);
+    auto append_padded = [&](const void * data, size_t size) {
+        out.append((const char *)data, size);
+        out.append(bpp_binary_pad(size) - size, '\0');
+    };
+    out.append((const char *)&header, sizeof(header));
+    append_padded(names_blob.data(), names_blob.size());
+    out.append((const char *)row_offsets.data(), (length + 1) * sizeof(uint64_t));
+    append_padded(j.data(), num_pairs * sizeof(uint32_t));
+    append_padded(quantised ? (const void *)prob16.data() : (const void *)prob32.data(), prob_size);
+}
+
+// the same, to fptr
+template <typename Prob>
+bool write_binary_bpp(FILE * fptr, const vector<pair<pair<int, int>, Prob>> & pairs, int length, const vector<string> & names, bool quantised) {
+    string record;
+    append_binary_bpp(record, pairs, length, names, quantised);
+    fwrite(record.data(), 1, record.size(), fptr);
+    return !ferror(fptr);
+}
+
+// a record of a mapped file
+struct BPPRecord {
+    const BPPRecordHeader * header;
+    const char * names;
+    const uint64_t * row_offsets;
+    const uint32_t * j;
+    const void * prob;
+
+    double probability(uint64_t e) const {
+        if (header->flags & BPP_QUANTISED) return ((const uint16_t *)prob)[e] / 65535.0;
+        return ((const float *)prob)[e];
+    };
+
+    // of pair (i, j), 1-based; 0 if it was not written (below the cutoff)
+    double get(int i, int j_) const {
+        if (i < 1 || i > (int)header->length) return 0;
+        const uint32_t * begin = j + row_offsets[i - 1], * end = j + row_offsets[i];
+        const uint32_t * found = lower_bound(begin, end, (uint32_t)j_);
+        return (found != end && *found == (uint32_t)j_) ? probability(found - j) : 0;
+    };
+
+    // the record at data (available bytes, 8-byte aligned); false if it is not one of this version
+    bool read(const char * data, size_t available) {
+        header = (const BPPRecordHeader *)data;
+        if (available < sizeof(BPPRecordHeader) || memcmp(header->magic, BPP_BINARY_MAGIC, 8) != 0
+            || header->version != BPP_BINARY_VERSION || header->record_size > available) return false;
+        size_t num_pairs = header->num_pairs;
+        const char * cursor = data + sizeof(BPPRecordHeader);
+        names = cursor;
+        cursor += bpp_binary_pad(header->names_size);
+        row_offsets = (const uint64_t *)cursor;
+        cursor += (header->length + 1) * sizeof(uint64_t);
+        j = (const uint32_t *)cursor;
+        cursor += bpp_binary_pad(num_pairs * sizeof(uint32_t));
+        prob = cursor;
+        cursor += bpp_binary_pad(num_pairs * ((header->flags & BPP_QUANTISED) ? sizeof(uint16_t) : sizeof(float)));
+        return cursor == data + header->record_size;
+    };
+};
+
+// a binary bpp file, mapped; records point into the mapping
+struct BPPFile {
+    vector<BPPRecord> records;
+    void * map_base;
+    size_t map_size;
+
+    BPPFile(): map_base(NULL), map_size(0) {};
+    ~BPPFile() { if (map_base != NULL) munmap(map_base, map_size); };
+
+    // false if path is not a binary bpp file of this version
+    bool open(const string & path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void * base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) return false;
+        map_base = base;
+        map_size = st.st_size;
+
+        records.clear();
+        for (size_t offset = 0; offset < map_size; ) {
+            BPPRecord record;
+            if (!record.read((const char *)base + offset, map_size - offset)) return false;
+            records.push_back(record);
+            offset += record.header->record_size;
+        }
+        return true;
+    };
+};
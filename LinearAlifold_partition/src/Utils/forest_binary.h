@@ -0,0 +1,199 @@
+// binary forest (--forest_format binary): the states of the beams dumped by --dumpforest (the
+// inside, and with outside the inside-outside, log partition functions of every P, M, M2 and
+// Multi state kept), as arrays that are mapped back with mmap instead of parsing the text dump.
+// With outside, as for the text dump, a state is kept if alpha + beta > log Z - threshold
+// (--forest_threshold); an inside-only forest keeps every state.
+//
+// layout, in host byte order, every section padded to 8 bytes:
+//   ForestHeader
+//   seq        original_length bytes, the first row of the alignment
+//   columns    int32[length]: the original column (1-based) of every folded column, as they
+//              differ with --compress_gaps; i and j below are folded columns, 1-based
+//   E          float alpha[length], then float beta[length] with FOREST_OUTSIDE
+//   for P, M, M2 and Multi (FOREST_P .. FOREST_MULTI):
+//     offsets  uint64[length + 1]: the states (i, j) of column j are the entries
+//              offsets[j - 1] .. offsets[j] - 1
+//     i        uint32[num_states], by j then i
+//     alpha    float[num_states]
+//     beta     float[num_states], with FOREST_OUTSIDE
+// Values are float log partition functions; one never set (the -1.8e308 of the text dump, as the
+// beta of E at the first column) is -inf.
+// python/linearalifold/forest.py reads the same files.
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FOREST_MAGIC "LAFFORST"
+#define FOREST_VERSION 1
+#define FOREST_OUTSIDE 1
+
+enum ForestType { FOREST_P = 0, FOREST_M, FOREST_M2, FOREST_MULTI, FOREST_TYPES };
+
+struct ForestHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;                     // FOREST_OUTSIDE
+    uint32_t length;                    // folded columns
+    uint32_t original_length;
+    float log_z;                        // alpha of E at the last column
+    float threshold;                    // of the states kept with outside
+    uint64_t num_states[FOREST_TYPES];
+};
+
+static inline size_t forest_pad(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+// the beams beams[type][j] (j 0-based, keyed by 0-based i) and the E states bestC of a parse
+// of length columns to path; column_map as BeamCKYParser::column_map (empty: every column)
+template <typename State>
+bool write_binary_forest(const string & path, const string & seq, const vector<int> & column_map, int length, const State * bestC,
+                         unordered_map<int, State> * const beams[FOREST_TYPES], bool inside_only, double threshold) {
+    FILE * fptr = fopen(path.c_str(), "wb");
+    if (fptr == NULL) return false;
+    setvbuf(fptr, NULL, _IOFBF, 1 << 20);
+
+    double log_z = bestC[length - 1].alpha;
+    auto kept = [&](const State & state) { return inside_only || state.alpha + state.beta > log_z - threshold; };
+
+    ForestHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FOREST_MAGIC, 8);
+    header.version = FOREST_VERSION;
+    header.flags = inside_only ? 0 : FOREST_OUTSIDE;
+    header.length = length;
+    header.original_length = seq.size();
+    header.log_z = log_z;
+    header.threshold = threshold;
+    for (int type = 0; type < FOREST_TYPES; type++)
+        for (int j = 0; j < length; j++)
+            for (auto & item : beams[type][j])
+                if (kept(item.second)) header.num_states[type]++;
+
+    const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    auto write_padded = [&](const void * data, size_t size) {
+        fwrite(data, 1, size, fptr);
+        fwrite(zeros, 1, forest_pad(size) - size, fptr);
+    };
+    fwrite(&header, sizeof(header), 1, fptr);
+    write_padded(seq.data(), seq.size());
+    vector<int32_t> columns(length);
+    for (int j = 0; j < length; j++) columns[j] = (column_map.empty() ? j : column_map[j]) + 1;
+    write_padded(columns.data(), length * sizeof(int32_t));
+    vector<float> values(length);
+    for (int j = 0; j < length; j++) values[j] = bestC[j].alpha;
+    write_padded(values.data(), length * sizeof(float));
+    if (!inside_only) {
+        for (int j = 0; j < length; j++) values[j] = bestC[j].beta;
+        write_padded(values.data(), length * sizeof(float));
+    }
+
+    // a beam type at a time, so that only its arrays are held besides the beams
+    for (int type = 0; type < FOREST_TYPES; type++) {
+        size_t num = header.num_states[type];
+        vector<uint64_t> offsets(length + 1, 0);
+        vector<uint32_t> is;
+        vector<float> alpha, beta;
+        is.reserve(num);
+        alpha.reserve(num);
+        if (!inside_only) beta.reserve(num);
+        vector<pair<int, const State *>> column;
+        for (int j = 0; j < length; j++) {
+            column.clear();
+            for (auto & item : beams[type][j])
+                if (kept(item.second)) column.push_back(make_pair(item.first, &item.second));
+            sort(column.begin(), column.end());
+            for (auto & item : column) {
+                is.push_back(item.first + 1);
+                alpha.push_back(item.second->alpha);
+                if (!inside_only) beta.push_back(item.second->beta);
+            }
+            offsets[j + 1] = is.size();
+        }
+        fwrite(offsets.data(), sizeof(uint64_t), length + 1, fptr);
+        write_padded(is.data(), num * sizeof(uint32_t));
+        write_padded(alpha.data(), num * sizeof(float));
+        if (!inside_only) write_padded(beta.data(), num * sizeof(float));
+    }
+
+    bool ok = !ferror(fptr);
+    return fclose(fptr) == 0 && ok;
+}
+
+// the states of a beam type in a mapped forest
+struct ForestStates {
+    const uint64_t * offsets;
+    const uint32_t * i;
+    const float * alpha;
+    const float * beta;   // NULL without FOREST_OUTSIDE
+
+    // the entry of state (i, j), 1-based folded columns; -1 if it is not in the forest
+    long find(int i_, int j) const {
+        const uint32_t * begin = i + offsets[j - 1], * end = i + offsets[j];
+        const uint32_t * found = lower_bound(begin, end, (uint32_t)i_);
+        return (found != end && *found == (uint32_t)i_) ? found - i : -1;
+    };
+};
+
+// a binary forest file, mapped; the arrays point into the mapping
+struct ForestFile {
+    const ForestHeader * header;
+    const char * seq;
+    const int32_t * columns;
+    const float * E_alpha;
+    const float * E_beta;       // NULL without FOREST_OUTSIDE
+    ForestStates states[FOREST_TYPES];
+    void * map_base;
+    size_t map_size;
+
+    ForestFile(): header(NULL), map_base(NULL), map_size(0) {};
+    ~ForestFile() { if (map_base != NULL) munmap(map_base, map_size); };
+
+    // false if path is not a binary forest of this version
+    bool open(const string & path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ForestHeader)) {
+            close(fd);
+            return false;
+        }
+        void * base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) return false;
+        map_base = base;
+        map_size = st.st_size;
+
+        header = (const ForestHeader *)base;
+        if (memcmp(header->magic, FOREST_MAGIC, 8) != 0 || header->version != FOREST_VERSION) return false;
+        bool outside = header->flags & FOREST_OUTSIDE;
+        size_t length = header->length;
+        size_t expected = sizeof(ForestHeader) + forest_pad(header->original_length) + forest_pad(length * 4) * (outside ? 3 : 2);
+        for (int type = 0; type < FOREST_TYPES; type++)
+            expected += (length + 1) * 8 + forest_pad(header->num_states[type] * 4) * (outside ? 3 : 2);
+        if (expected != map_size) return false;
+
+        const char * cursor = (const char *)base + sizeof(ForestHeader);
+        auto next = [&](size_t size) {
+            const char * data = cursor;
+            cursor += forest_pad(size);
+            return data;
+        };
+        seq = next(header->original_length);
+        columns = (const int32_t *)next(length * 4);
+        E_alpha = (const float *)next(length * 4);
+        E_beta = outside ? (const float *)next(length * 4) : NULL;
+        for (int type = 0; type < FOREST_TYPES; type++) {
+            size_t num = header->num_states[type];
+            states[type].offsets = (const uint64_t *)next((length + 1) * 8);
+            states[type].i = (const uint32_t *)next(num * 4);
+            states[type].alpha = (const float *)next(num * 4);
+            states[type].beta = outside ? (const float *)next(num * 4) : NULL;
+        }
+        return true;
+    };
+};
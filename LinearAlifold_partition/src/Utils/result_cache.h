@@ -0,0 +1,221 @@
+// result cache (--cache DIR): the results of alignments folded before, looked up before anything
+// is prepared or folded, so that an alignment submitted again with the same options is not folded
+// again. Entries are keyed by a 128-bit FNV-1a hash of the engine's options text (every option
+// that changes a result, and a checksum of the energy parameters: the binary, which has them
+// compiled in, and with bin/linearalifold the energy_data file it reads) and of the rows of the
+// alignment as the reader normalised them (upper case, U for T). What the results are is up to
+// the engine. The same directory works for bin/linearalifold and bin/linearalifold_p.
+//
+// An entry is the file DIR/<key in hex>, written to a temporary file and renamed, so that runs
+// and server threads sharing DIR never read a partial one; a hit compares the options text of
+// the entry and touches its modification time. Once the entries of DIR exceed the size bound
+// (--cache_size) the least recently used ones are removed, down to 90% of it.
+//
+// entry layout, in host byte order:
+//   ResultCacheHeader
+//   options    options_size bytes
+//   results    results_size bytes
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#define RESULT_CACHE_MAGIC "LAFCACHE"
+#define RESULT_CACHE_VERSION 1
+
+struct ResultCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t options_size;
+    uint64_t results_size;
+};
+
+// FNV-1a, 128 bits
+struct CacheKey {
+    unsigned __int128 hash;
+
+    CacheKey() {
+        hash = ((unsigned __int128)0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL;
+    };
+
+    void add(const void * data, size_t size) {
+        const unsigned __int128 prime = ((unsigned __int128)1 << 88) | 0x13b;
+        const unsigned char * bytes = (const unsigned char *)data;
+        unsigned __int128 h = hash;
+        for (size_t k = 0; k < size; k++) {
+            h ^= bytes[k];
+            h *= prime;
+        }
+        hash = h;
+    };
+
+    // a string and its end, so that ("ab", "c") and ("a", "bc") differ
+    void add(const string & text) {
+        add(text.data(), text.size());
+        add("\n", 1);
+    };
+
+    // the contents of the file at path; false if it cannot be read
+    bool add_file(const string & path) {
+        FILE * fptr = fopen(path.c_str(), "rb");
+        if (fptr == NULL) return false;
+        vector<char> buffer(1 << 16);
+        size_t size;
+        while ((size = fread(buffer.data(), 1, buffer.size(), fptr)) > 0) add(buffer.data(), size);
+        bool ok = !ferror(fptr);
+        fclose(fptr);
+        return ok;
+    };
+
+    string hex() const {
+        char text[33];
+        snprintf(text, sizeof(text), "%016llx%016llx", (unsigned long long)(hash >> 64), (unsigned long long)hash);
+        return text;
+    };
+};
+
+// the key of the rows of MSA folded with options (of the same engine and parameters)
+static inline string result_cache_key(const string & options, const vector<string> & MSA) {
+    CacheKey key;
+    key.add(options);
+    for (auto & row : MSA) key.add(row);
+    return key.hex();
+}
+
+// a checksum of the binary running, and of the files given (the energy parameters it reads), for
+// the options text: results of another build or other parameters are other entries
+static inline string result_cache_checksum(const vector<string> & files) {
+    CacheKey key;
+    if (!key.add_file("/proc/self/exe")) key.add(string(__DATE__ " " __TIME__));
+    for (auto & file : files)
+        if (!key.add_file(file)) key.add("missing " + file);
+    return key.hex();
+}
+
+class ResultCache {
+public:
+    ResultCache(): max_bytes(0), total_bytes(0), next_temporary(0) {};
+
+    bool enabled() const { return !dir.empty(); };
+
+    // use (and make) the directory path with at most max_bytes of entries; false if it cannot be made
+    bool open(const string & path, uint64_t max_bytes_) {
+        if (mkdir(path.c_str(), 0777) != 0 && errno != EEXIST) return false;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) return false;
+        dir = path;
+        max_bytes = max_bytes_;
+        vector<Entry> entries;
+        total_bytes = scan(entries);
+        return true;
+    };
+
+    // the results of the entry key made with options; false if there is none
+    bool load(const string & key, const string & options, string & results) {
+        string path = dir + "/" + key;
+        FILE * fptr = fopen(path.c_str(), "rb");
+        if (fptr == NULL) return false;
+        ResultCacheHeader header;
+        bool ok = fread(&header, sizeof(header), 1, fptr) == 1 && memcmp(header.magic, RESULT_CACHE_MAGIC, 8) == 0
+            && header.version == RESULT_CACHE_VERSION && header.options_size == options.size();
+        if (ok) {
+            string stored(header.options_size, '\0');
+            results.resize(header.results_size);
+            ok = fread(&stored[0], 1, stored.size(), fptr) == stored.size() && stored == options
+                && fread(&results[0], 1, results.size(), fptr) == results.size() && fgetc(fptr) == EOF;
+        }
+        fclose(fptr);
+        if (ok) utimensat(AT_FDCWD, path.c_str(), NULL, 0); // most recently used
+        return ok;
+    };
+
+    // results as the entry key made with options, then the least recently used entries removed
+    // if the directory is over its bound; false if the entry could not be written
+    bool store(const string & key, const string & options, const string & results) {
+        ResultCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, RESULT_CACHE_MAGIC, 8);
+        header.version = RESULT_CACHE_VERSION;
+        header.options_size = options.size();
+        header.results_size = results.size();
+
+        string temporary = dir + "/.tmp." + to_string(getpid()) + "." + to_string(next_temporary++);
+        FILE * fptr = fopen(temporary.c_str(), "wb");
+        if (fptr == NULL) return false;
+        fwrite(&header, sizeof(header), 1, fptr);
+        fwrite(options.data(), 1, options.size(), fptr);
+        fwrite(results.data(), 1, results.size(), fptr);
+        bool ok = !ferror(fptr);
+        ok = fclose(fptr) == 0 && ok;
+        if (!ok || rename(temporary.c_str(), (dir + "/" + key).c_str()) != 0) {
+            unlink(temporary.c_str());
+            return false;
+        }
+
+        lock_guard<mutex> lock(evict_mutex);
+        total_bytes += sizeof(header) + options.size() + results.size();
+        if (total_bytes > max_bytes) evict();
+        return true;
+    };
+
+private:
+    struct Entry {
+        struct timespec used;
+        uint64_t size;
+        string name;
+    };
+
+    string dir;
+    uint64_t max_bytes;
+    uint64_t total_bytes;   // of the entries, as of the last scan and the entries stored since
+    atomic<unsigned long> next_temporary;
+    mutex evict_mutex;
+
+    static bool is_key(const char * name) {
+        if (strlen(name) != 32) return false;
+        for (const char * c = name; *c; c++)
+            if (!isxdigit((unsigned char)*c)) return false;
+        return true;
+    };
+
+    // the entries of dir (also those of other runs) and their bytes
+    uint64_t scan(vector<Entry> & entries) {
+        uint64_t total = 0;
+        DIR * listing = opendir(dir.c_str());
+        if (listing == NULL) return 0;
+        struct dirent * item;
+        while ((item = readdir(listing)) != NULL) {
+            if (!is_key(item->d_name)) continue;
+            struct stat st;
+            string name = dir + "/" + item->d_name;
+            if (stat(name.c_str(), &st) != 0) continue;
+            entries.push_back(Entry{st.st_mtim, (uint64_t)st.st_size, name});
+            total += st.st_size;
+        }
+        closedir(listing);
+        return total;
+    };
+
+    // the least recently used entries removed until 90% of max_bytes are left
+    void evict() {
+        vector<Entry> entries;
+        total_bytes = scan(entries);
+        sort(entries.begin(), entries.end(), [](const Entry & a, const Entry & b) {
+            return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+        });
+        uint64_t target = max_bytes / 10 * 9;
+        for (auto & entry : entries) {
+            if (total_bytes <= target) break;
+            if (unlink(entry.name.c_str()) == 0) total_bytes -= entry.size;
+        }
+    };
+};
@@ -0,0 +1,288 @@
+// result container (--container): the results of every alignment of a batch in one file instead
+// of a file per alignment and output (--prefix, --mea_prefix, --threshknot_prefix). Records are
+// appended in input order by one writer thread, behind a buffered stream, while the next alignment
+// is folded; an index by alignment name closes the file. python/linearalifold/container.py reads
+// the same files.
+//
+// layout, in host byte order, every section padded to 8 bytes:
+//   ContainerHeader
+//   records, one per alignment:
+//     ContainerRecordHeader
+//     name         name_size bytes: #=GF ID of Stockholm, or "alignment N" (N from 1)
+//     mfe          mfe_size bytes: joint MFE structure (--mfe), dot-bracket
+//     mea          mea_size bytes: MEA structure (-M), dot-bracket
+//     threshknot   int32[2 * num_threshknot]: ThreshKnot pairs (-T) i j, 1-based, i < j
+//     bpp          bpp_size bytes: a binary bpp record (see bpp_binary.h), none with -p
+//   index        ContainerIndexEntry[num_records], by name (then input order)
+//   index names  the names of the entries, one after the other
+//   ContainerFooter
+// Columns are those of the input, also with --compress_gaps. A file without its footer (a run
+// that did not finish) still has every record written up to there, one after the other.
+
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#define CONTAINER_MAGIC "LAFCONT\0"
+#define CONTAINER_FOOTER_MAGIC "LAFCIDX\0"
+#define CONTAINER_VERSION 1
+
+struct ContainerHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct ContainerRecordHeader {
+    uint64_t record_size;     // bytes, header included: the next record starts there
+    double ensemble_energy;   // kcal/mol per sequence
+    double mfe_energy;        // kcal/mol per sequence, free energy + covariance, with --mfe
+    double mfe_covariance;
+    uint32_t name_size;
+    uint32_t mfe_size;
+    uint32_t mea_size;
+    uint32_t num_threshknot;
+    uint64_t bpp_size;
+};
+
+struct ContainerIndexEntry {
+    uint64_t record_offset;
+    uint64_t name_offset;     // in the index names
+    uint32_t name_size;
+    uint32_t reserved;
+};
+
+struct ContainerFooter {
+    uint64_t index_offset;
+    uint64_t num_records;
+    char magic[8];
+};
+
+static inline size_t container_pad(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+static inline void container_append(string & out, const void * data, size_t size) {
+    out.append((const char *)data, size);
+    out.append(container_pad(size) - size, '\0');
+}
+
+// one record, with threshknot as i -> j and j -> i (as BeamCKYParser::threshknot_pairs) and bpp
+// a record of append_binary_bpp or empty
+string container_record(const string & name, double ensemble_energy, const string & mfe, double mfe_energy, double mfe_covariance,
+                        const string & mea, const map<int, int> & threshknot, const string & bpp) {
+    vector<int32_t> knots;
+    for (auto & item : threshknot)
+        if (item.first < item.second) {
+            knots.push_back(item.first);
+            knots.push_back(item.second);
+        }
+
+    ContainerRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.ensemble_energy = ensemble_energy;
+    header.mfe_energy = mfe_energy;
+    header.mfe_covariance = mfe_covariance;
+    header.name_size = name.size();
+    header.mfe_size = mfe.size();
+    header.mea_size = mea.size();
+    header.num_threshknot = knots.size() / 2;
+    header.bpp_size = bpp.size();
+    header.record_size = sizeof(header) + container_pad(name.size()) + container_pad(mfe.size()) + container_pad(mea.size())
+        + container_pad(knots.size() * sizeof(int32_t)) + bpp.size();
+
+    string record;
+    record.reserve(header.record_size);
+    record.append((const char *)&header, sizeof(header));
+    container_append(record, name.data(), name.size());
+    container_append(record, mfe.data(), mfe.size());
+    container_append(record, mea.data(), mea.size());
+    container_append(record, knots.data(), knots.size() * sizeof(int32_t));
+    record.append(bpp);
+    return record;
+}
+
+// writes the records given to add from its own thread; close writes the index
+class ContainerWriter {
+public:
+    ContainerWriter(): fptr(NULL), offset(0), queued(0), closing(false), failed(false) {};
+    ~ContainerWriter() { close(); };
+
+    bool open(const string & path) {
+        fptr = fopen(path.c_str(), "wb");
+        if (fptr == NULL) return false;
+        setvbuf(fptr, NULL, _IOFBF, 1 << 20);
+        ContainerHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CONTAINER_MAGIC, 8);
+        header.version = CONTAINER_VERSION;
+        fwrite(&header, sizeof(header), 1, fptr);
+        offset = sizeof(header);
+        writer = thread(&ContainerWriter::run, this);
+        return true;
+    };
+
+    // queue record (of container_record) of the alignment name; waits while more than
+    // max_queued bytes are queued, so that folding does not run far ahead of the disk
+    void add(const string & name, string && record) {
+        unique_lock<mutex> lock(queue_mutex);
+        queue_space.wait(lock, [&]() { return queued < max_queued || queue.empty(); });
+        queued += record.size();
+        queue.push_back(make_pair(name, std::move(record)));
+        queue_ready.notify_one();
+    };
+
+    // the records queued written, then the index; false if any write failed
+    bool close() {
+        if (fptr == NULL) return !failed;
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            closing = true;
+            queue_ready.notify_one();
+        }
+        writer.join();
+
+        sort(index.begin(), index.end(), [](const pair<string, uint64_t> & a, const pair<string, uint64_t> & b) {
+            return a.first != b.first ? a.first < b.first : a.second < b.second;
+        });
+        string names_blob;
+        vector<ContainerIndexEntry> entries(index.size());
+        for (size_t k = 0; k < index.size(); k++) {
+            memset(&entries[k], 0, sizeof(ContainerIndexEntry));
+            entries[k].record_offset = index[k].second;
+            entries[k].name_offset = names_blob.size();
+            entries[k].name_size = index[k].first.size();
+            names_blob += index[k].first;
+        }
+        ContainerFooter footer;
+        memset(&footer, 0, sizeof(footer));
+        footer.index_offset = offset;
+        footer.num_records = index.size();
+        memcpy(footer.magic, CONTAINER_FOOTER_MAGIC, 8);
+        string tail;
+        container_append(tail, entries.data(), entries.size() * sizeof(ContainerIndexEntry));
+        container_append(tail, names_blob.data(), names_blob.size());
+        tail.append((const char *)&footer, sizeof(footer));
+        fwrite(tail.data(), 1, tail.size(), fptr);
+
+        failed |= ferror(fptr) != 0;
+        failed |= fclose(fptr) != 0;
+        fptr = NULL;
+        return !failed;
+    };
+
+private:
+    static const size_t max_queued = 64 << 20;
+
+    FILE * fptr;
+    thread writer;
+    mutex queue_mutex;
+    condition_variable queue_ready, queue_space;
+    deque<pair<string, string>> queue;
+    size_t queued;
+    bool closing;
+
+    // written by the writer thread, read by close after it is joined
+    uint64_t offset;
+    vector<pair<string, uint64_t>> index;
+    bool failed;
+
+    void run() {
+        while (true) {
+            pair<string, string> item;
+            {
+                unique_lock<mutex> lock(queue_mutex);
+                queue_ready.wait(lock, [&]() { return closing || !queue.empty(); });
+                if (queue.empty()) return;
+                item = std::move(queue.front());
+                queue.pop_front();
+                queued -= item.second.size();
+                queue_space.notify_one();
+            }
+            index.push_back(make_pair(item.first, offset));
+            if (fwrite(item.second.data(), 1, item.second.size(), fptr) != item.second.size()) failed = true;
+            offset += item.second.size();
+        }
+    };
+};
+
+// a record of a mapped container
+struct ContainerRecord {
+    const ContainerRecordHeader * header;
+    string name, mfe, mea;
+    const int32_t * threshknot; // num_threshknot pairs i j
+    BPPRecord bpp;              // bpp.header is NULL if there is none
+};
+
+// a container file, mapped; find looks a name up in the index
+struct ContainerFile {
+    void * map_base;
+    size_t map_size;
+    const ContainerIndexEntry * entries;
+    const char * index_names;
+    size_t num_records;
+
+    ContainerFile(): map_base(NULL), map_size(0), entries(NULL), index_names(NULL), num_records(0) {};
+    ~ContainerFile() { if (map_base != NULL) munmap(map_base, map_size); };
+
+    // false if path is not a complete container of this version
+    bool open(const string & path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)(sizeof(ContainerHeader) + sizeof(ContainerFooter))) {
+            close(fd);
+            return false;
+        }
+        void * base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) return false;
+        map_base = base;
+        map_size = st.st_size;
+
+        const ContainerHeader * header = (const ContainerHeader *)base;
+        const ContainerFooter * footer = (const ContainerFooter *)((const char *)base + map_size - sizeof(ContainerFooter));
+        if (memcmp(header->magic, CONTAINER_MAGIC, 8) != 0 || header->version != CONTAINER_VERSION
+            || memcmp(footer->magic, CONTAINER_FOOTER_MAGIC, 8) != 0
+            || footer->index_offset + footer->num_records * sizeof(ContainerIndexEntry) > map_size - sizeof(ContainerFooter)) return false;
+        num_records = footer->num_records;
+        entries = (const ContainerIndexEntry *)((const char *)base + footer->index_offset);
+        index_names = (const char *)entries + container_pad(num_records * sizeof(ContainerIndexEntry));
+        return true;
+    };
+
+    string name(size_t k) const {
+        return string(index_names + entries[k].name_offset, entries[k].name_size);
+    };
+
+    // the k-th record by name (0 .. num_records - 1)
+    bool record(size_t k, ContainerRecord & record) const {
+        const char * data = (const char *)map_base + entries[k].record_offset;
+        record.header = (const ContainerRecordHeader *)data;
+        const char * cursor = data + sizeof(ContainerRecordHeader);
+        record.name.assign(cursor, record.header->name_size);
+        cursor += container_pad(record.header->name_size);
+        record.mfe.assign(cursor, record.header->mfe_size);
+        cursor += container_pad(record.header->mfe_size);
+        record.mea.assign(cursor, record.header->mea_size);
+        cursor += container_pad(record.header->mea_size);
+        record.threshknot = (const int32_t *)cursor;
+        cursor += container_pad(record.header->num_threshknot * 2 * sizeof(int32_t));
+        record.bpp.header = NULL;
+        return record.header->bpp_size == 0 || record.bpp.read(cursor, record.header->bpp_size);
+    };
+
+    // the first record (in input order) of the alignment name; false if there is none
+    bool find(const string & name_, ContainerRecord & found) const {
+        size_t lo = 0, hi = num_records;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (name(mid) < name_) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo < num_records && name(lo) == name_ && record(lo, found);
+    };
+};
@@ -170,7 +170,7 @@ inline double dangle_right_score(int nuci, int nucj_1, int nucj) {
 // ------------- length based scores -------------
 
 inline double hairpin_score(int i, int j) {
-    return hairpin_length[std::min(j-i-1, LOOP_MAX_LEN)];
+    return hairpin_length[std::min(j-i-1, HAIRPIN_MAX_LEN)];
 }
 
 inline double internal_length_score(int l) {
@@ -198,7 +198,7 @@ inline double bulge_length_score(int l){
 }
 
 inline double hairpin_at_least_score(int l) {
-    return hairpin_length_at_least[std::min(l, LOOP_MAX_LEN)];
+    return hairpin_length_at_least[std::min(l, HAIRPIN_MAX_LEN)];
 }
 
 inline double buldge_length_at_least_score(int l) {
@@ -222,11 +222,11 @@ inline double score_junction_B(int i, int j, int nuci, int nuci1, int nucj_1, in
 }
 
 inline double score_hairpin_length(int len) {
-  return hairpin_length[std::min(len, LOOP_MAX_LEN)];
+  return hairpin_length[std::min(len, HAIRPIN_MAX_LEN)];
 }
 
 inline double score_hairpin(int i, int j, int nuci, int nuci1, int nucj_1, int nucj) {
-    return hairpin_length[std::min(j-i-1, LOOP_MAX_LEN)] +
+    return hairpin_length[std::min(j-i-1, HAIRPIN_MAX_LEN)] +
             score_junction_B(i, j, nuci, nuci1, nucj_1, nucj);
 }
 
@@ -4,37 +4,52 @@
 #include <algorithm>
 #include "linearalifold_p.h"
 #include "Utils/ribo.h"
+#include "Utils/bpp_binary.h"
 
 using namespace std;
 
 void BeamCKYParser::output_to_file(string file_name, const char * type) {
     if(!file_name.empty()) {
         printf("Outputing base pairing probability matrix to %s...\n", file_name.c_str()); 
-        FILE *fptr = fopen(file_name.c_str(), type); 
+        FILE *fptr = (bpp_out != NULL && file_name == bpp_file) ? bpp_out : fopen(file_name.c_str(), type); 
         if (fptr == NULL) { 
             printf("Could not open file!\n"); 
             return; 
         }
 
+        if (bpp_format != BPP_TEXT) {
+            int length = column_map.empty() ? seq_length : original_seq.size();
+            if (!write_binary_bpp(fptr, bpp_pairs(), length, bpp_names, bpp_format == BPP_BINARY16)) printf("Could not write file!\n");
+            if (fptr != bpp_out) fclose(fptr);
+            printf("Done!\n");
+            return;
+        }
+
         // int turn = no_sharp_turn?3:0;
         for (int i = 1; i <= seq_length; i++) {
-            for (int j = i + turn + 1; j <= seq_length; j++) {
+            for (int j = i + 1; j <= seq_length; j++) {
+                if (column_distance(i-1, j-1) <= turn) continue;
                 pair<int, int> key = make_pair(i,j);
                 auto got = Pij.find(key);
                 if (got != Pij.end()){
-                    fprintf(fptr, "%d %d %.4e\n", i, j, got->second);
+                    fprintf(fptr, "%d %d %.4e\n", original_index(i-1)+1, original_index(j-1)+1, got->second);
                 }
             }
         }
         fprintf(fptr, "\n");
-        fclose(fptr); 
+        if (fptr != bpp_out) fclose(fptr); 
         printf("Done!\n"); 
     }
 
     return;
 }
 
-void BeamCKYParser::output_to_file_MEA_threshknot_bpseq(string file_name, const char * type, map<int,int>& pairs, string & seq) {
+void BeamCKYParser::output_to_file_MEA_threshknot_bpseq(string file_name, const char * type, const map<int,int>& pairs_, string & seq_) {
+
+    // pairs_ are in the original columns already (mea_structure, threshknot_pairs)
+    map<int,int> pairs = pairs_;
+    string & seq = column_map.empty() ? seq_ : original_seq;
+    int length = seq.size();
 
     int i,j;
     char nuc;
@@ -46,7 +61,7 @@ void BeamCKYParser::output_to_file_MEA_threshknot_bpseq(string file_name, const
             return; 
         }
 
-        for (int i = 1; i <= seq_length; i++) {
+        for (int i = 1; i <= length; i++) {
             if (pairs.find(i) != pairs.end()){
                 j = pairs[i];
             }
@@ -62,7 +77,7 @@ void BeamCKYParser::output_to_file_MEA_threshknot_bpseq(string file_name, const
         printf("Done!\n"); 
     }
     else{
-        for (int i = 1; i <= seq_length; i++) {
+        for (int i = 1; i <= length; i++) {
             if (pairs.find(i) != pairs.end()){
                 j = pairs[i];
             }
@@ -77,7 +92,7 @@ void BeamCKYParser::output_to_file_MEA_threshknot_bpseq(string file_name, const
 
 }
 
-void BeamCKYParser::cal_PairProb(State& viterbi, vector<vector<ribo_state>> & pscore) {
+void BeamCKYParser::cal_PairProb(State& viterbi, SpanTable<ribo_state> & pscore) {
     
     double kTn = double(kT) * MSA.size();
     
@@ -95,6 +110,11 @@ void BeamCKYParser::cal_PairProb(State& viterbi, vector<vector<ribo_state>> & ps
         }
     }
 
+    output_PairProb();
+    return;
+}
+
+void BeamCKYParser::output_PairProb() {
     // -o mode: output to a single file with user specified name;
     // bpp matrices for different sequences are separated with empty lines
     if (!bpp_file.empty()){
@@ -105,11 +125,10 @@ void BeamCKYParser::cal_PairProb(State& viterbi, vector<vector<ribo_state>> & ps
     else if (!bpp_file_index.empty()) {
         output_to_file(bpp_file_index, "w");
     }
-    return;
 }
 
 
-string BeamCKYParser::back_trace(const int i, const int j, const vector<vector<int> >& back_pointer){
+string BeamCKYParser::back_trace(const int i, const int j, SpanTable<int>& back_pointer){
 
     if (i>j) return "";
     if (back_pointer[i][j] == -1){
@@ -184,29 +203,28 @@ void BeamCKYParser::ThreshKnot(string & seq){
         }
     }
 
+    threshknot_pairs.clear();
+    for (auto & item : pairs) threshknot_pairs[original_index(item.first-1)+1] = original_index(item.second-1)+1;
+
     // fprintf(stdout, "%s\n", seq.c_str());
-    output_to_file_MEA_threshknot_bpseq(threshknot_file_index, "w", pairs, seq);
+    if (!keep_results) output_ThreshKnot(seq);
 }
 
+void BeamCKYParser::output_ThreshKnot(string & seq) {
+    output_to_file_MEA_threshknot_bpseq(threshknot_file_index, "w", threshknot_pairs, seq);
+}
 
-void BeamCKYParser::PairProb_MEA(string & seq) {
-    
-    vector<vector<pf_type> > OPT;
-    OPT.resize(seq_length);
-
-    for (int i = 0; i < seq_length; ++i) OPT[i].resize(seq_length);
-
-    vector<vector<pf_type>> P;
-    P.resize(seq_length);
 
-    for (int i = 0; i < seq_length; ++i) P[i].resize(seq_length);
+void BeamCKYParser::PairProb_MEA(string & seq) {
 
-    vector<vector<int> > back_pointer;
-    back_pointer.resize(seq_length);
+    // OPT[i][j] is only needed for j - i < span (pairs never span more), the external
+    // loop is the suffix recursion ext[i] (= OPT[i][seq_length-1] when span is off)
+    int width = (span > 0 && span < seq_length) ? span : seq_length;
 
-    for (int i = 0; i < seq_length; ++i) back_pointer[i].resize(seq_length);
+    SpanTable<pf_type> OPT(seq_length, width);
+    SpanTable<int> back_pointer(seq_length, width);
 
-    vector<vector<int>> paired;
+    vector<vector<pair<int, pf_type>>> paired;
     paired.resize(seq_length);
 
     vector<pf_type> Q;
@@ -217,15 +235,13 @@ void BeamCKYParser::PairProb_MEA(string & seq) {
         auto j = pij.first.second-1;
         auto score = pij.second;
 
-        P[i][j] = score;
-
-        paired[i].push_back(j);
+        paired[i].push_back(make_pair(j, score));
         Q[i] -= score;
         Q[j] -= score;
     }
 
     for (int i = 0; i < seq_length; ++i) std::sort (paired[i].begin(), paired[i].end());
-    for (int l = 0; l< seq_length; l++){
+    for (int l = 0; l < width; l++){
         for (int i = 0; i<seq_length - l; i++){
             int j = i + l;
             if (i == j){
@@ -235,12 +251,14 @@ void BeamCKYParser::PairProb_MEA(string & seq) {
             }
             OPT[i][j] = OPT[i][i] + OPT[i+1][j];
             back_pointer[i][j] = -1;
-            for (int k : paired[i]){
+            for (auto& kp : paired[i]){
+                int k = kp.first;
                 if (k>j) break;
                 pf_type temp_OPT_k1_j;
                 if (k<j) temp_OPT_k1_j = OPT[k+1][j];
                 else temp_OPT_k1_j = pf_type(0.);
-                auto temp_score = 2 * gamma * P[i][k] + OPT[i+1][k-1] + temp_OPT_k1_j;
+                pf_type temp_OPT_i1_k_1 = (k > i+1) ? OPT[i+1][k-1] : pf_type(0.);
+                auto temp_score = 2 * gamma * kp.second + temp_OPT_i1_k_1 + temp_OPT_k1_j;
                 if (OPT[i][j] < temp_score){
                     OPT[i][j] = temp_score;
                     back_pointer[i][j] = k;
@@ -249,8 +267,39 @@ void BeamCKYParser::PairProb_MEA(string & seq) {
         }
     }
 
-    auto structure = back_trace(0,seq_length-1, back_pointer);
+    vector<pf_type> ext(seq_length + 1, pf_type(0.));
+    vector<int> ext_pointer(seq_length, -1);
+    for (int i = seq_length - 1; i >= 0; --i){
+        ext[i] = Q[i] + ext[i+1];
+        for (auto& kp : paired[i]){
+            int k = kp.first;
+            pf_type temp_OPT_i1_k_1 = (k > i+1) ? OPT[i+1][k-1] : pf_type(0.);
+            auto temp_score = 2 * gamma * kp.second + temp_OPT_i1_k_1 + ext[k+1];
+            if (ext[i] < temp_score){
+                ext[i] = temp_score;
+                ext_pointer[i] = k;
+            }
+        }
+    }
 
+    string structure;
+    for (int i = 0; i < seq_length; ){
+        int k = ext_pointer[i];
+        if (k == -1){
+            structure += ".";
+            ++i;
+        }else{
+            structure += "(" + back_trace(i+1, k-1, back_pointer) + ")";
+            i = k + 1;
+        }
+    }
+
+    mea_structure = column_map.empty() ? structure : expand_structure(structure, column_map, original_seq.size());
+    if (!keep_results) output_MEA(seq);
+}
+
+void BeamCKYParser::output_MEA(string & seq) {
+    string structure = mea_structure;
     if (!bpseq){
         if(!mea_file_index.empty()) {
             FILE *fptr = fopen(mea_file_index.c_str(), "w"); 
@@ -260,6 +309,7 @@ void BeamCKYParser::PairProb_MEA(string & seq) {
             }
             // fprintf(fptr, "%s\n", seq.c_str());
             fprintf(fptr, "%s\n\n", structure.c_str());
+            fclose(fptr);
         }
 
         else{
@@ -275,12 +325,12 @@ void BeamCKYParser::PairProb_MEA(string & seq) {
 }
 
 
-void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_state>> & pscore, vector<float> & smart_gap, float smart_gap_threshold, vector<vector<int>> & next_position){
+void BeamCKYParser::outside_alifold(vector<int> next_pair[], SpanTable<ribo_state> & pscore, vector<float> & smart_gap, float smart_gap_threshold, SpanTable<int> & next_position){
       
     struct timeval bpp_starttime, bpp_endtime;
     gettimeofday(&bpp_starttime, NULL);
 
-    bestC[seq_length-1].beta = 0.0;
+    bestC[seq_length-1].beta = pf_one();
 
     int n_seq = MSA.size();
 
@@ -311,7 +361,7 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
         {
             // C = C + U
             if (j < seq_length-1) {
-            Fast_LogPlusEquals(beamstepC.beta, (bestC[j+1].beta));
+            pf_plus_equals(beamstepC.beta, pf_times(bestC[j+1].beta, pf_weight(0, j+1, j+1)));
             }
         }
     
@@ -321,7 +371,7 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                 int i = item.first;
                 State& state = item.second;
                 if (j < seq_length-1) {
-                    Fast_LogPlusEquals(state.beta, bestM[j+1][i].beta);
+                    pf_plus_equals(state.beta, pf_times(bestM[j+1][i].beta, pf_weight(0, j+1, j+1)));
                 }
             }
         }
@@ -337,6 +387,7 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                     auto smart_i = smart_gap[i-1];
 
                     for (int p = i-1; ((smart_i -  smart_gap[p]) <= 2*SINGLE_MAX_LEN) and p >= 0; --p) {
+                        if (!in_span(p, j + 1)) break;
                         if (smart_gap[p] - smart_gap[p-1] < smart_gap_threshold){
 
                             continue;
@@ -363,6 +414,7 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                             if (q == jnext_org){
                                 q = -1;
                             }
+                            if (!in_span(p, q)) q = -1;
                             next_position[p][j] = q;
                         }
 
@@ -388,19 +440,20 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                                 if (jnext_min != jnext_org) q = jnext_min;
                                 else q = -1;
 
+                                if (!in_span(p, q)) q = -1;
                                 next_position[p][prev_q] = q;
                             }
                         }
                         if (q != -1) {
 
-                            Fast_LogPlusEquals(state.beta, bestMulti[q][p].beta);
+                            pf_plus_equals(state.beta, pf_times(bestMulti[q][p].beta, pf_weight(0, p, q, i, j)));
 
                         }
                     }
                 }
 
                 // 2. M = M2
-                Fast_LogPlusEquals(state.beta, beamstepM[i].beta);
+                pf_plus_equals(state.beta, beamstepM[i].beta);
             }
         }
 
@@ -428,7 +481,8 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                         tt2[s] = NUM_TO_PAIR(SS_j[s], SS_i[s]);
                     }
 
-                    for (int p = i - 1; p >= std::max(i - SINGLE_MAX_LEN, 0); --p) {
+                    for (int p = i - 1; p >= 0 && column_distance(p, i) <= SINGLE_MAX_LEN; --p) {
+                        if (!in_span(p, j + 1)) break;
 
 
                         auto & SS_p = SS_fast[p];
@@ -457,11 +511,12 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                                 q = -1;
                             }
 
+                            if (!in_span(p, q)) q = -1;
                             next_position[p][j] = q;
 
                         }
 
-                        while (q != -1 && ((i - p) + (q - j) - 2 <= SINGLE_MAX_LEN)) {
+                        while (q != -1 && (column_distance(p, i) + column_distance(j, q) - 2 <= SINGLE_MAX_LEN)) {
 
                             auto & SS_q = SS_fast[q];
                             auto & s5_q = s5_fast[q];
@@ -491,7 +546,7 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                                         newscore += -v_score_single_alifold(0, 0, type, tt2[s], nucp1, nucq_1, nuci_1, nucj1);
                                     }
 
-                                    Fast_LogPlusEquals(state.beta, bestP[q][p].beta + newscore/kTn);
+                                    pf_plus_equals(state.beta, pf_times(bestP[q][p].beta, pf_weight(newscore/kTn, p, q, i, j)));
 
                                 } else {
                                     // single branch
@@ -521,7 +576,7 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                                         newscore += -v_score_single_alifold(u1_local, u2_local, type, tt2[s], nucp1, nucq_1, nuci_1, nucj1); 
 
                                     }
-                                    Fast_LogPlusEquals(state.beta, bestP[q][p].beta + newscore/kTn);
+                                    pf_plus_equals(state.beta, pf_times(bestP[q][p].beta, pf_weight(newscore/kTn, p, q, i, j)));
 
 
 
@@ -550,6 +605,7 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                                 }
                                 else q = temp_q;
 
+                                if (!in_span(p, q)) q = -1;
                                 next_position[p][prev_q] = q;
                             }
                         }
@@ -579,7 +635,7 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                     }
 
 
-                    Fast_LogPlusEquals(state.beta, beamstepM[i].beta + newscore/kTn);
+                    pf_plus_equals(state.beta, pf_times(beamstepM[i].beta, pf_weight(newscore/kTn)));
 
 
                 }
@@ -607,13 +663,29 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                         newscore += (- v_score_M1(-1, -1, -1, new_nuci_1, new_nuci, new_nucj, new_nucj1, -1));
                     }                    
 
-                    pf_type m1_alpha = newscore/kTn;
-                    pf_type m1_plus_P_alpha = state.alpha + m1_alpha;
-                    for (auto &m : bestM[k]) {
-                        int newi = m.first;
-                        State& m_state = m.second;
-                        Fast_LogPlusEquals(state.beta, (beamstepM2[newi].beta + m_state.alpha + m1_alpha));
-                        Fast_LogPlusEquals(m_state.beta, (beamstepM2[newi].beta + m1_plus_P_alpha));
+                    pf_type m1_alpha = pf_weight(newscore/kTn);
+                    pf_type m1_plus_P_alpha = pf_times(state.alpha, m1_alpha);
+                    // over the flat M beam of column k
+                    FlatBeam & flat = flatM[k];
+                    if (use_linear) {
+                        pf_type sum = 0;
+                        for (int m = 0; m < flat.i.size(); ++m) {
+                            int newi = flat.i[m];
+                            if (!in_span(newi-1, j+1)) continue;
+                            pf_type m2_beta = beamstepM2[newi].beta;
+                            sum += m2_beta * flat.alpha[m];
+                            flat.state[m]->beta += m2_beta * m1_plus_P_alpha;
+                        }
+                        state.beta += sum * m1_alpha;
+                    }
+                    else {
+                        for (int m = 0; m < flat.i.size(); ++m) {
+                            int newi = flat.i[m];
+                            if (!in_span(newi-1, j+1)) continue;
+                            pf_type m2_beta = beamstepM2[newi].beta;
+                            Fast_LogPlusEquals(state.beta, m2_beta + flat.alpha[m] + m1_alpha);
+                            Fast_LogPlusEquals(flat.state[m]->beta, m2_beta + m1_plus_P_alpha);
+                        }
                     }
                 }
 
@@ -644,10 +716,10 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                             newscore += (- v_score_external_paired(-1, -1, new_nuck, new_nuck1, new_nucj, new_nucj1, -1));
                         }      
 
-                        pf_type external_paired_alpha_plus_beamstepC_beta = beamstepC.beta + newscore/kTn;
+                        pf_type external_paired_alpha_plus_beamstepC_beta = pf_times(beamstepC.beta, pf_weight(newscore/kTn));
 
-                        Fast_LogPlusEquals(bestC[k].beta, state.alpha + external_paired_alpha_plus_beamstepC_beta);
-                        Fast_LogPlusEquals(state.beta, bestC[k].alpha + external_paired_alpha_plus_beamstepC_beta);
+                        pf_plus_equals(bestC[k].beta, pf_times(state.alpha, external_paired_alpha_plus_beamstepC_beta));
+                        pf_plus_equals(state.beta, pf_times(bestC[k].alpha, external_paired_alpha_plus_beamstepC_beta));
                     } else {
 
                         int new_nuck1, new_nucj, new_nucj1;
@@ -669,7 +741,7 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
 
                         }
 
-                        Fast_LogPlusEquals(state.beta, (beamstepC.beta + newscore/kTn));
+                        pf_plus_equals(state.beta, pf_times(beamstepC.beta, pf_weight(newscore/kTn)));
 
                     }
                 }
@@ -678,7 +750,7 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                     pscore[i][j].ribo_score = make_pscores_ij(SS_fast[i], SS_fast[j], ribo);
                 }
 
-                state.beta = state.beta + pscore[i][j].ribo_score / kTn;
+                state.beta = pf_times(state.beta, pf_weight(pscore[i][j].ribo_score / kTn));
             }
 
         }
@@ -715,6 +787,7 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                         if (jnext == jnext_org){
                             jnext = -1;
                         }
+                        if (!in_span(i, jnext)) jnext = -1;
                         next_position[i][j] = jnext;
                     }
 
@@ -739,12 +812,13 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                             if (jnext_min != jnext_org) jnext = jnext_min;
                             else jnext = -1;
 
+                             if (!in_span(i, jnext)) jnext = -1;
                              next_position[i][prev_jnext] = jnext;
                         }
                     }
 
                     if (jnext != -1) {
-                        Fast_LogPlusEquals(state.beta, (bestMulti[jnext][i].beta));
+                        pf_plus_equals(state.beta, pf_times(bestMulti[jnext][i].beta, pf_weight(0, j+1, jnext)));
                     }
                 }
                 // 2. generate P (i, j)
@@ -763,7 +837,7 @@ void BeamCKYParser::outside_alifold(vector<int> next_pair[], vector<vector<ribo_
                         newscore += (- v_score_multi(-1, -1, new_nuci, new_nuci1, new_nucj_1, new_nucj, -1));
                     }                    
 
-                    Fast_LogPlusEquals(state.beta, beamstepP[i].beta + newscore/kTn);
+                    pf_plus_equals(state.beta, pf_times(beamstepP[i].beta, pf_weight(newscore/kTn)));
                 }
             }
         }
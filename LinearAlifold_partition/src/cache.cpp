@@ -0,0 +1,121 @@
+
+#include <stdio.h>
+#include <string.h>
+#include "linearalifold_p.h"
+#include "Utils/result_cache.h"
+
+using namespace std;
+
+// Result cache of bin/linearalifold_p (--cache, see Utils/result_cache.h): an entry holds the
+// results of a parse (ensemble_energy, the joint MFE, mea_structure, threshknot_pairs and Pij),
+// and a hit sets them and writes them out as parse_alifold and the steps after it would have,
+// so that stdout, -o / --prefix files and --container records are the same either way.
+//
+// results layout, in host byte order:
+//   double     ensemble_energy, joint_mfe_energy, joint_mfe_covariance
+//   uint32     size, then the bytes of joint_mfe_structure; the same for mea_structure
+//   uint32     threshknot pairs, then int32 i j of each (i < j, original columns)
+//   uint64     pairs of Pij, then int32 i, int32 j (folded columns, 1-based) and double p of each
+
+// the options text of the cache key of a parse with options (pf_only: no outside pass)
+string result_cache_options(const FoldOptions & options, bool pf_only) {
+    static const string checksum = result_cache_checksum(vector<string>());
+    char text[512];
+    snprintf(text, sizeof(text), "linearalifold_p %s beam=%d sharpturn=%d policy=%d margin=%.9g span=%d gap=%.9g linear=%d "
+             "pf_only=%d cutoff=%.9g mea=%d gamma=%.9g threshknot=%d threshold=%.9g mfe=%d",
+             checksum.c_str(), options.beam, !options.no_sharp_turn, (int)options.beam_policy, options.beam_margin, options.span,
+             options.gap_fraction, options.linear_space, pf_only, options.bpp_cutoff, options.mea, options.gamma,
+             options.threshknot, options.threshold, options.mfe);
+    return text;
+}
+
+string BeamCKYParser::cache_results() {
+    string results;
+    auto put = [&](const void * data, size_t size) { results.append((const char *)data, size); };
+    auto put_string = [&](const string & text) {
+        uint32_t size = text.size();
+        put(&size, sizeof(size));
+        put(text.data(), size);
+    };
+
+    double energies[3] = {ensemble_energy, joint_mfe_energy, joint_mfe_covariance};
+    put(energies, sizeof(energies));
+    put_string(joint_mfe ? joint_mfe_structure : "");
+    put_string(mea_ ? mea_structure : "");
+
+    // only the results asked for (a parser of the fold server keeps the others of earlier requests)
+    vector<int32_t> knots;
+    for (auto & item : threshknot_pairs)
+        if (threshknot_ && item.first < item.second) {
+            knots.push_back(item.first);
+            knots.push_back(item.second);
+        }
+    uint32_t num_knots = knots.size() / 2;
+    put(&num_knots, sizeof(num_knots));
+    put(knots.data(), knots.size() * sizeof(int32_t));
+
+    uint64_t num_pairs = Pij.size();
+    put(&num_pairs, sizeof(num_pairs));
+    for (auto & pij : Pij) {
+        int32_t ij[2] = {pij.first.first, pij.first.second};
+        double prob = pij.second;
+        put(ij, sizeof(ij));
+        put(&prob, sizeof(prob));
+    }
+    return results;
+}
+
+bool BeamCKYParser::restore_results(const string & results) {
+    size_t cursor = 0;
+    auto get = [&](void * data, size_t size) {
+        if (cursor + size > results.size()) return false;
+        memcpy(data, results.data() + cursor, size);
+        cursor += size;
+        return true;
+    };
+    auto get_string = [&](string & text) {
+        uint32_t size;
+        if (!get(&size, sizeof(size)) || cursor + size > results.size()) return false;
+        text.assign(results, cursor, size);
+        cursor += size;
+        return true;
+    };
+
+    double energies[3];
+    uint32_t num_knots;
+    if (!get(energies, sizeof(energies)) || !get_string(joint_mfe_structure) || !get_string(mea_structure) || !get(&num_knots, sizeof(num_knots)))
+        return false;
+    ensemble_energy = energies[0];
+    joint_mfe_energy = energies[1];
+    joint_mfe_covariance = energies[2];
+    threshknot_pairs.clear();
+    for (uint32_t k = 0; k < num_knots; k++) {
+        int32_t ij[2];
+        if (!get(ij, sizeof(ij))) return false;
+        threshknot_pairs[ij[0]] = ij[1];
+        threshknot_pairs[ij[1]] = ij[0];
+    }
+    uint64_t num_pairs;
+    if (!get(&num_pairs, sizeof(num_pairs))) return false;
+    Pij.clear();
+    for (uint64_t e = 0; e < num_pairs; e++) {
+        int32_t ij[2];
+        double prob;
+        if (!get(ij, sizeof(ij)) || !get(&prob, sizeof(prob))) return false;
+        Pij[make_pair(ij[0], ij[1])] = prob;
+    }
+    return cursor == results.size();
+}
+
+void BeamCKYParser::replay_results(vector<string> & MSA_) {
+    seq_length = MSA_[0].size();
+    if (keep_results) return;
+    output_energies();
+    fflush(stdout);
+    if (!pf_only) {
+        string seq = MSA_[0];
+        output_PairProb();
+        if (mea_) output_MEA(seq);
+        if (threshknot_) output_ThreshKnot(seq);
+    }
+}
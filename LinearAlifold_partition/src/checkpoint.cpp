@@ -0,0 +1,237 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "linearalifold_p.h"
+
+using namespace std;
+
+// Checkpoints of the inside pass (--checkpoint FILE): every checkpoint_interval seconds the state
+// of parse_alifold after a column is written to FILE, and a parse with resume continues after that
+// column instead of from the start if FILE holds a checkpoint of the same alignment and options.
+// The rest of the parse is the same as if it had not stopped: the beams are unordered_maps whose
+// iteration order decides the order of the sums, so every beam is saved in its iteration order
+// with its bucket count and rebuilt to iterate in that order (checked when it is read). The
+// memoised pscore and next_position are functions of the alignment and are filled again as the
+// parse needs them, but for the pairs of the P beams folded before the checkpoint, whose scores
+// outside and the MFE read as the inside pass left them. FILE is written to a temporary file and renamed, and removed once the
+// results of the alignment are out.
+//
+// layout, in host byte order:
+//   CheckpointHeader
+//   bestC      pf_type alpha[length], then pf_type viterbi[length]
+//   with CHECKPOINT_LINEAR: double log_scale_sum[length + 1]
+//   for H, P, M, M2 and Multi, for every column from first_column:
+//     uint64   bucket count, then number of states
+//     int32    i of every state, in iteration order; then pf_type alpha, then pf_type viterbi
+//   with CHECKPOINT_LINEAR, for every column from next_column: the pushes pending_multi
+//     uint64   number of pushes, then int32 i, int32 j and pf_type value of every push
+
+#define CHECKPOINT_MAGIC "LAFCKPT\0"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_LINEAR 1
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pf_size;       // sizeof(pf_type): 8, or 4 with -DFAST_FLOAT
+    char key[32];           // of checkpoint_key
+    uint32_t length;        // folded columns
+    uint32_t flags;         // CHECKPOINT_LINEAR
+    int32_t next_column;    // the column to continue from
+    int32_t first_column;   // the earliest column of the beams saved
+    uint64_t pruned, columns;
+    double beam_sum;
+    int32_t beam_lo, beam_hi;
+    int32_t scaled_columns;
+    int32_t reserved;
+    double column_log_scale;
+    uint64_t states;
+};
+
+// whether the rest of an inside-only parse (no outside, forest, samples or MFE) in log space with
+// a span is all that reads the beams; it then only reads M of the columns span back (for P)
+bool BeamCKYParser::checkpoint_all_columns() {
+    return !pf_only || span <= 0 || !forest_file.empty() || sample_number > 0 || joint_mfe || use_linear;
+}
+
+// the key of the checkpoints of a parse of MSA (folded columns) with ribo: the options that change
+// the inside pass, and the binary, as for the result cache (see Utils/result_cache.h)
+string BeamCKYParser::checkpoint_key() {
+    static const string checksum = result_cache_checksum(vector<string>());
+    char text[256];
+    snprintf(text, sizeof(text), "linearalifold_p checkpoint %s beam=%d sharpturn=%d policy=%d margin=%.9g span=%d linear=%d mfe=%d all=%d",
+             checksum.c_str(), beam, !no_sharp_turn, (int)beam_policy, beam_margin, span, use_linear, joint_mfe, checkpoint_all_columns());
+    CacheKey key;
+    key.add(string(text));
+    for (int k = 0; k < 7; k++) key.add(ribo[k], 7 * sizeof(float));
+    for (auto & row : MSA) key.add(row);
+    return key.hex();
+}
+
+// the state after column j to checkpoint_file; false if it could not be written
+bool BeamCKYParser::write_checkpoint(int j, const string & key) {
+    string temporary = checkpoint_file + ".tmp";
+    FILE * fptr = fopen(temporary.c_str(), "wb");
+    if (fptr == NULL) return false;
+    setvbuf(fptr, NULL, _IOFBF, 1 << 20);
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, 8);
+    header.version = CHECKPOINT_VERSION;
+    header.pf_size = sizeof(pf_type);
+    memcpy(header.key, key.data(), 32);
+    header.length = seq_length;
+    header.flags = use_linear ? CHECKPOINT_LINEAR : 0;
+    header.next_column = j + 1;
+    header.first_column = checkpoint_all_columns() ? 0 : max(0, j + 1 - span - 1);
+    header.pruned = beam_stats.pruned;
+    header.columns = beam_stats.columns;
+    header.beam_sum = beam_stats.beam_sum;
+    header.beam_lo = beam_stats.beam_lo;
+    header.beam_hi = beam_stats.beam_hi;
+    header.states = beam_stats.states;
+    header.scaled_columns = scaled_columns;
+    header.column_log_scale = column_log_scale;
+    fwrite(&header, sizeof(header), 1, fptr);
+
+    vector<pf_type> alpha(seq_length), viterbi(seq_length);
+    for (int k = 0; k < seq_length; k++) {
+        alpha[k] = bestC[k].alpha;
+        viterbi[k] = bestC[k].viterbi;
+    }
+    fwrite(alpha.data(), sizeof(pf_type), seq_length, fptr);
+    fwrite(viterbi.data(), sizeof(pf_type), seq_length, fptr);
+    if (use_linear) fwrite(log_scale_sum.data(), sizeof(double), seq_length + 1, fptr);
+
+    unordered_map<int, State> * const beams[5] = {bestH, bestP, bestM, bestM2, bestMulti};
+    vector<int32_t> is;
+    for (auto beams_type : beams)
+        for (int k = header.first_column; k < seq_length; k++) {
+            auto & beamstep = beams_type[k];
+            uint64_t counts[2] = {beamstep.bucket_count(), beamstep.size()};
+            is.clear();
+            alpha.clear();
+            viterbi.clear();
+            for (auto & item : beamstep) {
+                is.push_back(item.first);
+                alpha.push_back(item.second.alpha);
+                viterbi.push_back(item.second.viterbi);
+            }
+            fwrite(counts, sizeof(uint64_t), 2, fptr);
+            fwrite(is.data(), sizeof(int32_t), is.size(), fptr);
+            fwrite(alpha.data(), sizeof(pf_type), alpha.size(), fptr);
+            fwrite(viterbi.data(), sizeof(pf_type), viterbi.size(), fptr);
+        }
+
+    if (use_linear)
+        for (int k = j + 1; k < seq_length; k++) {
+            uint64_t num = pending_multi[k].size();
+            fwrite(&num, sizeof(num), 1, fptr);
+            for (auto & push : pending_multi[k]) {
+                int32_t ij[2] = {push.i, push.j};
+                fwrite(ij, sizeof(int32_t), 2, fptr);
+                fwrite(&push.value, sizeof(pf_type), 1, fptr);
+            }
+        }
+
+    bool ok = !ferror(fptr);
+    ok = fclose(fptr) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), checkpoint_file.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// the state of a checkpoint of key in checkpoint_file (with the pscore of its P states), and
+// next_column the column to continue from; false (and the parser as prepare left it) if there is
+// none or it cannot be read
+bool BeamCKYParser::read_checkpoint(const string & key, int & next_column, SpanTable<ribo_state> & pscore) {
+    FILE * fptr = fopen(checkpoint_file.c_str(), "rb");
+    if (fptr == NULL) return false;
+    setvbuf(fptr, NULL, _IOFBF, 1 << 20);
+
+    CheckpointHeader header;
+    if (fread(&header, sizeof(header), 1, fptr) != 1 || memcmp(header.magic, CHECKPOINT_MAGIC, 8) != 0 || header.version != CHECKPOINT_VERSION
+        || header.pf_size != sizeof(pf_type) || memcmp(header.key, key.data(), 32) != 0 || header.length != seq_length
+        || (header.flags & CHECKPOINT_LINEAR) != (use_linear ? CHECKPOINT_LINEAR : 0)
+        || header.next_column < 1 || header.next_column > (int)seq_length || header.first_column < 0 || header.first_column >= header.next_column) {
+        fclose(fptr);
+        return false;
+    }
+
+    auto get = [&](void * data, size_t size, size_t count) { return fread(data, size, count, fptr) == count; };
+    vector<pf_type> alpha(seq_length), viterbi(seq_length);
+    bool ok = get(alpha.data(), sizeof(pf_type), seq_length) && get(viterbi.data(), sizeof(pf_type), seq_length);
+    for (int k = 0; ok && k < seq_length; k++) {
+        bestC[k].alpha = alpha[k];
+        bestC[k].viterbi = viterbi[k];
+    }
+    if (ok && use_linear) ok = get(log_scale_sum.data(), sizeof(double), seq_length + 1);
+
+    // a beam is rebuilt with the bucket count it had, and its states inserted last to first: each
+    // goes to the front of the list, or of the states of its bucket, so it iterates as it did
+    unordered_map<int, State> * const beams[5] = {bestH, bestP, bestM, bestM2, bestMulti};
+    vector<int32_t> is;
+    for (int type = 0; ok && type < 5; type++)
+        for (int k = header.first_column; ok && k < seq_length; k++) {
+            auto & beamstep = beams[type][k];
+            uint64_t counts[2];
+            if (!(ok = get(counts, sizeof(uint64_t), 2) && counts[0] <= 4 * (uint64_t)seq_length + 16 && counts[1] <= seq_length)) break;
+            size_t num = counts[1];
+            is.resize(num);
+            alpha.resize(num);
+            viterbi.resize(num);
+            if (!(ok = get(is.data(), sizeof(int32_t), num) && get(alpha.data(), sizeof(pf_type), num) && get(viterbi.data(), sizeof(pf_type), num))) break;
+            if (counts[0] > 1) beamstep.rehash(counts[0]);
+            if (!(ok = beamstep.bucket_count() == counts[0])) break;
+            for (size_t e = num; e-- > 0; ) {
+                State & state = beamstep[is[e]];
+                state.alpha = alpha[e];
+                state.viterbi = viterbi[e];
+            }
+            if (!(ok = beamstep.size() == num && beamstep.bucket_count() == counts[0])) break;
+            size_t e = 0;
+            for (auto & item : beamstep)
+                if (!(ok = item.first == is[e++])) break;
+        }
+
+    for (int k = header.next_column; ok && use_linear && k < seq_length; k++) {
+        uint64_t num;
+        if (!(ok = get(&num, sizeof(num), 1) && num <= (uint64_t)seq_length * seq_length)) break;
+        pending_multi[k].resize(num);
+        for (auto & push : pending_multi[k]) {
+            int32_t ij[2];
+            if (!(ok = get(ij, sizeof(int32_t), 2) && get(&push.value, sizeof(pf_type), 1))) break;
+            push.i = ij[0];
+            push.j = ij[1];
+        }
+    }
+    ok = ok && fgetc(fptr) == EOF;
+    fclose(fptr);
+
+    if (!ok) {
+        postprocess();
+        prepare(seq_length);
+        return false;
+    }
+
+    next_column = header.next_column;
+    beam_stats.pruned = header.pruned;
+    beam_stats.columns = header.columns;
+    beam_stats.beam_sum = header.beam_sum;
+    beam_stats.beam_lo = header.beam_lo;
+    beam_stats.beam_hi = header.beam_hi;
+    beam_stats.states = header.states;
+    scaled_columns = header.scaled_columns;
+    column_log_scale = header.column_log_scale;
+    // the M beams of the columns done, as the parse flattened them
+    for (int k = max(header.first_column, 1); k < next_column; k++) flatten_beam(bestM[k], flatM[k]);
+    for (int k = header.first_column; k < next_column; k++)
+        for (auto & item : bestP[k])
+            if (pscore[item.first][k].ribo_score == std::numeric_limits<int>::lowest())
+                pscore[item.first][k].ribo_score = make_pscores_ij(SS_fast[item.first], SS_fast[k], ribo);
+    return true;
+}
@@ -0,0 +1,158 @@
+// the C API of liblinearalifold.h over BeamCKYParser::fold, the entry of the fold server's
+// requests; built from the same sources as bin/linearalifold_p, without its main
+
+#define LINEARALIFOLD_LIBRARY
+#include <mutex>
+#include "linearalifold_p.cpp"
+#include "liblinearalifold.h"
+
+// the energy parameters are compiled in (Utils/energy_parameter.h) and the tables the engine
+// derives from them are globals, set up by the first model, before any parser; a model is only
+// a handle to them, so that a parser cannot be created before they are
+static once_flag energy_model_once;
+
+struct laf_model {
+    laf_model() {
+        call_once(energy_model_once, []() {
+            initialize();
+#ifndef lpv
+            initialize_cachesingle();
+#endif
+        });
+    };
+};
+
+struct laf_parser {
+    BeamCKYParser parser;
+    FoldOptions options;
+    vector<string> MSA; // the rows of the last fold; their buffers are reused by the next one
+    string error;
+    vector<pair<pair<int, int>, pf_type>> pairs, knots; // of the last fold, see laf_bpp / laf_threshknot
+
+    laf_parser(const FoldOptions & options_): parser(options_.beam, options_.no_sharp_turn, false, "", "", false, options_.bpp_cutoff, "", options_.mea, options_.gamma, "", false, options_.threshknot, options_.threshold, "", options_.beam_policy, options_.beam_margin, options_.time_budget, options_.span), options(options_) {
+        parser.keep_results = true;
+        parser.linear_space = options.linear_space;
+    };
+};
+
+static FoldOptions fold_options(const laf_options * options) {
+    laf_options defaults;
+    if (options == NULL) {
+        laf_options_default(&defaults);
+        options = &defaults;
+    }
+    FoldOptions fold = {options->beam, options->mea != 0, options->gamma, options->threshknot != 0, options->threshold, options->bpp_cutoff, options->mfe != 0, options->span, options->gap_fraction,
+                        options->no_sharp_turn != 0, BEAM_FIXED, 0.0, 0.0, options->linear_space != 0};
+    return fold;
+}
+
+static size_t copy_pairs(const vector<pair<pair<int, int>, pf_type>> & pairs, laf_pair * out, size_t capacity) {
+    for (size_t k = 0; k < pairs.size() && k < capacity; k++) {
+        out[k].i = pairs[k].first.first;
+        out[k].j = pairs[k].first.second;
+        out[k].prob = pairs[k].second;
+    }
+    return pairs.size();
+}
+
+extern "C" {
+
+void laf_options_default(laf_options * options) {
+    options->beam = 100;
+    options->mea = 0;
+    options->gamma = 3.0;
+    options->threshknot = 0;
+    options->threshold = 0.3;
+    options->bpp_cutoff = 0.0;
+    options->mfe = 0;
+    options->span = 0;
+    options->gap_fraction = 0.0;
+    options->no_sharp_turn = 1;
+    options->linear_space = 0;
+}
+
+laf_model * laf_model_create(void) {
+    return new laf_model();
+}
+
+void laf_model_destroy(laf_model * model) {
+    delete model;
+}
+
+laf_parser * laf_parser_create(const laf_model * model, const laf_options * options) {
+    if (model == NULL) return NULL;
+    return new laf_parser(fold_options(options));
+}
+
+void laf_parser_destroy(laf_parser * parser) {
+    delete parser;
+}
+
+void laf_parser_set_options(laf_parser * parser, const laf_options * options) {
+    parser->options = fold_options(options);
+    parser->parser.no_sharp_turn = parser->options.no_sharp_turn;
+    parser->parser.linear_space = parser->options.linear_space;
+}
+
+int laf_fold(laf_parser * parser, const char * const * rows, int n_rows, int length) {
+    parser->error.clear();
+    if (rows == NULL || n_rows <= 0 || length <= 0) {
+        parser->error = "empty alignment";
+        return -1;
+    }
+    parser->MSA.resize(n_rows);
+    for (int s = 0; s < n_rows; s++) {
+        string & row = parser->MSA[s];
+        row.assign(rows[s], length);
+        for (auto & c : row) {
+            c = toupper((unsigned char)c);
+            if (c == 'T') c = 'U';
+            else if (c == '.' || c == '~') c = '-';
+        }
+    }
+    parser->pairs.clear();
+    parser->knots.clear();
+    if (!parser->parser.fold(parser->MSA, parser->options, parser->error)) return -1;
+
+    parser->pairs = parser->parser.bpp_pairs();
+    // ThreshKnot keeps pairs above its threshold, so all of them are among the sorted pairs
+    // unless bpp_cutoff is higher
+    if (parser->options.threshknot)
+        for (auto & item : parser->parser.threshknot_pairs) {
+            if (item.first > item.second) continue;
+            pair<int, int> ij(item.first, item.second);
+            auto pij = lower_bound(parser->pairs.begin(), parser->pairs.end(), make_pair(ij, pf_type(-1)));
+            parser->knots.push_back(make_pair(ij, (pij != parser->pairs.end() && pij->first == ij) ? pij->second : pf_type(0)));
+        }
+    return 0;
+}
+
+const char * laf_error(const laf_parser * parser) {
+    return parser->error.c_str();
+}
+
+double laf_ensemble_energy(const laf_parser * parser) {
+    return parser->parser.ensemble_energy;
+}
+
+const char * laf_mfe_structure(const laf_parser * parser, double * energy, double * covariance) {
+    if (!parser->options.mfe || !parser->error.empty()) return NULL;
+    if (energy != NULL) *energy = parser->parser.joint_mfe_energy;
+    if (covariance != NULL) *covariance = parser->parser.joint_mfe_covariance;
+    return parser->parser.joint_mfe_structure.c_str();
+}
+
+const char * laf_mea_structure(const laf_parser * parser) {
+    if (!parser->options.mea || !parser->error.empty()) return NULL;
+    return parser->parser.mea_structure.c_str();
+}
+
+size_t laf_bpp(const laf_parser * parser, laf_pair * pairs, size_t capacity) {
+    return copy_pairs(parser->pairs, pairs, capacity);
+}
+
+size_t laf_threshknot(const laf_parser * parser, laf_pair * pairs, size_t capacity) {
+    return copy_pairs(parser->knots, pairs, capacity);
+}
+
+}
@@ -0,0 +1,106 @@
+/* liblinearalifold: the partition function engine (bin/linearalifold_p) as a C library, for
+ * folding alignments from other programs without going through stdin and text output.
+ *
+ *   laf_model * model = laf_model_create();
+ *   laf_options options;
+ *   laf_options_default(&options);
+ *   options.mfe = 1;
+ *   laf_parser * parser = laf_parser_create(model, &options);
+ *
+ *   if (laf_fold(parser, rows, n_rows, length) == 0) {
+ *       double energy = laf_ensemble_energy(parser);
+ *       const char * mfe = laf_mfe_structure(parser, NULL, NULL);
+ *       size_t n = laf_bpp(parser, NULL, 0);
+ *       laf_pair * pairs = malloc(n * sizeof(laf_pair));
+ *       laf_bpp(parser, pairs, n);
+ *   } else fprintf(stderr, "%s\n", laf_error(parser));
+ *
+ *   laf_parser_destroy(parser);
+ *   laf_model_destroy(model);
+ *
+ * A parser folds one alignment at a time and keeps its tables between calls; use one parser
+ * per thread. Results stay valid until the next laf_fold on the same parser. Columns are
+ * 1-based and in the alignment as passed, also with gap_fraction set.
+ *
+ * Link with -llinearalifold and the C++ runtime (-lstdc++ -lpthread -lm, and zlib: -lz, for the static library).
+ */
+
+#ifndef LIBLINEARALIFOLD_H
+#define LIBLINEARALIFOLD_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LAF_API __attribute__((visibility("default")))
+
+typedef struct laf_model laf_model;
+typedef struct laf_parser laf_parser;
+
+/* as the flags of the linearalifold wrapper with the same names */
+typedef struct {
+    int beam;           /* 0: no beam pruning */
+    int mea;            /* MEA structure, see laf_mea_structure */
+    float gamma;
+    int threshknot;     /* ThreshKnot pairs, see laf_threshknot */
+    float threshold;
+    float bpp_cutoff;   /* pairs with a lower probability are not kept */
+    int mfe;            /* joint MFE structure, see laf_mfe_structure */
+    int span;           /* max base pair span, 0: no limit */
+    float gap_fraction; /* leave out columns with more gaps, 0: fold every column */
+    int no_sharp_turn;
+    int linear_space;
+} laf_options;
+
+typedef struct {
+    int i, j;           /* i < j */
+    double prob;
+} laf_pair;
+
+/* the defaults of bin/linearalifold_p */
+LAF_API void laf_options_default(laf_options * options);
+
+/* the energy model (the Turner parameters and ribosum scores built into the engine). It is
+ * process-global: the first laf_model_create sets up the engine's tables, and later calls
+ * only return another handle to them; a parser needs a model so that it is not used before
+ * that. laf_model_destroy frees the handle, the tables stay until the process ends. */
+LAF_API laf_model * laf_model_create(void);
+LAF_API void laf_model_destroy(laf_model * model);
+
+/* NULL options: laf_options_default */
+LAF_API laf_parser * laf_parser_create(const laf_model * model, const laf_options * options);
+LAF_API void laf_parser_destroy(laf_parser * parser);
+LAF_API void laf_parser_set_options(laf_parser * parser, const laf_options * options);
+
+/* fold n_rows aligned sequences of length columns each (rows[s][0 .. length-1], no terminating
+ * 0 needed, upper or lower case, T read as U, '-' for gaps); 0 on success, -1 otherwise
+ * (see laf_error) */
+LAF_API int laf_fold(laf_parser * parser, const char * const * rows, int n_rows, int length);
+
+/* why the last laf_fold failed */
+LAF_API const char * laf_error(const laf_parser * parser);
+
+/* free energy of the ensemble, kcal/mol */
+LAF_API double laf_ensemble_energy(const laf_parser * parser);
+
+/* joint MFE structure in dot-bracket, with its energy (free energy + covariance) and
+ * covariance in kcal/mol if the pointers are not NULL; NULL unless options.mfe */
+LAF_API const char * laf_mfe_structure(const laf_parser * parser, double * energy, double * covariance);
+
+/* MEA structure in dot-bracket; NULL unless options.mea */
+LAF_API const char * laf_mea_structure(const laf_parser * parser);
+
+/* the pairs with a probability of at least bpp_cutoff, by i then j: copies at most capacity of
+ * them into pairs (which may be NULL if capacity is 0) and returns how many there are */
+LAF_API size_t laf_bpp(const laf_parser * parser, laf_pair * pairs, size_t capacity);
+
+/* the ThreshKnot pairs (prob: their probability), as laf_bpp; 0 unless options.threshknot */
+LAF_API size_t laf_threshknot(const laf_parser * parser, laf_pair * pairs, size_t capacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,18 +9,32 @@
 #include <algorithm>
 #include <string>
 #include <map>
+#include <sstream>
 #include <stdio.h> 
+#include <climits>
 
 #include "linearalifold_p.h"
 #include "Utils/utility.h"
 #include "Utils/utility_v.h"
 #include "bpp.cpp"
+#include "window.cpp"
+#include "sample.cpp"
+#include "cache.cpp"
+#include "checkpoint.cpp"
+#include "server.cpp"
+#include "sweep.cpp"
+#include "Utils/alignment_index.h"
+#include "Utils/alignment_reader.h"
+#include "Utils/result_container.h"
+#include "Utils/forest_binary.h"
 // #include "Utils/ribo.h"
 
 #define SPECIAL_HP
 
 using namespace std;
 
+thread_local pf_type State::zero = VALUE_MIN;
+
 unsigned long quickselect_partition(vector<pair<pf_type, int>>& scores, unsigned long lower, unsigned long upper) {
     pf_type pivot = scores[upper].first;
     while (lower < upper) {
@@ -45,25 +59,62 @@ pf_type quickselect(vector<pair<pf_type, int>>& scores, unsigned long lower, uns
 
 pf_type BeamCKYParser::beam_prune(std::unordered_map<int, State> &beamstep) {
     scores.clear();
+    pf_type best = VALUE_MIN;
     for (auto &item : beamstep) {
         int i = item.first;
         State &cand = item.second;
         int k = i - 1;
-        pf_type newalpha = (k >= 0 ? bestC[k].alpha : pf_type(0.0)) + cand.alpha;
+        pf_type newalpha = pf_times(k >= 0 ? bestC[k].alpha : pf_one(), cand.alpha);
         scores.push_back(make_pair(newalpha, i));
+        best = max(best, newalpha);
     }
-    if (scores.size() <= beam) return VALUE_MIN;
-    pf_type threshold = quickselect(scores, 0, scores.size() - 1, scores.size() - beam);
+
+    pf_type threshold = VALUE_MIN;
+    if (cur_beam > 0 && scores.size() > cur_beam)
+        threshold = quickselect(scores, 0, scores.size() - 1, scores.size() - cur_beam);
+    // score-margin pruning: nothing further than margin_alpha below the best candidate survives
+    if (beam_policy == BEAM_MARGIN && best > (use_linear ? pf_type(0.0) : pf_type(NEG_INF)))
+        threshold = max(threshold, use_linear ? best * pf_type(exp(-margin_alpha)) : best - margin_alpha);
+    if (threshold == VALUE_MIN) return VALUE_MIN;
+
     for (auto &p : scores) {
-        if (p.first < threshold) beamstep.erase(p.second);
+        if (p.first < threshold) {
+            beamstep.erase(p.second);
+            ++beam_stats.pruned;
+        }
     }
 
     return threshold;
 }
 
+// BEAM_ADAPTIVE: after each column, rescale the beam by how the time per column we can still
+// afford compares to the time per column we are spending now (a damped proportional controller).
+// Outside costs about as much as inside, so without -p only half of the budget goes to inside.
+void BeamCKYParser::adapt_beam(int j, double elapsed) {
+    double this_column = elapsed - last_elapsed;
+    last_elapsed = elapsed;
+    column_time = (column_time > 0) ? 0.9 * column_time + 0.1 * this_column : this_column;
+
+    int remaining = seq_length - 1 - j;
+    if (remaining <= 0 || column_time <= 0) return;
+
+    int beam_cap = beam > 0 ? beam : seq_length;
+    double inside_budget = pf_only ? time_budget : time_budget / 2;
+    double affordable = (inside_budget - elapsed) / remaining;
+    if (affordable <= 0)
+        cur_beam_f = ADAPTIVE_BEAM_MIN;
+    else {
+        double ratio = min(max(affordable / column_time, 0.5), 2.0);
+        cur_beam_f *= pow(ratio, 0.25);
+    }
+    cur_beam_f = min(max(cur_beam_f, double(ADAPTIVE_BEAM_MIN)), double(beam_cap));
+    cur_beam = int(cur_beam_f + 0.5);
+}
+
 
 void BeamCKYParser::prepare(unsigned len) {
     seq_length = len;
+    Pij.clear();
 
     nucs = new int[seq_length];
     bestC = new State[seq_length];
@@ -74,6 +125,62 @@ void BeamCKYParser::prepare(unsigned len) {
     bestMulti = new unordered_map<int, State>[seq_length];
     
     scores.reserve(seq_length);
+
+    flatM.assign(seq_length, FlatBeam());
+    M2_alpha.assign(seq_length, pf_zero());
+    M2_viterbi.assign(joint_mfe ? seq_length : 0, VALUE_MIN);
+    M2_touched.clear();
+
+    log_scale_sum.assign(seq_length + 1, 0.0);
+    scaled_columns = 0;
+    column_log_scale = 0.0;
+    if (use_linear) pending_multi.assign(seq_length, vector<PendingPush>());
+}
+
+void BeamCKYParser::scale_columns(int j) {
+    for (; scaled_columns <= j; ++scaled_columns)
+        log_scale_sum[scaled_columns + 1] = log_scale_sum[scaled_columns] + column_log_scale;
+}
+
+// linear space to log space, after the inside (and outside) pass; false if anything overflowed
+bool BeamCKYParser::log_space_values(bool with_beta) {
+    double total_scale = scale_span(0, seq_length - 1);
+    bool finite = true;
+
+    auto to_log = [&](pf_type & value, double scale) {
+        if (!std::isfinite(value)) finite = false;
+        value = value > 0 ? pf_type(log(value) + scale) : VALUE_MIN;
+    };
+    auto beam_to_log = [&](unordered_map<int, State> & beamstep, int j) {
+        for (auto & item : beamstep) {
+            double scale = scale_span(item.first, j);
+            to_log(item.second.alpha, scale);
+            if (with_beta) to_log(item.second.beta, total_scale - scale);
+        }
+    };
+
+    for (int j = 0; j < seq_length; ++j) {
+        beam_to_log(bestH[j], j);
+        beam_to_log(bestMulti[j], j);
+        beam_to_log(bestP[j], j);
+        beam_to_log(bestM2[j], j);
+        beam_to_log(bestM[j], j);
+        to_log(bestC[j].alpha, scale_span(0, j));
+        if (with_beta) to_log(bestC[j].beta, total_scale - scale_span(0, j));
+    }
+    if (!(bestC[seq_length - 1].alpha > VALUE_MIN)) finite = false;
+
+    use_linear = false;
+    State::zero = VALUE_MIN;
+    return finite;
+}
+
+void BeamCKYParser::flatten_beam(unordered_map<int, State> & beamstep, FlatBeam & flat) {
+    for (auto & item : beamstep) {
+        flat.i.push_back(item.first);
+        flat.alpha.push_back(item.second.alpha);
+        flat.state.push_back(&item.second);
+    }
 }
 
 void BeamCKYParser::postprocess() {
@@ -86,10 +193,13 @@ void BeamCKYParser::postprocess() {
     delete[] bestMulti;  
 
     delete[] nucs;  
+
+    vector<FlatBeam>().swap(flatM);
+    vector<vector<PendingPush>>().swap(pending_multi);
 }
 
 
-bool BeamCKYParser::check_pairable_ij(vector<int> & SS_fast_i, vector<int> & SS_fast_j, float ** ribo, vector<vector<ribo_state>> & pscore, int i, int j){ //it is hc_decompose  = fc->hc->mx[n * i + j]; in mfe.c
+bool BeamCKYParser::check_pairable_ij(vector<int> & SS_fast_i, vector<int> & SS_fast_j, float ** ribo, SpanTable<ribo_state> & pscore, int i, int j){ //it is hc_decompose  = fc->hc->mx[n * i + j]; in mfe.c
 
     // in hard.c, RNAalifold use this to check if column i and column j can be paired, 0 no, 63(VRNA_CONSTRAINT_CONTEXT_ALL_LOOPS = 63) yes
     // if ((sn[i] != sn[j]) ||
@@ -149,7 +259,7 @@ vector<pair<int,int>> get_pairs(string& structure){
 }
 
 
-void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector<int>> & a2s_, vector<vector<ribo_state>> & pscore, vector<vector<int>> & s5_, vector<vector<int>> & s3_, vector<vector<int>> & SS_, float ** ribo_, vector<float> & smart_gap_) {
+void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector<int>> & a2s_, SpanTable<ribo_state> & pscore, vector<vector<int>> & s5_, vector<vector<int>> & s3_, vector<vector<int>> & SS_, float ** ribo_, vector<float> & smart_gap_) {
     
     struct timeval parse_starttime, parse_endtime;
 
@@ -157,6 +267,8 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
 
     auto seq = MSA_[0];
 
+    use_linear = linear_space;
+    State::zero = pf_zero();
     prepare(static_cast<unsigned>(seq.length()));
 
     MSA = MSA_;
@@ -206,7 +318,7 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
     vector<vector<int>>().swap(next_pair_ij);
 
 
-    auto next_position = init_next_position_only(seq_length);
+    auto next_position = init_next_position_only(seq_length, span);
 
 
 
@@ -260,14 +372,11 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
 
     }
 
-    v_init_tetra_hex_tri(MSA, if_tetraloops_MSA, if_hexaloops_MSA, if_triloops_MSA);
+    v_init_tetra_hex_tri(seq_MSA_no_gap, if_tetraloops_MSA, if_hexaloops_MSA, if_triloops_MSA);
 #endif
 
 
 
-        if(seq_length > 0) bestC[0].alpha = 0.0;
-        if(seq_length > 1) bestC[1].alpha = 0.0;
-
     float smart_gap_threshold = 0.5;
 
     value_type newscore;
@@ -277,8 +386,31 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
 
     gettimeofday(&starttime, NULL);
 
+    cur_beam = beam_policy == BEAM_ADAPTIVE && beam <= 0 ? 100 : beam;
+    cur_beam_f = cur_beam;
+    margin_alpha = beam_margin * 100.0 / kT;
+    last_elapsed = column_time = 0;
+    beam_stats = {0, 0, 0, INT_MAX, 0, 0};
+
+    // --checkpoint: continue after the column of a checkpoint of this parse (see checkpoint.cpp)
+    string checkpoint_key_;
+    int first_j = 0;
+    struct timeval checkpoint_time = starttime;
+    if (!checkpoint_file.empty() && !window_mode) {
+        checkpoint_key_ = checkpoint_key();
+        if (resume && read_checkpoint(checkpoint_key_, first_j, pscore) && is_verbose)
+            fprintf(stdout,"Checkpoint: resumed from %s at column %d of %d\n", checkpoint_file.c_str(), first_j + 1, seq_length);
+    }
+
+    if (first_j == 0) {
+        if(seq_length > 0) bestC[0].alpha = pf_weight(0, 0, 0);
+        if(seq_length > 1) bestC[1].alpha = pf_weight(0, 0, 1);
+        if(seq_length > 0) bestC[0].viterbi = 0;
+        if(seq_length > 1) bestC[1].viterbi = 0;
+    }
+
 
-    for(int j = 0; j < seq_length; ++j) {
+    for(int j = first_j; j < seq_length; ++j) {
 
         unordered_map<int, State>& beamstepH = bestH[j];
         unordered_map<int, State>& beamstepMulti = bestMulti[j];
@@ -297,7 +429,12 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
 
         // beam of H
         {
-            if (beam > 0 && beamstepH.size() > beam) beam_prune(beamstepH);
+            // hairpins can end far ahead of the column that adds them, before the scales of
+            // the columns in between are known; their weights are scaled once reached
+            if (use_linear)
+                for (auto &item : beamstepH) item.second.alpha *= exp(-scale_span(item.first, j));
+
+            if (need_prune(beamstepH.size())) beam_prune(beamstepH);
 
 
             if (smart_gap[j] - smart_gap[j-1] > smart_gap_threshold){
@@ -314,13 +451,14 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
 
                     for (int s = 0; s< MSA.size(); s++){
                         auto jnext_temp = next_pair_MSA[s][SS_j[s]][j];
-                        while (jnext_temp -  j < 4 && jnext_temp != -1) jnext_temp = next_pair_MSA[s][SS_j[s]][jnext_temp];
+                        while (jnext_temp != -1 && column_distance(j, jnext_temp) < 4) jnext_temp = next_pair_MSA[s][SS_j[s]][jnext_temp];
 
                         if (jnext_temp != -1) jnext = min(jnext, jnext_temp);
                     }
 
                     if (jnext == jnext_org) jnext = -1;
 
+                    if (!in_span(j, jnext)) jnext = -1;
                     next_position[j][j] = jnext;
                 }
 
@@ -348,6 +486,7 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                         if (jnext_min != jnext_org) jnext = jnext_min;
                         else jnext = -1;
 
+                        if (!in_span(j, jnext)) jnext = -1;
                         next_position[j][prev_jnext] = jnext;
 
                     }
@@ -394,7 +533,9 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
 
                     }
 
-                    Fast_LogPlusEquals(bestH[jnext][j].alpha, newscore/kTn);
+                    State & newstate = bestH[jnext][j];
+                    pf_plus_equals(newstate.alpha, pf_weight(newscore/kTn));
+                    if (joint_mfe) viterbi_max(newstate.viterbi, newscore/kTn);
                 }
             }
 
@@ -427,6 +568,7 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                         jnext = -1;
                     }
 
+                    if (!in_span(i, jnext)) jnext = -1;
                     next_position[i][j] = jnext;
 
                     while (1){
@@ -449,6 +591,7 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                             if (jnext_min != jnext_org) jnext = jnext_min;
                             else jnext = -1;
 
+                            if (!in_span(i, jnext)) jnext = -1;
                             next_position[i][prev_jnext] = jnext;
 
                         }
@@ -495,12 +638,16 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
 
                         }
 
-                        Fast_LogPlusEquals(bestH[jnext][i].alpha, newscore/kTn);
+                        State & newstate = bestH[jnext][i];
+                        pf_plus_equals(newstate.alpha, pf_weight(newscore/kTn));
+                        if (joint_mfe) viterbi_max(newstate.viterbi, newscore/kTn);
 
                     }
 
                     // 2. generate p(i, j)
-                    Fast_LogPlusEquals(beamstepP[i].alpha, state.alpha);
+                    State & newstate = beamstepP[i];
+                    pf_plus_equals(newstate.alpha, state.alpha);
+                    if (joint_mfe) viterbi_max(newstate.viterbi, state.viterbi);
 
                 }
             }
@@ -509,7 +656,13 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
 
         // beam of Multi
         {
-            if (beam > 0 && beamstepMulti.size() > beam) beam_prune(beamstepMulti);
+            if (use_linear) {
+                for (auto & push : pending_multi[j])
+                    beamstepMulti[push.i].alpha += push.value * exp(-scale_span(push.j + 1, j));
+                vector<PendingPush>().swap(pending_multi[j]);
+            }
+
+            if (need_prune(beamstepMulti.size())) beam_prune(beamstepMulti);
 
             for(auto& item : beamstepMulti) {
                 int i = item.first;
@@ -540,6 +693,7 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                         if (jnext == jnext_org){
                             jnext = -1;
                         }
+                        if (!in_span(i, jnext)) jnext = -1;
                         next_position[i][j] = jnext;
                     }
 
@@ -564,6 +718,7 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                             if (jnext_min != jnext_org) jnext = jnext_min;
                             else jnext = -1;
 
+                             if (!in_span(i, jnext)) jnext = -1;
                              next_position[i][prev_jnext] = jnext;
                         }
 
@@ -571,7 +726,7 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
 
 
                     if (jnext != -1) {
-                        Fast_LogPlusEquals(bestMulti[jnext][i].alpha, state.alpha);
+                        add_multi(i, jnext, j, state.alpha, state.viterbi);
                     }
                 }
 
@@ -591,7 +746,9 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
 
                     }
 
-                    Fast_LogPlusEquals(beamstepP[i].alpha, state.alpha + newscore / kTn);
+                    State & newstate = beamstepP[i];
+                    pf_plus_equals(newstate.alpha, pf_times(state.alpha, pf_weight(newscore / kTn)));
+                    if (joint_mfe) viterbi_max(newstate.viterbi, state.viterbi + newscore / kTn);
 
                 }
             }
@@ -608,11 +765,12 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                     pscore[i][j].ribo_score = make_pscores_ij(SS_fast[i], SS_fast[j], ribo);
                 }
 
-                state.alpha = state.alpha + pscore[i][j].ribo_score / (kTn);
+                state.alpha = pf_times(state.alpha, pf_weight(pscore[i][j].ribo_score / (kTn)));
+                if (joint_mfe) state.viterbi += pscore[i][j].ribo_score / (kTn);
 
             }
 
-            if (beam > 0 && beamstepP.size() > beam) beam_prune(beamstepP);
+            if (need_prune(beamstepP.size())) beam_prune(beamstepP);
 
             // for every state in P[j]
             //   1. generate new helix/bulge
@@ -641,7 +799,8 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                         tt2[s] = NUM_TO_PAIR(SS_j[s], SS_i[s]);
                     }
 
-                    for (int p = i - 1; p >= std::max(i - SINGLE_MAX_LEN, 0); --p) {
+                    for (int p = i - 1; p >= 0 && column_distance(p, i) <= SINGLE_MAX_LEN; --p) {
+                        if (!in_span(p, j + 1)) break;
 
                         auto & SS_p = SS_fast[p];
                         auto & s5_p = s5_fast[p];
@@ -669,10 +828,11 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                                 q = -1;
                             }
 
+                            if (!in_span(p, q)) q = -1;
                             next_position[p][j] = q;
                         }
 
-                        while (q != -1 && ((i - p) + (q - j) - 2 <= SINGLE_MAX_LEN)) {
+                        while (q != -1 && (column_distance(p, i) + column_distance(j, q) - 2 <= SINGLE_MAX_LEN)) {
   
                             auto & SS_q = SS_fast[q];
                             auto & s5_q = s5_fast[q];
@@ -704,7 +864,9 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
 
                                     }
 
-                                    Fast_LogPlusEquals(bestP[q][p].alpha, state.alpha + newscore / kTn);
+                                    State & newstate = bestP[q][p];
+                                    pf_plus_equals(newstate.alpha, pf_times(state.alpha, pf_weight(newscore / kTn, p, q, i, j)));
+                                    if (joint_mfe) viterbi_max(newstate.viterbi, state.viterbi + newscore / kTn);
 
                                 } else {
                                     // single branch
@@ -736,7 +898,9 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                                     }
 
 
-                                    Fast_LogPlusEquals(bestP[q][p].alpha, state.alpha + newscore / kTn);
+                                    State & newstate = bestP[q][p];
+                                    pf_plus_equals(newstate.alpha, pf_times(state.alpha, pf_weight(newscore / kTn, p, q, i, j)));
+                                    if (joint_mfe) viterbi_max(newstate.viterbi, state.viterbi + newscore / kTn);
 
                                 }
                             }
@@ -763,6 +927,7 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                                 }
                                 else q = temp_q;
 
+                                if (!in_span(p, q)) q = -1;
                                 next_position[p][prev_q] = q;
                             }
                         }
@@ -771,7 +936,7 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                 }
 
                 // 2. M = P
-                if(i > 0 && j < seq_length-1){
+                if(i > 0 && j < seq_length-1 && in_span(i-1, j+1)){
 
                     newscore = 0;
                     int new_nuci_1, new_nuci, new_nucj, new_nucj1;
@@ -788,7 +953,9 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                         new_nucj1 = (j + 1) < seq_length? s3_j[s] : -1;
                         newscore += (- v_score_M1(-1, -1, -1, new_nuci_1, new_nuci, new_nucj, new_nucj1, -1)); // no position information needed
                     }
-                        Fast_LogPlusEquals(beamstepM[i].alpha, state.alpha + newscore/kTn);
+                        State & newstate = beamstepM[i];
+                        pf_plus_equals(newstate.alpha, pf_times(state.alpha, pf_weight(newscore/kTn)));
+                        if (joint_mfe) viterbi_max(newstate.viterbi, state.viterbi + newscore/kTn);
 
                 }
 
@@ -810,11 +977,21 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                         newscore += (- v_score_M1(-1, -1, -1, new_nuci_1, new_nuci, new_nucj, new_nucj1, -1));
                     }
 
-                    pf_type m1_alpha = state.alpha + newscore / kTn;
-                    for (auto &m : bestM[k]) {
-                        int newi = m.first;
-                        State& m_state = m.second;
-                        Fast_LogPlusEquals(beamstepM2[newi].alpha, m_state.alpha + m1_alpha);
+                    pf_type m1_alpha = pf_times(state.alpha, pf_weight(newscore / kTn));
+                    FlatBeam & flat = flatM[k];
+                    for (int m = 0; m < flat.i.size(); ++m) {
+                        int newi = flat.i[m];
+                        if (!in_span(newi-1, j+1)) continue;
+                        if (M2_alpha[newi] == pf_zero()) M2_touched.push_back(newi);
+                        pf_plus_equals(M2_alpha[newi], pf_times(flat.alpha[m], m1_alpha));
+                    }
+                    if (joint_mfe) {
+                        pf_type m1_viterbi = state.viterbi + newscore / kTn;
+                        for (int m = 0; m < flat.i.size(); ++m) {
+                            int newi = flat.i[m];
+                            if (!in_span(newi-1, j+1)) continue;
+                            viterbi_max(M2_viterbi[newi], flat.state[m]->viterbi + m1_viterbi);
+                        }
                     }
                 }
 
@@ -838,7 +1015,8 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                             newscore += (- v_score_external_paired(-1, -1, new_nuck, new_nuck1, new_nucj, new_nucj1, -1));
                         }
 
-                        Fast_LogPlusEquals(beamstepC.alpha, prefix_C.alpha + state.alpha + newscore/kTn);
+                        pf_plus_equals(beamstepC.alpha, pf_times(pf_times(prefix_C.alpha, state.alpha), pf_weight(newscore/kTn)));
+                        if (joint_mfe) viterbi_max(beamstepC.viterbi, prefix_C.viterbi + state.viterbi + newscore/kTn);
 
                     } else {
 
@@ -851,16 +1029,30 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                             new_nucj1 = (a2s_j[s] < a2s_seq_length_1[s]) ? s3_j[s] : -1; //external.c line 1165, weird
                             newscore += - v_score_external_paired(0, j, -1, new_nuck1, new_nucj, new_nucj1, -1);
                         }
-                        Fast_LogPlusEquals(beamstepC.alpha, state.alpha + newscore/kTn);
+                        pf_plus_equals(beamstepC.alpha, pf_times(state.alpha, pf_weight(newscore/kTn)));
+                        if (joint_mfe) viterbi_max(beamstepC.viterbi, state.viterbi + newscore/kTn);
 
                     }
                 }
             }
         }
 
+        // M2 = M + P of this column, in the order the M2 were first reached (in linear space
+        // a start can be listed twice if its first terms underflowed to 0)
+        for (int newi : M2_touched) {
+            if (M2_alpha[newi] != pf_zero()) {
+                State & m2 = beamstepM2[newi];
+                m2.alpha = M2_alpha[newi];
+                M2_alpha[newi] = pf_zero();
+                if (joint_mfe) m2.viterbi = M2_viterbi[newi];
+            }
+            if (joint_mfe) M2_viterbi[newi] = VALUE_MIN;
+        }
+        M2_touched.clear();
+
         // beam of M2
         {
-            if (beam > 0 && beamstepM2.size() > beam) beam_prune(beamstepM2);
+            if (need_prune(beamstepM2.size())) beam_prune(beamstepM2);
 
             for(auto& item : beamstepM2) {
                 int i = item.first;
@@ -871,6 +1063,7 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                 auto smart_i = smart_gap[i-1];
 
                 for (int p = i-1; ((smart_i -  smart_gap[p]) <= 2*SINGLE_MAX_LEN) and p >= 0; --p) {
+                    if (!in_span(p, j + 1)) break;
 
                     if (smart_gap[p] - smart_gap[p-1] < smart_gap_threshold){
 
@@ -898,6 +1091,7 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                         if (q == jnext_org){
                             q = -1;
                         }
+                        if (!in_span(p, q)) q = -1;
                         next_position[p][j] = q;
                     }
 
@@ -922,6 +1116,7 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                             if (jnext_min != jnext_org) q = jnext_min;
                             else q = -1;
 
+                            if (!in_span(p, q)) q = -1;
                             next_position[p][prev_q] = q;
 
 
@@ -930,24 +1125,29 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
                     }
 
                     if (q != -1) {
-                        Fast_LogPlusEquals(bestMulti[q][p].alpha, state.alpha);      
+                        add_multi(p, q, j, pf_times(state.alpha, pf_weight(0, p, i-1)), state.viterbi);
                     }
                 }
 
                 // 2. M = M2
-                Fast_LogPlusEquals(beamstepM[i].alpha, state.alpha);  
+                State & newstate = beamstepM[i];
+                pf_plus_equals(newstate.alpha, state.alpha);
+                if (joint_mfe) viterbi_max(newstate.viterbi, state.viterbi);
             }
         }
 
         // beam of M
         {
-            if (beam > 0 && beamstepM.size() > beam) beam_prune(beamstepM);
+            if (need_prune(beamstepM.size())) beam_prune(beamstepM);
+            flatten_beam(beamstepM, flatM[j]);
 
             for(auto& item : beamstepM) {
                 int i = item.first;
                 State& state = item.second;
-                if (j < seq_length-1) {
-                    Fast_LogPlusEquals(bestM[j+1][i].alpha, state.alpha); 
+                if (j < seq_length-1 && in_span(i-1, j+2)) {
+                    State & newstate = bestM[j+1][i];
+                    pf_plus_equals(newstate.alpha, pf_times(state.alpha, pf_weight(0, j+1, j+1)));
+                    if (joint_mfe) viterbi_max(newstate.viterbi, state.viterbi);
                 }
             }
         }
@@ -956,7 +1156,33 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
         {
             // C = C + U
             if (j < seq_length-1) {
-                Fast_LogPlusEquals(bestC[j+1].alpha, beamstepC.alpha);    
+                pf_plus_equals(bestC[j+1].alpha, pf_times(beamstepC.alpha, pf_weight(0, j+1, j+1)));
+                if (joint_mfe) viterbi_max(bestC[j+1].viterbi, beamstepC.viterbi);
+            }
+
+            // the columns not scaled yet get the free energy per column of 0 .. j, plus what
+            // brings the scaled C of the prefix back to 1 over SCALE_HORIZON columns
+            if (use_linear && beamstepC.alpha > 0)
+                column_log_scale = (log(beamstepC.alpha) + log_scale_sum[j+1]) / (j + 1) + log(beamstepC.alpha) / SCALE_HORIZON;
+        }
+
+        ++beam_stats.columns;
+        beam_stats.beam_sum += cur_beam;
+        beam_stats.beam_lo = min(beam_stats.beam_lo, cur_beam);
+        beam_stats.beam_hi = max(beam_stats.beam_hi, cur_beam);
+        beam_stats.states += beamstepH.size() + beamstepMulti.size() + beamstepP.size() + beamstepM2.size() + beamstepM.size() + 1;
+
+        if (beam_policy == BEAM_ADAPTIVE) {
+            gettimeofday(&endtime, NULL);
+            adapt_beam(j, endtime.tv_sec - starttime.tv_sec + (endtime.tv_usec-starttime.tv_usec)/1000000.0);
+        }
+
+        if (!checkpoint_key_.empty()) {
+            gettimeofday(&endtime, NULL);
+            if (endtime.tv_sec - checkpoint_time.tv_sec + (endtime.tv_usec-checkpoint_time.tv_usec)/1000000.0 >= checkpoint_interval) {
+                if (!write_checkpoint(j, checkpoint_key_)) fprintf(stdout,"Could not write checkpoint %s!\n", checkpoint_file.c_str());
+                else if (is_verbose) fprintf(stdout,"Checkpoint: column %d of %d written to %s\n", j + 1, seq_length, checkpoint_file.c_str());
+                checkpoint_time = endtime;
             }
         }
     }  // end of for-loo j
@@ -967,16 +1193,56 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
     gettimeofday(&parse_endtime, NULL);
     double parse_elapsed_time = parse_endtime.tv_sec - parse_starttime.tv_sec + (parse_endtime.tv_usec-parse_starttime.tv_usec)/1000000.0;
 
-    fprintf(stdout,"Free Energy of Ensemble: %.2f kcal/mol\n", -kTn * viterbi.alpha / 100.0 / MSA.size());
-    if(is_verbose) fprintf(stdout,"Partition Function Calculation Time: %.2f seconds.\n", parse_elapsed_time);
+    // linear space: the outside pass runs on the scaled inside values, then both go to log space
+    bool outside_done = false;
+    if (use_linear) {
+        double mean_log_scale = scale_span(0, seq_length - 1) / seq_length;
+        if (!pf_only) {
+            outside_alifold(next_pair, pscore, smart_gap, smart_gap_threshold, next_position);
+            outside_done = true;
+        }
+        if (!log_space_values(outside_done)) {
+            if (is_verbose) fprintf(stdout,"Linear space overflow, falling back to log space\n");
+            postprocess();
+            linear_space = false;
+            parse_alifold(MSA_, a2s_, pscore, s5_, s3_, SS_, ribo_, smart_gap_);
+            linear_space = true;
+            return;
+        }
+        if (is_verbose) fprintf(stdout,"Partition Function Space: linear (mean column scale exp(%.4f))\n", mean_log_scale);
+    }
+
+    // the MFE structure from the same inside pass, as bin/linearalifold prints it
+    if (joint_mfe && !window_mode) {
+        double ribo_sum;
+        string structure = mfe_structure(pscore, ribo_sum);
+        if (!column_map.empty()) structure = expand_structure(structure, column_map, original_seq.size());
+        joint_mfe_structure = structure;
+        joint_mfe_energy = -kTn * viterbi.viterbi / 100.0 / MSA.size();
+        joint_mfe_covariance = -ribo_sum / 100.0 / MSA.size();
+    }
+
+    ensemble_energy = -kTn * viterbi.alpha / 100.0 / MSA.size();
+    if (!window_mode && !keep_results) output_energies();
+    if(is_verbose) {
+        if (beam_policy == BEAM_MARGIN) fprintf(stdout,"Beam Policy: margin (%.2f kcal/mol)\n", beam_margin);
+        else if (beam_policy == BEAM_ADAPTIVE) fprintf(stdout,"Beam Policy: adaptive (budget %.2f seconds)\n", time_budget);
+        else fprintf(stdout,"Beam Policy: fixed\n");
+        fprintf(stdout,"Beam Per Column: avg %.1f, min %d, max %d\n", beam_stats.columns ? beam_stats.beam_sum / beam_stats.columns : 0., beam_stats.beam_lo, beam_stats.beam_hi);
+        fprintf(stdout,"Pruned States: %lu\n", beam_stats.pruned);
+        fprintf(stdout,"States in the Beams: %lu\n", beam_stats.states);
+        fprintf(stdout,"Partition Function Calculation Time: %.2f seconds.\n", parse_elapsed_time);
+    }
     fflush(stdout);
 
+    if (sample_number > 0) sample(pscore);
+
     // lhuang
     if(pf_only && !forest_file.empty()) dump_forest(seq, true); // inside-only forest
 
     if(!pf_only){
 
-        outside_alifold(next_pair, pscore, smart_gap, smart_gap_threshold, next_position);
+        if (!outside_done) outside_alifold(next_pair, pscore, smart_gap, smart_gap_threshold, next_position);
 
         if (!forest_file.empty())
           dump_forest(seq, false); // inside-outside forest
@@ -990,31 +1256,44 @@ void BeamCKYParser::parse_alifold(std::vector<std::string> & MSA_, vector<vector
             ThreshKnot(seq);
         }
     }
+    // the results are out, the checkpoint of this parse is not needed any more
+    if (!checkpoint_key_.empty()) unlink(checkpoint_file.c_str());
     postprocess();
     return;
 }
 
 
+void BeamCKYParser::output_energies() {
+    if (joint_mfe) fprintf(stdout, "%s (%.2f = %.2f + %.2f)\n", joint_mfe_structure.c_str(), joint_mfe_energy, joint_mfe_energy - joint_mfe_covariance, joint_mfe_covariance);
+    fprintf(stdout,"Free Energy of Ensemble: %.2f kcal/mol\n", ensemble_energy);
+}
+
 void BeamCKYParser::print_states(FILE *fptr, unordered_map<int, State>& states, int j, string label, bool inside_only, double threshold) {    
     for (auto & item : states) {
         int i = item.first;
         State & state = item.second;
-        if (inside_only) fprintf(fptr, "%s %d %d %.5lf\n", label.c_str(), i+1, j+1, state.alpha);
+        if (inside_only) fprintf(fptr, "%s %d %d %.5lf\n", label.c_str(), original_index(i)+1, original_index(j)+1, state.alpha);
         else if (state.alpha + state.beta > threshold) // lhuang : alpha + beta - totalZ < ...
-            fprintf(fptr, "%s %d %d %.5lf %.5lf\n", label.c_str(), i+1, j+1, state.alpha, state.beta);
+            fprintf(fptr, "%s %d %d %.5lf %.5lf\n", label.c_str(), original_index(i)+1, original_index(j)+1, state.alpha, state.beta);
     }
 }
 
 void BeamCKYParser::dump_forest(string seq, bool inside_only) {  
     printf("Dumping (%s) Forest to %s...\n", (inside_only ? "Inside-Only" : "Inside-Outside"), forest_file.c_str());
+    if (forest_binary) {
+        unordered_map<int, State> * const beams[FOREST_TYPES] = {bestP, bestM, bestM2, bestMulti};
+        if (!write_binary_forest(forest_file, column_map.empty() ? seq : original_seq, column_map, seq.length(), bestC, beams, inside_only, forest_threshold))
+            printf("Could not write file!\n");
+        return;
+    }
     FILE *fptr = fopen(forest_file.c_str(), "w");  // lhuang: should be fout >>
-    fprintf(fptr, "%s\n", seq.c_str());
+    fprintf(fptr, "%s\n", column_map.empty() ? seq.c_str() : original_seq.c_str());
     int n = seq.length(), j;
     for (j = 0; j < n; j++) {
-        if (inside_only) fprintf(fptr, "E %d %.5lf\n", j+1, bestC[j].alpha);
-        else fprintf(fptr, "E %d %.5lf %.5lf\n", j+1, bestC[j].alpha, bestC[j].beta);
+        if (inside_only) fprintf(fptr, "E %d %.5lf\n", original_index(j)+1, bestC[j].alpha);
+        else fprintf(fptr, "E %d %.5lf %.5lf\n", original_index(j)+1, bestC[j].alpha, bestC[j].beta);
     }
-    double threshold = bestC[n-1].alpha - 9.91152; // lhuang -9.xxx or ?
+    double threshold = bestC[n-1].alpha - forest_threshold; // lhuang -9.xxx or ?
     for (j = 0; j < n; j++) 
         print_states(fptr, bestP[j], j, "P", inside_only, threshold);
     for (j = 0; j < n; j++) 
@@ -1023,6 +1302,7 @@ void BeamCKYParser::dump_forest(string seq, bool inside_only) {
         print_states(fptr, bestM2[j], j, "M2", inside_only, threshold);
     for (j = 0; j < n; j++) 
         print_states(fptr, bestMulti[j], j, "Multi", inside_only, threshold);
+    fclose(fptr);
 }
 
 BeamCKYParser::BeamCKYParser(int beam_size,
@@ -1039,8 +1319,16 @@ BeamCKYParser::BeamCKYParser(int beam_size,
                              bool MEA_bpseq,
                              bool ThreshKnot,
                              float ThreshKnot_threshold,
-                             string ThreshKnot_file_index)
+                             string ThreshKnot_file_index,
+                             BeamPolicy policy,
+                             float margin,
+                             float budget,
+                             int max_span)
     : beam(beam_size), 
+      beam_policy(policy),
+      beam_margin(margin),
+      time_budget(budget),
+      span(max_span),
       no_sharp_turn(nosharpturn), 
       is_verbose(verbose),
       bpp_file(bppfile),
@@ -1064,6 +1352,8 @@ BeamCKYParser::BeamCKYParser(int beam_size,
 
 }
 
+// built into liblinearalifold (see liblinearalifold.cpp) without main
+#ifndef LINEARALIFOLD_LIBRARY
 int main(int argc, char** argv){
 
     struct timeval total_starttime, total_endtime;
@@ -1085,6 +1375,33 @@ int main(int argc, char** argv){
     float ThreshKnot_threshold = 0.3;
     bool ThreshKnot = false;
     string ThresKnot_prefix;
+    string beam_policy = "fixed";
+    float beam_margin = 0.0;
+    float time_budget = 0.0;
+    int span = 0;
+    int window_size = 0;
+    string unpaired_file;
+    float gap_fraction = 0.0;
+    int sample_number = 0;
+    int sample_threads = 1;
+    bool sample_nonredundant = false;
+    long sample_seed = -1;
+    bool linear_space = false;
+    bool joint_mfe = false;
+    string index_file;
+    string server_address;
+    int server_threads = 1;
+    string bpp_format_name = "text";
+    string container_file;
+    string forest_format = "text";
+    double forest_threshold = 9.91152;
+    string cache_dir;
+    double cache_size = 1024; // MB
+    string checkpoint_file;
+    double checkpoint_interval = 600; // seconds
+    bool resume = false;
+    vector<int> sweep_beams;
+    int sweep_threads = 0;
 
 
     if (argc > 1) {
@@ -1104,9 +1421,119 @@ int main(int argc, char** argv){
         MEA_prefix = argv[14];
         MEA_bpseq = atoi(argv[15]) == 1;
     }
+    if (argc > 16) {
+        beam_policy = argv[16];
+        beam_margin = atof(argv[17]);
+        time_budget = atof(argv[18]);
+    }
+    if (argc > 19) span = atoi(argv[19]);
+    if (argc > 21) {
+        window_size = atoi(argv[20]);
+        unpaired_file = argv[21];
+    }
+    if (argc > 22) gap_fraction = atof(argv[22]);
+    if (argc > 26) {
+        sample_number = atoi(argv[23]);
+        sample_threads = atoi(argv[24]);
+        sample_nonredundant = atoi(argv[25]) == 1;
+        sample_seed = atol(argv[26]);
+    }
+    if (argc > 27) linear_space = atoi(argv[27]) == 1;
+    if (argc > 28) joint_mfe = atoi(argv[28]) == 1;
+    if (argc > 29) index_file = argv[29];
+    if (argc > 31) {
+        server_address = argv[30];
+        server_threads = atoi(argv[31]);
+    }
+    if (argc > 32) bpp_format_name = argv[32];
+    if (argc > 33) container_file = argv[33];
+    if (argc > 35) {
+        forest_format = argv[34];
+        forest_threshold = atof(argv[35]);
+    }
+    if (argc > 37) {
+        cache_dir = argv[36];
+        cache_size = atof(argv[37]);
+    }
+    if (argc > 40) {
+        checkpoint_file = argv[38];
+        checkpoint_interval = atof(argv[39]);
+        resume = atoi(argv[40]) == 1;
+    }
+    if (argc > 42) {
+        stringstream beams(argv[41]);
+        string beam;
+        while (getline(beams, beam, ','))
+            if (!beam.empty()) sweep_beams.push_back(atoi(beam.c_str()));
+        sweep_threads = atoi(argv[42]);
+    }
+
+    // local folding in windows: pairs must fit in a window, RNAplfold's default span is 2/3 of it
+    if (window_size > 0 && (span <= 0 || span > window_size)) span = (span <= 0) ? window_size * 2 / 3 : window_size;
+
+    BeamPolicy policy = BEAM_FIXED;
+    if (beam_policy == "margin") policy = BEAM_MARGIN;
+    else if (beam_policy == "adaptive") policy = BEAM_ADAPTIVE;
+    else if (beam_policy != "fixed") {
+        printf("Unknown beam policy %s, use fixed, margin or adaptive.\n", beam_policy.c_str());
+        return 1;
+    }
+
+    BppFormat bpp_format = BPP_TEXT;
+    if (bpp_format_name == "binary") bpp_format = BPP_BINARY;
+    else if (bpp_format_name == "binary16") bpp_format = BPP_BINARY16;
+    else if (bpp_format_name != "text") {
+        printf("Unknown bpp format %s, use text, binary or binary16.\n", bpp_format_name.c_str());
+        return 1;
+    }
+    if (bpp_format != BPP_TEXT && window_size > 0) {
+        printf("Window probabilities are written as text only, use --bpp_format text.\n");
+        return 1;
+    }
+    if (forest_format != "text" && forest_format != "binary") {
+        printf("Unknown forest format %s, use text or binary.\n", forest_format.c_str());
+        return 1;
+    }
+    if (!container_file.empty() && (!bpp_prefix.empty() || !MEA_prefix.empty() || !ThresKnot_prefix.empty() || window_size > 0)) {
+        printf("Choose either --container or --prefix / --mea_prefix / --threshknot_prefix / --window!\n");
+        return 1;
+    }
+    if (!cache_dir.empty() && (window_size > 0 || sample_number > 0 || !forest_file.empty())) {
+        printf("Choose either --cache or --window / --sample / --dumpforest!\n");
+        return 1;
+    }
+    // the beams of the adaptive policy depend on the time taken, they would not be the same after a resume
+    if (!checkpoint_file.empty() && (window_size > 0 || !server_address.empty() || policy == BEAM_ADAPTIVE)) {
+        printf("Choose either --checkpoint or --window / --server / --beam_policy adaptive!\n");
+        return 1;
+    }
+    // a sweep prints the results of every beam on stdout, and shares nothing but the prepared alignment
+    if (!sweep_beams.empty() && (window_size > 0 || !server_address.empty() || !container_file.empty() || !bpp_file.empty() || !bpp_prefix.empty()
+                                 || !MEA_prefix.empty() || !ThresKnot_prefix.empty() || !forest_file.empty() || sample_number > 0 || !cache_dir.empty() || !checkpoint_file.empty())) {
+        printf("Choose either --sweep or --window / --server / --container / -o / --prefix / --mea_prefix / --threshknot_prefix / --dumpforest / -k / --cache / --checkpoint!\n");
+        return 1;
+    }
+    if (resume && checkpoint_file.empty()) {
+        printf("--resume needs --checkpoint!\n");
+        return 1;
+    }
+
+    FoldOptions options = {beamsize, mea, MEA_gamma, ThreshKnot, ThreshKnot_threshold, bpp_cutoff, joint_mfe, span, gap_fraction,
+                           !sharpturn, policy, beam_margin, time_budget, linear_space};
+
+    // --cache: results of alignments folded before (see Utils/result_cache.h and cache.cpp)
+    ResultCache cache;
+    if (!cache_dir.empty() && !cache.open(cache_dir, uint64_t(cache_size * 1048576))) {
+        printf("Could not open cache directory %s!\n", cache_dir.c_str());
+        return 1;
+    }
 
 
+    // fold server: no input here, alignments come with the requests (see server.cpp)
+    if (!server_address.empty()) return run_fold_server(server_address, server_threads, options, is_verbose, cache.enabled() ? &cache : NULL);
+
     if (is_verbose) printf("beam size: %d\n", beamsize);
+    if (is_verbose && span > 0) printf("max base pair span: %d\n", span);
 
     // variables for decoding
     int num=0, total_len = 0;
@@ -1121,56 +1548,224 @@ int main(int argc, char** argv){
 
 
     std::vector<std::string> MSA_;
-
-    for (string seq; getline(cin, seq);) {
-        if (seq.length() == 0)
-            continue;
-
-        if (seq[0] == ';' || seq[0] == '>') {
-            // printf("%s\n", seq.c_str());
-            if (!bpp_file.empty()) {
-                FILE *fptr = fopen(bpp_file.c_str(), "a"); 
-                if (fptr == NULL) { 
-                    printf("Could not open file!\n"); 
-                    return 0; 
-                }
-                fprintf(fptr, "%s\n", seq.c_str());
-                fclose(fptr); 
-            }
-            continue;
+    std::vector<std::string> names;
+    string id; // #=GF ID of Stockholm
+
+    // the alignments of stdin, in any of the formats of Utils/alignment_reader.h and one after
+    // the other (a batch); the next one is read before one is folded, to tell a batch
+    AlignmentReader reader(0);
+    std::vector<std::string> next_MSA, next_names;
+    string next_id;
+    bool has_next = false;
+
+    // an existing alignment index replaces the input and its preparation (see Utils/alignment_index.h)
+    AlignmentIndex index;
+    bool from_index = false;
+    struct stat index_stat;
+    struct timeval index_starttime, index_endtime;
+    gettimeofday(&index_starttime, NULL);
+    if (!index_file.empty() && stat(index_file.c_str(), &index_stat) == 0) {
+        if (!load_alignment_index(index_file, index)) {
+            printf("Could not read alignment index %s!\n", index_file.c_str());
+            return 1;
+        }
+        if (index.gap_fraction != gap_fraction) {
+            printf("Alignment index %s was made with gap fraction %.2f, not %.2f!\n", index_file.c_str(), index.gap_fraction, gap_fraction);
+            return 1;
+        }
+        from_index = true;
+        MSA_ = index.MSA;
+        names = index.names;
+        // an alignment on stdin (none is read from a terminal) must be the one the index was made of
+        if (!isatty(0) && reader.next(next_MSA, next_names) && alignment_index_key(next_MSA) != index.input_key) {
+            printf("Alignment index %s was made from another alignment!\n", index_file.c_str());
+            return 1;
+        }
+        next_MSA.clear();
+        next_names.clear();
+    }
+    else {
+        if (!reader.next(MSA_, names)) {
+            printf("Could not read the alignment: %s!\n", reader.error.empty() ? "no alignment in the input" : reader.error.c_str());
+            return 1;
+        }
+        id = reader.id;
+        // an index is made of the first alignment of the input only
+        has_next = index_file.empty() && reader.next(next_MSA, next_names);
+        next_id = reader.id;
+    }
+    bool batch = has_next;
+
+    // -o mode: one file for every alignment of the batch, opened once
+    FILE * bpp_out = NULL;
+    if (!bpp_file.empty()) {
+        bpp_out = fopen(bpp_file.c_str(), "a");
+        if (bpp_out == NULL) {
+            printf("Could not open file!\n");
+            return 1;
         }
+    }
 
-        seq_index ++;
-        if (!bpp_prefix.empty()) bpp_file_index = bpp_prefix + to_string(seq_index);
+    // --container: the results of every alignment go to one file (see Utils/result_container.h)
+    ContainerWriter container;
+    if (!container_file.empty() && !container.open(container_file)) {
+        printf("Could not open file!\n");
+        return 1;
+    }
 
-        if (!ThresKnot_prefix.empty()) ThreshKnot_file_index = ThresKnot_prefix + to_string(seq_index);
+    for (int record = 1; ; record++) {
+        string name = id.empty() ? "alignment " + to_string(record) : id;
+        if (batch) printf(">%s\n", name.c_str());
 
+        // the names head a text matrix, and go into a binary record
+        if (bpp_out != NULL && bpp_format == BPP_TEXT)
+            for (auto & name : names) fprintf(bpp_out, "%s\n", name.c_str());
+
+        seq_index = batch ? record : MSA_.size();
+        if (!bpp_prefix.empty()) bpp_file_index = bpp_prefix + to_string(seq_index);
+        if (!ThresKnot_prefix.empty()) ThreshKnot_file_index = ThresKnot_prefix + to_string(seq_index);
         if (!MEA_prefix.empty()) MEA_file_index = MEA_prefix + to_string(seq_index);
-        
-        // convert to uppercase
-        transform(seq.begin(), seq.end(), seq.begin(), ::toupper);
 
-        // convert T to U
-        replace(seq.begin(), seq.end(), 'T', 'U');
+        // the result cache, before anything is prepared; an index's rows are its folded columns,
+        // so its column map goes into the key (the adaptive policy depends on the time taken)
+        string cache_options, cache_key, cached;
+        bool cache_hit = false;
+        if (cache.enabled() && policy != BEAM_ADAPTIVE) {
+            cache_options = result_cache_options(options, pf_only);
+            if (from_index) {
+                CacheKey columns;
+                columns.add(index.column_map.data(), index.column_map.size() * sizeof(int));
+                cache_options += " index=" + columns.hex();
+            }
+            cache_key = result_cache_key(cache_options, MSA_);
+        }
 
-        MSA_.push_back(seq);
+        auto n_seq = MSA_.size();
+        BeamCKYParser parser(beamsize, !sharpturn, is_verbose, bpp_file, bpp_file_index, pf_only, bpp_cutoff, forest_file, mea, MEA_gamma, MEA_file_index, MEA_bpseq, ThreshKnot, ThreshKnot_threshold, ThreshKnot_file_index, policy, beam_margin, time_budget, span);
+        parser.sample_number = sample_number;
+        parser.sample_threads = sample_threads;
+        parser.sample_nonredundant = sample_nonredundant;
+        parser.sample_seed = sample_seed;
+        parser.linear_space = linear_space;
+        parser.joint_mfe = joint_mfe;
+        parser.bpp_format = bpp_format;
+        parser.bpp_out = bpp_out;
+        if (bpp_format != BPP_TEXT) parser.bpp_names = names;
+        parser.keep_results = !container_file.empty();
+        parser.forest_binary = forest_format == "binary";
+        parser.forest_threshold = forest_threshold;
+        // a checkpoint file per alignment of a batch, so that the others do not overwrite the one to resume
+        if (!checkpoint_file.empty()) parser.checkpoint_file = batch ? checkpoint_file + "." + to_string(record) : checkpoint_file;
+        parser.checkpoint_interval = checkpoint_interval;
+        parser.resume = resume;
+        cache_hit = !cache_key.empty() && cache.load(cache_key, cache_options, cached) && parser.restore_results(cached);
+
+        // the ribosum of a hit is only needed for an index to write
+        float ** ribo_ = NULL;
+        if (from_index) ribo_ = index.ribo;
+        else if (!cache_hit || !index_file.empty()) ribo_ = get_ribosum(MSA_, n_seq, MSA_[0].size());
+
+        string input_key = index_file.empty() || from_index ? "" : alignment_index_key(MSA_);
+
+        // fold without the gappy columns (ribosum from the full alignment); outputs are in original columns
+        if (from_index && !index.column_map.empty()) {
+            parser.original_seq = index.original_seq;
+            parser.column_map = index.column_map;
+        }
+        else if (!from_index && gap_fraction > 0) {
+            parser.original_seq = MSA_[0];
+            parser.column_map = compress_gap_columns(MSA_, gap_fraction);
+        }
+        if (is_verbose && !parser.column_map.empty()) printf("folded columns: %d of %d (gap fraction < %.2f)\n", (int)MSA_[0].size(), (int)parser.original_seq.size(), gap_fraction);
 
-        // printf("%s\n", seq.c_str());
+        if (!index_file.empty() && !from_index) {
+            if (!write_alignment_index(index_file, input_key, names, MSA_, parser.column_map.empty() ? MSA_[0] : parser.original_seq, parser.column_map, gap_fraction, ribo_, span))
+                printf("Could not write alignment index %s!\n", index_file.c_str());
+        }
+        if (is_verbose && !index_file.empty()) {
+            gettimeofday(&index_endtime, NULL);
+            double index_elapsed_time = index_endtime.tv_sec - index_starttime.tv_sec + (index_endtime.tv_usec-index_starttime.tv_usec)/1000000.0;
+            printf("Alignment Index: %s %s in %.2f seconds.\n", from_index ? "loaded from" : "written to", index_file.c_str(), index_elapsed_time);
+        }
 
-    }
+        auto MSA_seq_length = MSA_[0].size();
+        if (window_size > 0) {
+            FILE * unpaired_out = unpaired_file.empty() ? NULL : fopen(unpaired_file.c_str(), "w");
+            if (!unpaired_file.empty() && unpaired_out == NULL) {
+                printf("Could not open file!\n");
+                return 1;
+            }
+            parser.parse_windows(MSA_, ribo_, window_size, bpp_out == NULL ? stdout : bpp_out, unpaired_out);
+            if (unpaired_out != NULL) fclose(unpaired_out);
+        }
+        else if (cache_hit) {
+            if (is_verbose) printf("Result Cache: %s from %s\n", cache_key.c_str(), cache_dir.c_str());
+            parser.replay_results(MSA_);
+        }
+        else {
+            auto pscore = init_pscores_only(MSA_seq_length, span);
+            vector<float> smart_gap;
+            vector<vector<int>> a2s_fast, s5_fast, s3_fast, SS_fast;
+            if (from_index) {
+                index.fill_pscores(pscore);
+                a2s_fast.swap(index.a2s);
+                s5_fast.swap(index.s5);
+                s3_fast.swap(index.s3);
+                SS_fast.swap(index.SS);
+                smart_gap.swap(index.smart_gap);
+            }
+            else a2s_prepare_is(MSA_, n_seq, MSA_seq_length, a2s_fast, s5_fast, s3_fast, SS_fast, smart_gap);
+            if (!sweep_beams.empty()) {
+                auto make_parser = [&](int beam) {
+                    BeamCKYParser * sweep_parser = new BeamCKYParser(beam, !sharpturn, false, "", "", pf_only, bpp_cutoff, "", mea, MEA_gamma, "", MEA_bpseq, ThreshKnot, ThreshKnot_threshold, "", policy, beam_margin, time_budget, span);
+                    sweep_parser->linear_space = linear_space;
+                    sweep_parser->joint_mfe = joint_mfe;
+                    sweep_parser->original_seq = parser.original_seq;
+                    sweep_parser->column_map = parser.column_map;
+                    return sweep_parser;
+                };
+                run_sweep(sweep_beams, sweep_threads, make_parser, MSA_, a2s_fast, pscore, s5_fast, s3_fast, SS_fast, ribo_, smart_gap);
+            }
+            else parser.parse_alifold(MSA_, a2s_fast, pscore, s5_fast, s3_fast, SS_fast, ribo_, smart_gap);
+            if (!cache_key.empty() && !cache.store(cache_key, cache_options, parser.cache_results()))
+                printf("Could not write to cache directory %s!\n", cache_dir.c_str());
+        }
+
+        // (--container is not with --window)
+        if (!container_file.empty()) {
+            string bpp;
+            if (!pf_only) {
+                int original_length = parser.column_map.empty() ? MSA_seq_length : parser.original_seq.size();
+                append_binary_bpp(bpp, parser.bpp_pairs(), original_length, names, bpp_format == BPP_BINARY16);
+            }
+            container.add(name, container_record(name, parser.ensemble_energy, parser.joint_mfe_structure, parser.joint_mfe_energy,
+                                                 parser.joint_mfe_covariance, parser.mea_structure, parser.threshknot_pairs, bpp));
+        }
 
-    auto n_seq = MSA_.size();
-    auto MSA_seq_length = MSA_[0].size();
-    auto ribo_ = get_ribosum(MSA_, n_seq, MSA_seq_length);
-    auto pscore = init_pscores_only(MSA_seq_length);
-    vector<float> smart_gap;
-    vector<vector<int>> a2s_fast, s5_fast, s3_fast, SS_fast;
-    a2s_prepare_is(MSA_, n_seq, MSA_seq_length, a2s_fast, s5_fast, s3_fast, SS_fast, smart_gap);
-    BeamCKYParser parser(beamsize, !sharpturn, is_verbose, bpp_file, bpp_file_index, pf_only, bpp_cutoff, forest_file, mea, MEA_gamma, MEA_file_index, MEA_bpseq, ThreshKnot, ThreshKnot_threshold, ThreshKnot_file_index);
-    parser.parse_alifold(MSA_, a2s_fast, pscore, s5_fast, s3_fast, SS_fast, ribo_, smart_gap);
+        if (!has_next) break;
+        if (ribo_ != NULL && !from_index) {
+            for (int i = 0; i < 7; i++) free(ribo_[i]);
+            free(ribo_);
+        }
+        MSA_.swap(next_MSA);
+        names.swap(next_names);
+        id = next_id;
+        has_next = reader.next(next_MSA, next_names);
+        next_id = reader.id;
+    }
+    if (bpp_out != NULL) fclose(bpp_out);
+    if (!container.close()) {
+        printf("Could not write %s!\n", container_file.c_str());
+        return 1;
+    }
+    if (!reader.error.empty()) {
+        printf("Could not read the alignment: %s!\n", reader.error.c_str());
+        return 1;
+    }
 
     gettimeofday(&total_endtime, NULL);
     double total_elapsed_time = total_endtime.tv_sec - total_starttime.tv_sec + (total_endtime.tv_usec-total_starttime.tv_usec)/1000000.0;
 
     return 0;
 }
+#endif
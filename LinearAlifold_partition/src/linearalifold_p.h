@@ -9,16 +9,23 @@
 #include <unordered_map>
 #include <math.h> 
 #include <set>
+#include <mutex>
+#include <random>
 
 // #define MIN_CUBE_PRUNING_SIZE 20
+#define ADAPTIVE_BEAM_MIN 10 // smallest per-column beam the adaptive policy may use
 #define kT 61.63207755
+#define SAMPLE_CACHE_SHARDS 64 // locks of the hyperedge cache shared by the sampling threads
+#define SCALE_HORIZON 64 // linear space: columns over which a drift of the column scales is undone
 
 #define NEG_INF -2e20 
 
 using namespace std;
 
-#ifdef lpv
-  typedef double pf_type;
+// -DFAST_FLOAT: single precision partition functions (half the beam memory); log-space sums
+// go through Fast_Exp / Fast_LogExpPlusOne, which are only accurate to ~1e-5 anyway
+#ifdef FAST_FLOAT
+  typedef float pf_type;
 #else
   typedef double pf_type;
 #endif
@@ -26,10 +33,10 @@ using namespace std;
 
 #ifdef lpv
   typedef int value_type;
-  #define VALUE_MIN numeric_limits<double>::lowest()
+  #define VALUE_MIN numeric_limits<pf_type>::lowest()
 #else
   typedef double value_type;
-  #define VALUE_MIN numeric_limits<double>::lowest()
+  #define VALUE_MIN numeric_limits<pf_type>::lowest()
 #endif
 
 // A hash function used to hash a pair of any kind 
@@ -57,12 +64,105 @@ struct comp
     }
 };
 
+enum BeamPolicy {
+    BEAM_FIXED = 0, // 0: keep the top-k states of every beam (k = beam)
+    BEAM_MARGIN,    // 1: top-k, and drop states worse than the best by more than a margin
+    BEAM_ADAPTIVE,  // 2: top-k, with k adjusted per column to fit a runtime budget
+};
+
+enum BppFormat {
+    BPP_TEXT = 0,   // 0: "i j prob" lines
+    BPP_BINARY,     // 1: sparse matrix records with float probabilities (see Utils/bpp_binary.h)
+    BPP_BINARY16,   // 2: the same with 16-bit quantised probabilities
+};
+
+// what a request of the fold server can set (see server.cpp); the server's command line gives the defaults
+struct FoldOptions {
+    int beam;
+    bool mea;
+    float gamma;
+    bool threshknot;
+    float threshold;    // ThreshKnot
+    float bpp_cutoff;
+    bool mfe;           // joint_mfe
+    int span;
+    float gap_fraction; // compress_gap_columns, 0 to fold every column
+
+    // from the command line only
+    bool no_sharp_turn;
+    BeamPolicy beam_policy;
+    float beam_margin, time_budget;
+    bool linear_space;
+};
+
+class ResultCache;
+
+// the options text of the result cache key of a parse with options (see cache.cpp)
+string result_cache_options(const FoldOptions & options, bool pf_only);
+
 struct State {
 
     pf_type alpha;
     pf_type beta;
+    // joint_mfe: best (Viterbi) score of the state, newscore / kTn, always in log space
+    pf_type viterbi;
+
+    // the empty sum: VALUE_MIN in log space, 0 while a parse runs in linear space (per thread,
+    // so that the parsers of the fold server's workers do not share it)
+    static thread_local pf_type zero;
+
+    State(): alpha(zero), beta(zero), viterbi(VALUE_MIN) {};
+};
+
+// L x L table that keeps, for row i, only the columns i .. i+width-1 (pairs spanning
+// at most width columns), in one L*width block; t[i][j] reads as for vector<vector<T>>
+template <typename T>
+class SpanTable {
+public:
+    SpanTable(): width(0) {};
+    SpanTable(int n, int w, const T & init = T()) { resize(n, w, init); };
+
+    void resize(int n, int w, const T & init = T()) {
+        width = w;
+        data.assign((size_t)n * w, init);
+    };
+
+    T * operator[](int i) { return data.data() + (size_t)i * (width - 1); };
+    const T * operator[](int i) const { return data.data() + (size_t)i * (width - 1); };
 
-    State(): alpha(VALUE_MIN), beta(VALUE_MIN) {};
+    int width;
+
+private:
+    std::vector<T> data;
+};
+
+// sampling: a state of the inside beams, and one hyperedge into it (at most two children;
+// the weight is its probability given the state once recovered)
+enum SampleType {
+    SAMPLE_NONE = 0,
+    SAMPLE_C,
+    SAMPLE_P,
+    SAMPLE_M,
+    SAMPLE_M2,
+    SAMPLE_Multi,
+};
+
+struct SampleNode {
+    SampleType type;
+    int i, j;
+};
+
+struct HyperEdge {
+    pf_type weight;
+    SampleNode left, right;
+};
+
+// non-redundant sampling: one node per choice made so far; taken is the share of its
+// probability that belongs to structures already sampled, prob that of the choice into it
+struct TrieNode {
+    double prob;
+    double taken;
+    vector<pair<int, int>> children; // (hyperedge, node)
 };
 
 struct ribo_state {
@@ -75,6 +175,10 @@ struct ribo_state {
 class BeamCKYParser {
 public:
     int beam;
+    BeamPolicy beam_policy;
+    float beam_margin; // kcal/mol per sequence, for BEAM_MARGIN
+    float time_budget; // seconds for inside (and outside), for BEAM_ADAPTIVE
+    int span; // > 0: local folding, only pairs (i, j) with j - i < span
     bool no_sharp_turn;
     bool is_verbose;
     string bpp_file;
@@ -94,6 +198,16 @@ public:
 
     int jnext_org = 1000000000;
 
+    // what beam_prune did over one parse
+    struct BeamStats {
+        unsigned long pruned;  // states removed from the beams
+        unsigned long columns; // columns processed
+        double beam_sum;       // sum of the per-column beam, for the average
+        int beam_lo, beam_hi;  // smallest and largest per-column beam
+        unsigned long states;  // states left in the beams after pruning
+    };
+
+    BeamStats beam_stats;
 
     BeamCKYParser(int beam_size=100,
                   bool nosharpturn=true,
@@ -109,12 +223,100 @@ public:
                   bool bpseq=false,
                   bool threshknot_=false,
                   float threshknot_threshold=0.3,
-                  string threshknot_file_index="");
+                  string threshknot_file_index="",
+                  BeamPolicy beam_policy=BEAM_FIXED,
+                  float beam_margin=0.0,
+                  float time_budget=0.0,
+                  int max_span=0);
 
     // DecoderResult parse(string& seq);
     // void parse(string& seq);
 
-    void parse_alifold(std::vector<std::string> & MSA, vector<vector<int>> & a2s, vector<vector<ribo_state>> & pscore, vector<vector<int>> & s5, vector<vector<int>> & s3, vector<vector<int>> & SS, float ** ribo, vector<float> & smart_gap);
+    void parse_alifold(std::vector<std::string> & MSA, vector<vector<int>> & a2s, SpanTable<ribo_state> & pscore, vector<vector<int>> & s5, vector<vector<int>> & s3, vector<vector<int>> & SS, float ** ribo, vector<float> & smart_gap);
+
+    // fold the requests read from in and write the responses to out, until the end of in or quit
+    void serve(FILE * in, FILE * out, const FoldOptions & defaults);
+
+    // fold MSA (upper case, U for T) with options into the results below, as a request of the
+    // fold server or of the library (see liblinearalifold.cpp); false (and error) if it cannot be folded
+    bool fold(std::vector<std::string> & MSA, const FoldOptions & options, std::string & error);
+
+    // Pij with probability of at least bpp_cutoff, 1-based original columns, by i then j
+    vector<pair<pair<int, int>, pf_type>> bpp_pairs();
+
+    // local pair and unpaired probabilities from overlapping windows, written out as they are final
+    void parse_windows(std::vector<std::string> & MSA, float ** ribo, int window_size, FILE * bpp_out, FILE * unpaired_out);
+
+    // set for the parsers of parse_windows, which only keep Pij
+    bool window_mode = false;
+
+    // original column of every folded one, if gappy columns were left out (compress_gap_columns)
+    vector<int> column_map;
+    string original_seq;
+
+    // (also for the column just outside either end, which the span limits ask about)
+    int original_index(int i) {
+        if (column_map.empty()) return i;
+        if (i < 0) return column_map[0] + i;
+        if (i >= (int)column_map.size()) return column_map.back() + i - (int)column_map.size() + 1;
+        return column_map[i];
+    };
+
+    // j - i in original columns: the hairpin, interior loop and span limits count the columns
+    // left out too, so that leaving out all-gap columns gives the result of folding them
+    int column_distance(int i, int j) {
+        return original_index(j) - original_index(i);
+    };
+
+    // how the bpp matrix is written to bpp_file / bpp_file_index; bpp_out: a file opened once for
+    // a whole batch to write to instead of bpp_file; bpp_names: the names of a binary record
+    BppFormat bpp_format = BPP_TEXT;
+    FILE * bpp_out = NULL;
+    vector<string> bpp_names;
+
+    // forest_file as arrays (see Utils/forest_binary.h) instead of text; with outside, states
+    // with alpha + beta below log Z - forest_threshold are left out of either
+    bool forest_binary = false;
+    double forest_threshold = 9.91152;
+
+    // > 0: draw this many structures from the inside beams (see sample.cpp)
+    int sample_number = 0;
+    int sample_threads = 1;
+    bool sample_nonredundant = false;
+    long sample_seed = -1; // < 0: a random seed
+
+    // inside and outside in linear space (see use_linear); log space if they overflow
+    bool linear_space = false;
+
+    // the inside pass also keeps the Viterbi score of every state, and the MFE structure is
+    // traced back over the same beams (see sample.cpp)
+    bool joint_mfe = false;
+
+    // results of the last parse, also printed (or written to the files above) unless
+    // keep_results is set, as for the fold server's parsers (see server.cpp)
+    bool keep_results = false;
+    double ensemble_energy = 0;                              // kcal/mol per sequence
+    string joint_mfe_structure;                              // joint_mfe, in the original columns
+    double joint_mfe_energy = 0, joint_mfe_covariance = 0;   // kcal/mol per sequence
+    string mea_structure;                                    // mea_, dot-bracket in the original columns
+    map<int, int> threshknot_pairs;                          // threshknot_, i -> j and j -> i, 1-based original columns
+
+    // --cache (see cache.cpp): fold looks the alignment up there before folding it, and stores
+    // the results of what it folds
+    ResultCache * result_cache = NULL;
+
+    // the results above as a result cache entry, and back (false if results is not one); then
+    // written out as parse_alifold would have (MSA in folded columns, column_map set)
+    string cache_results();
+    bool restore_results(const string & results);
+    void replay_results(std::vector<std::string> & MSA);
+
+    // --checkpoint (see checkpoint.cpp): the state of the inside pass is written to checkpoint_file
+    // every checkpoint_interval seconds; with resume, a parse continues from there if it holds a
+    // checkpoint of the same alignment and options
+    string checkpoint_file;
+    double checkpoint_interval = 600;
+    bool resume = false;
  
 
 private:
@@ -130,35 +332,145 @@ private:
 
     State *bestC;
 
+    // M beam of every column in contiguous arrays, in the order of bestM[k], made once the
+    // column is pruned; M2 = M + P runs over it instead of the hash map
+    struct FlatBeam {
+        vector<int> i;
+        vector<pf_type> alpha;
+        vector<State *> state;
+    };
+    vector<FlatBeam> flatM;
+    void flatten_beam(unordered_map<int, State> & beamstep, FlatBeam & flat);
+
+    // scratch of M2 = M + P: the M2 of the current column by start (dense while the column's P
+    // beam is processed)
+    vector<pf_type> M2_alpha;
+    vector<pf_type> M2_viterbi;
+    vector<int> M2_touched;
+
+    // linear space: alpha and beta are partition functions instead of their logs, so that sums
+    // are plain adds. Like pf_scale in ViennaRNA, every column a value covers divides it by
+    // exp(log scale of the column); the scale of a column is fixed once a state reaches it, from
+    // the ensemble free energy per column of the prefix folded so far (scale_columns).
+    // log_space_values turns the beams back to log space for everything after the outside pass.
+    bool use_linear = false;
+    vector<double> log_scale_sum; // [k]: sum of the log scales of columns 0 .. k-1
+    int scaled_columns;
+    double column_log_scale;
+    void scale_columns(int j);
+    bool log_space_values(bool with_beta);
+
+    // log scale of columns i .. j (0 if i > j)
+    double scale_span(int i, int j) {
+        if (j >= scaled_columns) scale_columns(j);
+        return log_scale_sum[j+1] - log_scale_sum[i];
+    };
+
+    pf_type pf_one() { return use_linear ? pf_type(1.0) : pf_type(0.0); };
+    pf_type pf_zero() { return use_linear ? pf_type(0.0) : VALUE_MIN; };
+    pf_type pf_times(pf_type x, pf_type y) { return use_linear ? x * y : x + y; };
+    void pf_plus_equals(pf_type & x, pf_type y);
+    // weight of an energy term e (newscore / kTn) that adds nothing to the span
+    pf_type pf_weight(double e) { return use_linear ? pf_type(exp(e)) : pf_type(e); };
+    // ... that adds the columns i .. j
+    pf_type pf_weight(double e, int i, int j) { return use_linear ? pf_type(exp(e - scale_span(i, j))) : pf_type(e); };
+    // ... that takes the span i .. j out to p .. q
+    pf_type pf_weight(double e, int p, int q, int i, int j) { return use_linear ? pf_type(exp(e - scale_span(p, q) + scale_span(i, j))) : pf_type(e); };
+
+    // Multi(i, q) += value, pushed from column j (value scaled up to j). The next paired position
+    // can be far ahead: in linear space a push to a column without a scale yet waits for it in
+    // pending_multi, so that only the short reach of the other rules decides how soon scales
+    // are fixed (hairpins are scaled when reached, see the beam of H)
+    struct PendingPush {
+        int i, j;
+        pf_type value;
+    };
+    vector<vector<PendingPush>> pending_multi;
+    void add_multi(int i, int q, int j, pf_type value, pf_type viterbi) {
+        if (joint_mfe) viterbi_max(bestMulti[q][i].viterbi, viterbi);
+        if (!use_linear) pf_plus_equals(bestMulti[q][i].alpha, value);
+        else if (q < scaled_columns) bestMulti[q][i].alpha += value * exp(-scale_span(j + 1, q));
+        else pending_multi[q].push_back({i, j, value});
+    };
+
+    void viterbi_max(pf_type & x, pf_type y) {
+        if (y > x) x = y;
+    };
+
     int *nucs;
 
     void prepare(unsigned len);
     void postprocess();
 
-    void cal_PairProb(State& viterbi, vector<vector<ribo_state>> & pscore); 
+    void cal_PairProb(State& viterbi, SpanTable<ribo_state> & pscore); 
 
     void PairProb_MEA(string & seq);
 
     void ThreshKnot(string & seq);
 
-    string back_trace(const int i, const int j, const vector<vector<int> >& back_pointer);
+    string back_trace(const int i, const int j, SpanTable<int>& back_pointer);
     map<int, int> get_pairs(string & structure);
-    void outside_alifold(vector<int> next_pair[], vector<vector<ribo_state>> & pscore, vector<float> & smart_gap, float smart_gap_threshold, vector<vector<int>> & next_position);
+    void outside_alifold(vector<int> next_pair[], SpanTable<ribo_state> & pscore, vector<float> & smart_gap, float smart_gap_threshold, SpanTable<int> & next_position);
 
     void dump_forest(string seq, bool inside_only);
+
+    void sample(SpanTable<ribo_state> & pscore);
+    string sample_one(mt19937 & rng, SpanTable<ribo_state> & pscore, vector<int> * trie_path);
+    const vector<HyperEdge> & get_hyperedges(const SampleNode & node, SpanTable<ribo_state> & pscore);
+    void recover_hyperedges(const SampleNode & node, SpanTable<ribo_state> & pscore, vector<HyperEdge> & edges, pf_type State::* score);
+    string mfe_structure(SpanTable<ribo_state> & pscore, double & ribo_sum);
+    bool pairable_in_chain(int i, int x, SpanTable<ribo_state> & pscore);
+
+    struct HyperedgeShard {
+        mutex lock;
+        unordered_map<unsigned long long, vector<HyperEdge>> edges;
+    };
+    HyperedgeShard hyperedge_cache[SAMPLE_CACHE_SHARDS];
+    mutex recover_lock;
+    vector<TrieNode> trie;
     void print_states(FILE *fptr, unordered_map<int, State>& states, int j, string label, bool inside_only, double threshold);
 
     pf_type beam_prune(unordered_map<int, State>& beamstep);
 
+    bool checkpoint_all_columns();
+    string checkpoint_key();
+    bool write_checkpoint(int j, const string & key);
+    bool read_checkpoint(const string & key, int & next_column, SpanTable<ribo_state> & pscore);
+
+    // the beam used in the current column; equals beam unless the policy is BEAM_ADAPTIVE
+    int cur_beam;
+    double cur_beam_f;
+    // BEAM_MARGIN threshold in log space
+    pf_type margin_alpha;
+    // BEAM_ADAPTIVE controller state
+    double last_elapsed, column_time;
+
+    bool need_prune(size_t size) {
+        return (cur_beam > 0 && size > cur_beam) || (beam_policy == BEAM_MARGIN && size > 1);
+    };
+
+    void adapt_beam(int j, double elapsed);
+
+    bool in_span(int i, int j) {
+        return span <= 0 || column_distance(i, j) < span;
+    };
+
     vector<pair<pf_type, int>> scores;
 
     unordered_map<pair<int,int>, pf_type, hash_pair> Pij;
 
     void output_to_file(string file_name, const char * type);
-    void output_to_file_MEA_threshknot_bpseq(string file_name, const char * type, map<int,int> & pairs, string & seq);
+    void output_to_file_MEA_threshknot_bpseq(string file_name, const char * type, const map<int,int> & pairs, string & seq);
+
+    // the results below written out (or printed) as the parse made them, also for the result
+    // cache (see cache.cpp)
+    void output_energies();
+    void output_PairProb();
+    void output_MEA(string & seq);
+    void output_ThreshKnot(string & seq);
 
 
-    bool check_pairable_ij(vector<int> & SS_fast_i, vector<int> & SS_fast_j, float ** ribo, vector<vector<ribo_state>> & pscore, int i, int j);
+    bool check_pairable_ij(vector<int> & SS_fast_i, vector<int> & SS_fast_j, float ** ribo, SpanTable<ribo_state> & pscore, int i, int j);
 
 
     std::vector<std::vector<int>> nucs_MSA;
@@ -260,4 +572,10 @@ inline pf_type Fast_Exp(pf_type x)
     return (x > pf_type(46.052) ? pf_type(1e20) : expf(x));
 }
 
+inline void BeamCKYParser::pf_plus_equals(pf_type & x, pf_type y)
+{
+    if (use_linear) x += y;
+    else Fast_LogPlusEquals(x, y);
+}
+
 #endif //FASTCKY_BEAMCKYPAR_H
@@ -0,0 +1,386 @@
+
+#include <stdio.h>
+#include <math.h>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include "linearalifold_p.h"
+
+using namespace std;
+
+// Stochastic sampling from the inside beams (cf. LinearSampling): starting from C[n-1], every
+// state picks one of its incoming hyperedges with probability proportional to the edge weight
+// times the inside partition functions of its children, until only pairs and unpaired columns
+// are left. The hyperedges are not stored by the inside pass; the ones into a state are
+// recovered from the beams the first time a sample reaches it and cached (hyperedge_cache), so
+// K samples cost one recovery per visited state plus O(n) per sample. The same recovery over the
+// Viterbi scores of the states gives the MFE structure of the beams (joint_mfe).
+
+// cache key of a state; i, j < 2^28
+static inline unsigned long long sample_key(int type, int i, int j) {
+    return ((unsigned long long)type << 56) | ((unsigned long long)(i + 1) << 28) | (unsigned long long)(j + 1);
+}
+
+// column x can close a pair opened at i: the next_position chain of i would stop at x
+bool BeamCKYParser::pairable_in_chain(int i, int x, SpanTable<ribo_state> & pscore) {
+    if (!in_span(i, x)) return false;
+    auto & SS_i = SS_fast[i];
+    bool in_chain = false;
+    for (int s = 0; s < MSA.size() && !in_chain; s++)
+        in_chain = next_pair_MSA[s][SS_i[s]][x - 1] == x;
+    return in_chain && check_pairable_ij(SS_i, SS_fast[x], ribo, pscore, i, x);
+}
+
+// all hyperedges of the inside pass into one state, weighted by the score (alpha or viterbi)
+// of their children in log space
+void BeamCKYParser::recover_hyperedges(const SampleNode & node, SpanTable<ribo_state> & pscore, vector<HyperEdge> & edges, pf_type State::* score) {
+    int n_seq = MSA.size();
+    double kTn = double(kT) * n_seq;
+    int i = node.i, j = node.j;
+    value_type newscore;
+
+    auto score_of = [score](unordered_map<int, State> & beamstep, int i) -> pf_type {
+        auto it = beamstep.find(i);
+        return it == beamstep.end() ? VALUE_MIN : it->second.*score;
+    };
+    auto add_edge = [&](pf_type weight, SampleNode left, SampleNode right) {
+        edges.push_back({weight, left, right});
+    };
+    const SampleNode none = {SAMPLE_NONE, -1, -1};
+
+    // M1 term of a branch P(i, j) in a multiloop, as M = P and M2 = M + P
+    auto score_branch = [&](int i, int j) {
+        value_type score = 0;
+        for (int s = 0; s < n_seq; s++) {
+            int new_nuci_1 = ((i - 1) > -1) ? s5_fast[i][s] : -1;
+            int new_nucj1 = (j + 1) < seq_length ? s3_fast[j][s] : -1;
+            score += - v_score_M1(-1, -1, -1, new_nuci_1, SS_fast[i][s], SS_fast[j][s], new_nucj1, -1);
+        }
+        return score;
+    };
+
+    switch (node.type) {
+        case SAMPLE_C: {
+            // C[0] and C[1] are set to 0 before the inside pass, and only unpaired (C[1] also gets
+            // C[0] + U, which is the same structure again)
+            if (j <= 1) {
+                add_edge(0.0, none, none);
+                break;
+            }
+
+            // C = C + U
+            add_edge(bestC[j - 1].*score, {SAMPLE_C, 0, j - 1}, none);
+
+            // C = C + P
+            auto & a2s_j = a2s_fast[j];
+            auto & a2s_seq_length_1 = a2s_fast[seq_length - 1];
+            for (auto & item : bestP[j]) {
+                int i = item.first;
+                auto & a2s_i = a2s_fast[i];
+                newscore = 0;
+                for (int s = 0; s < n_seq; s++) {
+                    int new_nucj1 = (a2s_j[s] < a2s_seq_length_1[s]) ? s3_fast[j][s] : -1;
+                    if (i > 0) {
+                        int new_nuck = (a2s_i[s] > 0) ? s5_fast[i][s] : -1;
+                        newscore += - v_score_external_paired(-1, -1, new_nuck, SS_fast[i][s], SS_fast[j][s], new_nucj1, -1);
+                    }
+                    else newscore += - v_score_external_paired(0, j, -1, SS_fast[i][s], SS_fast[j][s], new_nucj1, -1);
+                }
+                if (i > 0)
+                    add_edge(bestC[i - 1].*score + item.second.*score + newscore / kTn, {SAMPLE_C, 0, i - 1}, {SAMPLE_P, i, j});
+                else
+                    add_edge(item.second.*score + newscore / kTn, {SAMPLE_P, i, j}, none);
+            }
+            break;
+        }
+        case SAMPLE_P: {
+            // hairpin
+            pf_type h_alpha = score_of(bestH[j], i);
+            if (h_alpha != VALUE_MIN) add_edge(h_alpha, none, none);
+
+            // multiloop closed by (i, j)
+            pf_type multi_alpha = score_of(bestMulti[j], i);
+            if (multi_alpha != VALUE_MIN) {
+                newscore = 0;
+                for (int s = 0; s < n_seq; s++)
+                    newscore += - v_score_multi(-1, -1, SS_fast[i][s], s3_fast[i][s], s5_fast[j][s], SS_fast[j][s], -1);
+                add_edge(multi_alpha + newscore / kTn, {SAMPLE_Multi, i, j}, none);
+            }
+
+            // helix / single branch around an inner P(p, q)
+            for (int p = i + 1; p < j && column_distance(i, p) <= SINGLE_MAX_LEN; ++p) {
+                for (int q = j - 1; q > p && column_distance(i, p) + column_distance(q, j) - 2 <= SINGLE_MAX_LEN; --q) {
+                    pf_type inner_alpha = score_of(bestP[q], p);
+                    if (inner_alpha == VALUE_MIN) continue;
+
+                    newscore = 0;
+                    for (int s = 0; s < n_seq; s++) {
+                        int type = NUM_TO_PAIR(SS_fast[i][s], SS_fast[j][s]);
+                        int type_2 = NUM_TO_PAIR(SS_fast[q][s], SS_fast[p][s]);
+                        int u1 = 0, u2 = 0;
+                        if (p != i + 1 || q != j - 1) {
+                            u1 = a2s_fast[p - 1][s] - a2s_fast[i][s];
+                            u2 = a2s_fast[j - 1][s] - a2s_fast[q][s];
+                        }
+                        newscore += - v_score_single_alifold(u1, u2, type, type_2, s3_fast[i][s], s5_fast[j][s], s5_fast[p][s], s3_fast[q][s]);
+                    }
+                    add_edge(inner_alpha + newscore / kTn, {SAMPLE_P, p, q}, none);
+                }
+            }
+            break;
+        }
+        case SAMPLE_Multi: {
+            // Multi(i, j) comes from Multi(i, k) or M2(newi, k) whose next pairable column after k is j
+            for (int k = j - 1; k > i; --k) {
+                pf_type multi_alpha = score_of(bestMulti[k], i);
+                if (multi_alpha != VALUE_MIN) add_edge(multi_alpha, {SAMPLE_Multi, i, k}, none);
+
+                if (in_span(i, k + 1)) {
+                    for (auto & item : bestM2[k]) {
+                        int newi = item.first;
+                        if (newi <= i || smart_gap[newi - 1] - smart_gap[i] > 2 * SINGLE_MAX_LEN) continue;
+                        add_edge(item.second.*score, {SAMPLE_M2, newi, k}, none);
+                    }
+                }
+
+                if (pairable_in_chain(i, k, pscore)) break;
+            }
+            break;
+        }
+        case SAMPLE_M2: {
+            // M2 = M + P
+            if (!in_span(i - 1, j + 1)) break;
+            for (auto & item : bestP[j]) {
+                int k = item.first - 1;
+                if (k <= i || k <= 0) continue;
+                pf_type m_alpha = score_of(bestM[k], i);
+                if (m_alpha == VALUE_MIN) continue;
+                add_edge(m_alpha + item.second.*score + score_branch(k + 1, j) / kTn, {SAMPLE_M, i, k}, {SAMPLE_P, k + 1, j});
+            }
+            break;
+        }
+        case SAMPLE_M: {
+            // M = M2
+            pf_type m2_alpha = score_of(bestM2[j], i);
+            if (m2_alpha != VALUE_MIN) add_edge(m2_alpha, {SAMPLE_M2, i, j}, none);
+
+            if (!in_span(i - 1, j + 1)) break;
+
+            // M = P
+            if (i > 0 && j < seq_length - 1) {
+                pf_type p_alpha = score_of(bestP[j], i);
+                if (p_alpha != VALUE_MIN) add_edge(p_alpha + score_branch(i, j) / kTn, {SAMPLE_P, i, j}, none);
+            }
+
+            // M = M + U
+            pf_type m_alpha = score_of(bestM[j - 1], i);
+            if (m_alpha != VALUE_MIN) add_edge(m_alpha, {SAMPLE_M, i, j - 1}, none);
+            break;
+        }
+        default:
+            break;
+    }
+
+}
+
+// hyperedges into a state, recovered on the first visit; shared by the sampling threads
+const vector<HyperEdge> & BeamCKYParser::get_hyperedges(const SampleNode & node, SpanTable<ribo_state> & pscore) {
+    unsigned long long key = sample_key(node.type, node.i, node.j);
+    HyperedgeShard & shard = hyperedge_cache[key % SAMPLE_CACHE_SHARDS];
+    {
+        lock_guard<mutex> lock(shard.lock);
+        auto it = shard.edges.find(key);
+        if (it != shard.edges.end()) return it->second;
+    }
+
+    // recovering reads the beams and fills pscore, one thread at a time
+    vector<HyperEdge> edges;
+    {
+        lock_guard<mutex> lock(recover_lock);
+        recover_hyperedges(node, pscore, edges, &State::alpha);
+    }
+
+    // probabilities given the state, normalised over the recovered edges
+    pf_type total = VALUE_MIN;
+    for (auto & edge : edges) total = max(total, edge.weight);
+    double sum = 0.;
+    for (auto & edge : edges) {
+        edge.weight = exp(edge.weight - total);
+        sum += edge.weight;
+    }
+    for (auto & edge : edges) edge.weight /= sum;
+
+    lock_guard<mutex> lock(shard.lock);
+    return shard.edges.emplace(key, std::move(edges)).first->second;
+}
+
+// one structure; for non-redundant sampling (trie_path != NULL) the choices are made over what
+// is left of the ensemble after the structures sampled so far, and the new one is taken out
+string BeamCKYParser::sample_one(mt19937 & rng, SpanTable<ribo_state> & pscore, vector<int> * trie_path) {
+    uniform_real_distribution<double> uniform(0.0, 1.0);
+    string structure(seq_length, '.');
+
+    vector<SampleNode> stk;
+    stk.push_back({SAMPLE_C, 0, (int)seq_length - 1});
+    if (trie_path != NULL) trie_path->assign(1, 0);
+
+    while (!stk.empty()) {
+        SampleNode node = stk.back();
+        stk.pop_back();
+
+        if (node.type == SAMPLE_P) {
+            structure[node.i] = '(';
+            structure[node.j] = ')';
+        }
+
+        const vector<HyperEdge> & edges = get_hyperedges(node, pscore);
+        if (edges.empty()) continue;
+
+        int choice = edges.size() - 1;
+        if (edges.size() > 1 && trie_path == NULL) {
+            double r = uniform(rng);
+            for (int e = 0; e < edges.size(); ++e) {
+                r -= edges[e].weight;
+                if (r < 0) { choice = e; break; }
+            }
+        }
+        else if (edges.size() > 1) {
+            int t = trie_path->back();
+            vector<int> child(edges.size(), -1);
+            for (auto & c : trie[t].children) child[c.first] = c.second;
+
+            // probability of each choice, less the structures already sampled below it
+            vector<double> left(edges.size());
+            double total = 0.;
+            for (int e = 0; e < edges.size(); ++e) {
+                double taken = child[e] == -1 ? 0. : trie[child[e]].taken;
+                left[e] = edges[e].weight * max(0.0, 1.0 - taken);
+                total += left[e];
+            }
+            double r = uniform(rng) * total;
+            choice = -1;
+            for (int e = 0; e < edges.size(); ++e) {
+                if (left[e] <= 0) continue;
+                choice = e;
+                r -= left[e];
+                if (r < 0) break;
+            }
+            if (choice == -1) choice = edges.size() - 1;
+
+            if (child[choice] == -1) {
+                child[choice] = trie.size();
+                trie[t].children.push_back(make_pair(choice, child[choice]));
+                trie.push_back({edges[choice].weight, 0.0, {}});
+            }
+            trie_path->push_back(child[choice]);
+        }
+
+        const HyperEdge & edge = edges[choice];
+        // right child below the left one, so that the structure is derived from left to right
+        if (edge.right.type != SAMPLE_NONE) stk.push_back(edge.right);
+        if (edge.left.type != SAMPLE_NONE) stk.push_back(edge.left);
+    }
+
+    if (trie_path != NULL) {
+        // all of the leaf is taken now, and the structure's share of every choice above it
+        double share = 1.0;
+        trie[trie_path->back()].taken = 1.0;
+        for (int k = (int)trie_path->size() - 2; k >= 0; --k) {
+            share *= trie[(*trie_path)[k + 1]].prob;
+            trie[(*trie_path)[k]].taken += share;
+        }
+    }
+
+    return structure;
+}
+
+// joint_mfe: the MFE structure over the inside beams, following from C[n-1] the hyperedge of
+// best Viterbi score into every state; ribo_sum gets the covariance scores of its pairs
+string BeamCKYParser::mfe_structure(SpanTable<ribo_state> & pscore, double & ribo_sum) {
+    string structure(seq_length, '.');
+    ribo_sum = 0;
+
+    vector<SampleNode> stk;
+    stk.push_back({SAMPLE_C, 0, (int)seq_length - 1});
+    vector<HyperEdge> edges;
+
+    while (!stk.empty()) {
+        SampleNode node = stk.back();
+        stk.pop_back();
+
+        if (node.type == SAMPLE_P) {
+            structure[node.i] = '(';
+            structure[node.j] = ')';
+            ribo_sum += pscore[node.i][node.j].ribo_score;
+        }
+
+        edges.clear();
+        recover_hyperedges(node, pscore, edges, &State::viterbi);
+        if (edges.empty()) continue;
+
+        int best = 0;
+        for (int e = 1; e < edges.size(); ++e)
+            if (edges[e].weight > edges[best].weight) best = e;
+
+        const HyperEdge & edge = edges[best];
+        if (edge.right.type != SAMPLE_NONE) stk.push_back(edge.right);
+        if (edge.left.type != SAMPLE_NONE) stk.push_back(edge.left);
+    }
+
+    return structure;
+}
+
+// draw sample_number structures from the inside beams, on sample_threads threads with
+// independent random streams (seeded with sample_seed and the thread number), or one by one
+// without repeats if sample_nonredundant; written to stdout in the original columns
+void BeamCKYParser::sample(SpanTable<ribo_state> & pscore) {
+    struct timeval sample_starttime, sample_endtime;
+    gettimeofday(&sample_starttime, NULL);
+
+    unsigned long seed = sample_seed >= 0 ? (unsigned long)sample_seed : random_device()();
+    vector<string> samples;
+
+    if (sample_nonredundant) {
+        trie.assign(1, {1.0, 0.0, {}});
+        vector<int> trie_path;
+        mt19937 rng(seed);
+        for (int k = 0; k < sample_number && trie[0].taken < 1.0 - 1e-12; ++k)
+            samples.push_back(sample_one(rng, pscore, &trie_path));
+    }
+    else {
+        samples.resize(sample_number);
+        int num_threads = max(1, min(sample_threads, sample_number));
+        vector<thread> threads;
+        for (int t = 0; t < num_threads; ++t) {
+            threads.push_back(thread([this, &samples, &pscore, seed, t, num_threads]() {
+                seed_seq stream{(unsigned)seed, (unsigned)(seed >> 32), (unsigned)t};
+                mt19937 rng(stream);
+                for (int k = t; k < sample_number; k += num_threads)
+                    samples[k] = sample_one(rng, pscore, NULL);
+            }));
+        }
+        for (auto & worker : threads) worker.join();
+    }
+
+    for (auto & structure : samples) {
+        if (!column_map.empty()) structure = expand_structure(structure, column_map, original_seq.size());
+        printf("%s\n", structure.c_str());
+    }
+
+    gettimeofday(&sample_endtime, NULL);
+    double sample_elapsed_time = sample_endtime.tv_sec - sample_starttime.tv_sec + (sample_endtime.tv_usec-sample_starttime.tv_usec)/1000000.0;
+
+    if (is_verbose) {
+        unsigned long num_states = 0;
+        for (auto & shard : hyperedge_cache) num_states += shard.edges.size();
+        fprintf(stdout, "Samples: %lu (seed %lu%s)\n", samples.size(), seed, sample_nonredundant ? ", non-redundant" : "");
+        if (sample_nonredundant) fprintf(stdout, "Probability Covered: %.4f\n", trie[0].taken);
+        fprintf(stdout, "States Visited: %lu\n", num_states);
+        fprintf(stdout, "Sampling Time: %.2f seconds.\n", sample_elapsed_time);
+    }
+    fflush(stdout);
+
+    for (auto & shard : hyperedge_cache) shard.edges.clear();
+    vector<TrieNode>().swap(trie);
+}
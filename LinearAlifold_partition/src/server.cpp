@@ -0,0 +1,259 @@
+
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+#include "linearalifold_p.h"
+
+using namespace std;
+
+// Fold server: a long-running process that folds alignments sent to it, so that a request pays
+// neither process start nor parser setup. Every worker thread keeps one BeamCKYParser (with
+// keep_results set) for all the requests it serves; requests come over a Unix domain socket,
+// one connection per worker at a time, or over stdin with the responses on stdout. Only this
+// engine serves: the MFE of a request is the joint MFE of its inside pass (joint_mfe, --mfe),
+// which can differ from what bin/linearalifold folds.
+//
+// A request is the line
+//   fold [beam=B] [mea=0|1] [gamma=G] [threshknot=0|1] [threshold=T] [cutoff=C] [joint_mfe=0|1] [span=S] [gap=F]
+// (options not given are those of the server's command line), the alignment as on stdin, and
+// the line "end". The response is "ok", then
+//   ensemble E                    free energy of the ensemble, kcal/mol
+//   joint_mfe STRUCTURE E FE COV  with joint_mfe=1: as --mfe, energy = free energy + covariance
+//   mea STRUCTURE                 with mea=1
+//   threshknot I J I J ...        with threshknot=1, the pairs (1-based columns)
+//   bpp I J P                     every pair with a probability of at least cutoff, by I then J
+// and "end"; a request that cannot be folded gets "error REASON" instead, also up to "end".
+// The line "quit" closes the connection (the server, on stdin).
+
+// next line of in without the newline; false at the end of in
+static bool read_line(FILE * in, string & line) {
+    line.clear();
+    int c;
+    while ((c = getc(in)) != EOF && c != '\n') line += (char)c;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    return c != EOF || !line.empty();
+}
+
+// the options of a fold line over options; false (and error) for a bad one
+static bool parse_fold_options(const string & line, FoldOptions & options, string & error) {
+    istringstream words(line);
+    string word;
+    words >> word; // fold
+    while (words >> word) {
+        size_t eq = word.find('=');
+        string key = word.substr(0, eq);
+        const char * value = eq == string::npos ? "" : word.c_str() + eq + 1;
+        char * rest;
+        double number = strtod(value, &rest);
+        if (eq == string::npos || *value == 0 || *rest != 0) {
+            error = "bad option " + word;
+            return false;
+        }
+        if (key == "beam") options.beam = int(number);
+        else if (key == "mea") options.mea = number != 0;
+        else if (key == "gamma") options.gamma = number;
+        else if (key == "threshknot") options.threshknot = number != 0;
+        else if (key == "threshold") options.threshold = number;
+        else if (key == "cutoff") options.bpp_cutoff = number;
+        else if (key == "joint_mfe") options.mfe = number != 0;
+        else if (key == "span") options.span = int(number);
+        else if (key == "gap") options.gap_fraction = number;
+        else {
+            error = "unknown option " + key;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BeamCKYParser::fold(vector<string> & MSA_, const FoldOptions & options, string & error) {
+    if (MSA_.empty() || MSA_[0].empty()) {
+        error = "empty alignment";
+        return false;
+    }
+    for (auto & row : MSA_)
+        if (row.size() != MSA_[0].size()) {
+            error = "rows of different lengths";
+            return false;
+        }
+
+    beam = options.beam;
+    mea_ = options.mea;
+    gamma = options.gamma;
+    threshknot_ = options.threshknot;
+    threshknot_threshold = options.threshold;
+    bpp_cutoff = options.bpp_cutoff;
+    joint_mfe = options.mfe;
+    span = options.span;
+
+    // the result cache, before anything is prepared (the adaptive policy depends on the time taken)
+    string cache_options, cache_key, cached;
+    bool cache_hit = false;
+    if (result_cache != NULL && options.beam_policy != BEAM_ADAPTIVE) {
+        cache_options = result_cache_options(options, pf_only);
+        cache_key = result_cache_key(cache_options, MSA_);
+        cache_hit = result_cache->load(cache_key, cache_options, cached) && restore_results(cached);
+    }
+
+    int n_seq = MSA_.size();
+    float ** ribo_ = cache_hit ? NULL : get_ribosum(MSA_, n_seq, MSA_[0].size());
+    column_map.clear();
+    original_seq.clear();
+    if (options.gap_fraction > 0) {
+        original_seq = MSA_[0];
+        column_map = compress_gap_columns(MSA_, options.gap_fraction);
+    }
+
+    bool folded = !MSA_[0].empty();
+    if (!folded) error = "no columns left to fold";
+    else if (cache_hit) replay_results(MSA_);
+    else {
+        int length = MSA_[0].size();
+        auto pscore = init_pscores_only(length, span);
+        vector<float> smart_gap_;
+        vector<vector<int>> a2s_, s5_, s3_, SS_;
+        a2s_prepare_is(MSA_, n_seq, length, a2s_, s5_, s3_, SS_, smart_gap_);
+        parse_alifold(MSA_, a2s_, pscore, s5_, s3_, SS_, ribo_, smart_gap_);
+        if (!cache_key.empty()) result_cache->store(cache_key, cache_options, cache_results());
+    }
+
+    if (ribo_ != NULL) {
+        for (int i = 0; i < 7; i++) free(ribo_[i]);
+        free(ribo_);
+    }
+    return folded;
+}
+
+vector<pair<pair<int, int>, pf_type>> BeamCKYParser::bpp_pairs() {
+    vector<pair<pair<int, int>, pf_type>> pairs;
+    pairs.reserve(Pij.size());
+    for (auto & pij : Pij)
+        pairs.push_back(make_pair(make_pair(original_index(pij.first.first-1)+1, original_index(pij.first.second-1)+1), pij.second));
+    sort(pairs.begin(), pairs.end());
+    return pairs;
+}
+
+void BeamCKYParser::serve(FILE * in, FILE * out, const FoldOptions & defaults) {
+    keep_results = true;
+    is_verbose = false;
+    pf_only = false;
+
+    string line;
+    while (read_line(in, line)) {
+        if (line.empty()) continue;
+        if (line == "quit") break;
+
+        string error;
+        FoldOptions options = defaults;
+        if (line.compare(0, 4, "fold") != 0 || (line.size() > 4 && line[4] != ' '))
+            error = "expected fold or quit";
+        else parse_fold_options(line, options, error);
+
+        // the alignment, read up to end even if the request is already bad
+        vector<string> MSA_;
+        bool ended = false;
+        while (read_line(in, line)) {
+            if (line == "end") {
+                ended = true;
+                break;
+            }
+            if (line.empty() || line[0] == ';' || line[0] == '>') continue;
+            transform(line.begin(), line.end(), line.begin(), ::toupper);
+            replace(line.begin(), line.end(), 'T', 'U');
+            MSA_.push_back(line);
+        }
+        if (!ended) break;
+
+        if (error.empty()) fold(MSA_, options, error);
+        if (!error.empty()) {
+            fprintf(out, "error %s\nend\n", error.c_str());
+            fflush(out);
+            continue;
+        }
+
+        fprintf(out, "ok\nensemble %.2f\n", ensemble_energy);
+        if (joint_mfe)
+            fprintf(out, "joint_mfe %s %.2f %.2f %.2f\n", joint_mfe_structure.c_str(), joint_mfe_energy, joint_mfe_energy - joint_mfe_covariance, joint_mfe_covariance);
+        if (mea_) fprintf(out, "mea %s\n", mea_structure.c_str());
+        if (threshknot_) {
+            fprintf(out, "threshknot");
+            for (auto & item : threshknot_pairs)
+                if (item.first < item.second) fprintf(out, " %d %d", item.first, item.second);
+            fprintf(out, "\n");
+        }
+        for (auto & pij : bpp_pairs())
+            fprintf(out, "bpp %d %d %.4e\n", pij.first.first, pij.first.second, pij.second);
+        fprintf(out, "end\n");
+        fflush(out);
+    }
+}
+
+// serve on the Unix domain socket at address with threads workers, or on stdin / stdout if
+// address is "-"; only returns on an error. cache: the result cache of every worker, or NULL
+int run_fold_server(const string & address, int threads, const FoldOptions & defaults, bool verbose, ResultCache * cache) {
+    auto make_parser = [&defaults, cache]() {
+        BeamCKYParser * parser = new BeamCKYParser(defaults.beam, defaults.no_sharp_turn, false, "", "", false, defaults.bpp_cutoff, "", defaults.mea, defaults.gamma, "", false, defaults.threshknot, defaults.threshold, "", defaults.beam_policy, defaults.beam_margin, defaults.time_budget, defaults.span);
+        parser->linear_space = defaults.linear_space;
+        parser->result_cache = cache;
+        return parser;
+    };
+
+    if (address == "-") {
+        unique_ptr<BeamCKYParser> parser(make_parser());
+        parser->serve(stdin, stdout, defaults);
+        return 0;
+    }
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (address.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long!\n", address.c_str());
+        return 1;
+    }
+    strcpy(addr.sun_path, address.c_str());
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(address.c_str());
+    if (listen_fd < 0 || ::bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", address.c_str(), strerror(errno));
+        return 1;
+    }
+    // a client that goes away mid-response must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    threads = max(1, threads);
+    if (verbose) fprintf(stderr, "Fold Server: listening on %s with %d threads.\n", address.c_str(), threads);
+
+    vector<thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.push_back(thread([&]() {
+            unique_ptr<BeamCKYParser> parser(make_parser());
+            while (true) {
+                int fd = accept(listen_fd, NULL, NULL);
+                if (fd < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    fprintf(stderr, "Fold Server: accept failed: %s\n", strerror(errno));
+                    return;
+                }
+                FILE * in = fdopen(fd, "r");
+                FILE * out = fdopen(dup(fd), "w");
+                if (in != NULL && out != NULL) parser->serve(in, out, defaults);
+                if (in != NULL) fclose(in);
+                else close(fd);
+                if (out != NULL) fclose(out);
+            }
+        }));
+    }
+    for (auto & worker : workers) worker.join();
+    close(listen_fd);
+    return 1;
+}
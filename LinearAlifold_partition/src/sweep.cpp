@@ -0,0 +1,66 @@
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include "linearalifold_p.h"
+
+using namespace std;
+
+// Beam sweep (--sweep BEAMS): one alignment folded at every beam size of a list in one run, to
+// see how the ensemble and the structures change with the beam. The alignment is read and
+// prepared once, and pscore is filled up front (make_pscores_all) so that the parsers, one per
+// beam on worker threads and largest beams first, only read it. Every parser keeps its results
+// (keep_results) and they are written out in the order of the list, as a run at that beam would
+// print them on stdout, each followed by "beam B: S states, P pruned, T seconds". The outside pass
+// (and so MEA and ThreshKnot) runs unless the parsers are pf_only. Each worker holds the beams of
+// its own parse, so memory grows with the number of threads.
+
+// make_parser(beam): a parser with the options of the run at that beam, for folded columns
+void run_sweep(const vector<int> & beams, int threads, const function<BeamCKYParser * (int)> & make_parser, vector<string> & MSA_, vector<vector<int>> & a2s_, SpanTable<ribo_state> & pscore, vector<vector<int>> & s5_, vector<vector<int>> & s3_, vector<vector<int>> & SS_, float ** ribo_, vector<float> & smart_gap_) {
+    struct timeval sweep_starttime, sweep_endtime;
+    gettimeofday(&sweep_starttime, NULL);
+    make_pscores_all(pscore, SS_, ribo_);
+
+    int num_beams = beams.size();
+    vector<int> order(num_beams);
+    for (int k = 0; k < num_beams; ++k) order[k] = k;
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return beams[a] > beams[b]; });
+
+    vector<unique_ptr<BeamCKYParser>> parsers(num_beams);
+    vector<double> seconds(num_beams);
+    int num_threads = threads > 0 ? threads : max(1, (int)thread::hardware_concurrency());
+    num_threads = min(num_threads, num_beams);
+    atomic<int> next_beam(0);
+    vector<thread> workers;
+    for (int t = 0; t < num_threads; ++t) {
+        workers.push_back(thread([&]() {
+            for (int next; (next = next_beam++) < num_beams; ) {
+                int k = order[next];
+                struct timeval starttime, endtime;
+                gettimeofday(&starttime, NULL);
+                parsers[k].reset(make_parser(beams[k]));
+                parsers[k]->keep_results = true;
+                parsers[k]->parse_alifold(MSA_, a2s_, pscore, s5_, s3_, SS_, ribo_, smart_gap_);
+                gettimeofday(&endtime, NULL);
+                seconds[k] = endtime.tv_sec - starttime.tv_sec + (endtime.tv_usec-starttime.tv_usec)/1000000.0;
+            }
+        }));
+    }
+    for (auto & worker : workers) worker.join();
+
+    for (int k = 0; k < num_beams; ++k) {
+        auto & parser = parsers[k];
+        parser->keep_results = false;
+        parser->replay_results(MSA_);
+        printf("beam %d: %lu states, %lu pruned, %.2f seconds\n", beams[k], parser->beam_stats.states, parser->beam_stats.pruned, seconds[k]);
+    }
+
+    gettimeofday(&sweep_endtime, NULL);
+    double sweep_elapsed_time = sweep_endtime.tv_sec - sweep_starttime.tv_sec + (sweep_endtime.tv_usec-sweep_starttime.tv_usec)/1000000.0;
+    printf("sweep of %d beams on %d threads: %.2f seconds\n", num_beams, num_threads, sweep_elapsed_time);
+    fflush(stdout);
+}
@@ -0,0 +1,127 @@
+
+#include <stdio.h>
+#include <map>
+#include <algorithm>
+#include "linearalifold_p.h"
+
+using namespace std;
+
+// plfold-style local folding (cf. RNAplfold -W/-L): fold the alignment in overlapping windows
+// of window_size columns, with pairs spanning less than span columns, and average each pair
+// probability over the windows that contain the pair. Windows start every
+// window_size - span + 1 columns, so every pair is inside at least one of them (RNAplfold
+// slides by one column). A position is written out as soon as the last window containing it
+// is done; only the windows' own beams and the probabilities of the open positions are kept.
+// With --compress_gaps the windows, their step and the span count original columns, as the
+// loop limits do: each window folds the folded columns within it, with its part of column_map.
+void BeamCKYParser::parse_windows(std::vector<std::string> & MSA_, float ** ribo_, int window_size, FILE * bpp_out, FILE * unpaired_out) {
+
+    struct timeval windows_starttime, windows_endtime;
+    gettimeofday(&windows_starttime, NULL);
+
+    int n = MSA_[0].size();
+    int n_seq = MSA_.size();
+    int original_length = column_map.empty() ? n : original_seq.size();
+    int width = min(window_size, original_length);
+    int step = max(1, window_size - span + 1);
+    int num_windows = (original_length <= window_size) ? 1 : (original_length - window_size + step - 1) / step + 1;
+
+    // the first folded column at or after original column c
+    auto folded_column = [&](int c) {
+        if (column_map.empty()) return min(c, n);
+        return (int)(lower_bound(column_map.begin(), column_map.end(), c) - column_map.begin());
+    };
+
+    // windows k * step with k in [0, num_windows) that contain both original columns i and j
+    auto num_covering = [&](int i, int j) {
+        int k_lo = max(0, (j - window_size + 1 + step - 1) / step);
+        int k_hi = min(num_windows - 1, i / step);
+        return max(1, k_hi - k_lo + 1);
+    };
+
+    // sums over the windows done so far, for positions not yet written out
+    map<pair<int, int>, double> pair_sum;
+    map<int, double> unpaired_sum;
+
+    unsigned long num_pairs = 0;
+    // next original column to write to unpaired_out; the left-out gappy columns never pair
+    int next_column = 0;
+    for (int k = 0; k < num_windows; ++k) {
+        // original columns [start, end), folded columns [first, first + len)
+        int start = k * step;
+        int end = min(start + width, original_length);
+        int first = folded_column(start);
+        int len = folded_column(end) - first;
+
+        if (len > 0) {
+            vector<string> window_MSA(n_seq);
+            for (int s = 0; s < n_seq; s++)
+                window_MSA[s] = MSA_[s].substr(first, len);
+
+            vector<float> window_smart_gap;
+            vector<vector<int>> a2s_window, s5_window, s3_window, SS_window;
+            a2s_prepare_is(window_MSA, n_seq, len, a2s_window, s5_window, s3_window, SS_window, window_smart_gap);
+            auto window_pscore = init_pscores_only(len, span);
+
+            // every pair of the window (cutoff 0): bpp_cutoff applies to the averages written out
+            BeamCKYParser window_parser(beam, no_sharp_turn, false, "", "", false, 0.0, "", false, gamma, "", false, false, threshknot_threshold, "", beam_policy, beam_margin, time_budget, span);
+            window_parser.window_mode = true;
+            window_parser.linear_space = linear_space;
+            if (!column_map.empty()) {
+                window_parser.original_seq = original_seq.substr(start, end - start);
+                window_parser.column_map.resize(len);
+                for (int i = 0; i < len; i++)
+                    window_parser.column_map[i] = column_map[first + i] - start;
+            }
+            window_parser.parse_alifold(window_MSA, a2s_window, window_pscore, s5_window, s3_window, SS_window, ribo_, window_smart_gap);
+
+            vector<double> unpaired(len, 1.0);
+            for (auto & pij : window_parser.Pij) {
+                int i = pij.first.first - 1, j = pij.first.second - 1;
+                pair_sum[make_pair(first + i, first + j)] += pij.second;
+                unpaired[i] -= pij.second;
+                unpaired[j] -= pij.second;
+            }
+            for (int i = 0; i < len; i++)
+                unpaired_sum[first + i] += max(0.0, unpaired[i]);
+        }
+
+        // positions left of the next window are final
+        int done = (k == num_windows - 1) ? n : folded_column((k + 1) * step);
+
+        auto pair_end = pair_sum.lower_bound(make_pair(done, 0));
+        for (auto it = pair_sum.begin(); it != pair_end; ++it) {
+            int i = it->first.first, j = it->first.second;
+            double prob = it->second / num_covering(original_index(i), original_index(j));
+            if (prob < bpp_cutoff) continue;
+            fprintf(bpp_out, "%d %d %.4e\n", original_index(i) + 1, original_index(j) + 1, prob);
+            ++num_pairs;
+        }
+        pair_sum.erase(pair_sum.begin(), pair_end);
+
+        auto unpaired_end = unpaired_sum.lower_bound(done);
+        for (auto it = unpaired_sum.begin(); it != unpaired_end && unpaired_out != NULL; ++it) {
+            int column = original_index(it->first);
+            for (; next_column < column; next_column++)
+                fprintf(unpaired_out, "%d %.4e\n", next_column + 1, 1.0);
+            fprintf(unpaired_out, "%d %.4e\n", column + 1, it->second / num_covering(column, column));
+            next_column = column + 1;
+        }
+        if (k == num_windows - 1 && unpaired_out != NULL)
+            for (; next_column < original_length; next_column++)
+                fprintf(unpaired_out, "%d %.4e\n", next_column + 1, 1.0);
+        unpaired_sum.erase(unpaired_sum.begin(), unpaired_end);
+
+        fflush(bpp_out);
+        if (unpaired_out != NULL) fflush(unpaired_out);
+    }
+
+    gettimeofday(&windows_endtime, NULL);
+    double windows_elapsed_time = windows_endtime.tv_sec - windows_starttime.tv_sec + (windows_endtime.tv_usec-windows_starttime.tv_usec)/1000000.0;
+
+    if (is_verbose) {
+        fprintf(stdout,"Windows: %d of %d columns (step %d, max span %d)\n", num_windows, width, step, span);
+        fprintf(stdout,"Base Pairs Written: %lu\n", num_pairs);
+        fprintf(stdout,"Local Folding Time: %.2f seconds.\n", windows_elapsed_time);
+    }
+}
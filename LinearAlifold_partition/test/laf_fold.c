@@ -0,0 +1,95 @@
+/* laf_fold: fold the alignment of a FASTA file with lib/liblinearalifold and print the results
+ * as the fold server answers "fold joint_mfe=1 mea=1 threshknot=1" (see src/server.cpp), so that
+ * the two can be compared (make check). The alignment is folded twice on the same parser, which
+ * must give the same results, and an empty alignment must be refused.
+ *
+ *   bin/laf_fold alignment_fasta.fa
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "liblinearalifold.h"
+
+#define MAX_ROWS 4096
+#define MAX_LINE 1000000
+
+/* the rows of the FASTA file at path (one line per sequence) into rows; their number, -1 if the
+ * file cannot be read */
+static int read_rows(const char * path, char ** rows) {
+    static char line[MAX_LINE];
+    FILE * fptr = fopen(path, "r");
+    if (fptr == NULL) return -1;
+    int n_rows = 0;
+    while (n_rows < MAX_ROWS && fgets(line, sizeof(line), fptr) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0 || line[0] == '>' || line[0] == ';') continue;
+        rows[n_rows++] = strdup(line);
+    }
+    fclose(fptr);
+    return n_rows;
+}
+
+static laf_pair * get_pairs(size_t (*get)(const laf_parser *, laf_pair *, size_t), const laf_parser * parser, size_t * n) {
+    *n = get(parser, NULL, 0);
+    laf_pair * pairs = malloc((*n + 1) * sizeof(laf_pair));
+    get(parser, pairs, *n);
+    return pairs;
+}
+
+int main(int argc, char ** argv) {
+    static char * rows[MAX_ROWS];
+    int n_rows = argc > 1 ? read_rows(argv[1], rows) : -1;
+    if (n_rows <= 0) {
+        fprintf(stderr, "usage: %s ALIGNMENT.fa\n", argv[0]);
+        return 1;
+    }
+    int length = strlen(rows[0]);
+
+    laf_model * model = laf_model_create();
+    laf_options options;
+    laf_options_default(&options);
+    options.mfe = 1;
+    options.mea = 1;
+    options.threshknot = 1;
+    laf_parser * parser = laf_parser_create(model, &options);
+
+    if (laf_fold(parser, (const char * const *)rows, n_rows, length) != 0) {
+        printf("error %s\nend\n", laf_error(parser));
+        return 1;
+    }
+    double energy, covariance;
+    const char * mfe = laf_mfe_structure(parser, &energy, &covariance);
+    printf("ok\nensemble %.2f\n", laf_ensemble_energy(parser));
+    printf("joint_mfe %s %.2f %.2f %.2f\n", mfe, energy, energy - covariance, covariance);
+    printf("mea %s\n", laf_mea_structure(parser));
+
+    size_t n_knots, n_pairs;
+    laf_pair * knots = get_pairs(laf_threshknot, parser, &n_knots);
+    printf("threshknot");
+    for (size_t k = 0; k < n_knots; k++) printf(" %d %d", knots[k].i, knots[k].j);
+    printf("\n");
+    laf_pair * pairs = get_pairs(laf_bpp, parser, &n_pairs);
+    for (size_t k = 0; k < n_pairs; k++) printf("bpp %d %d %.4e\n", pairs[k].i, pairs[k].j, pairs[k].prob);
+    printf("end\n");
+
+    /* the parser keeps its tables between folds, the results must not depend on them */
+    int failed = 0;
+    double ensemble = laf_ensemble_energy(parser);
+    if (laf_fold(parser, (const char * const *)rows, n_rows, length) != 0 || laf_ensemble_energy(parser) != ensemble || laf_bpp(parser, NULL, 0) != n_pairs) {
+        fprintf(stderr, "laf_fold: a second fold on the same parser differs\n");
+        failed = 1;
+    }
+
+    const char * empty[2] = {"ACGU", "ACGU"};
+    if (laf_fold(parser, empty, 0, 4) == 0 || laf_fold(parser, empty, 2, 0) == 0 || laf_error(parser)[0] == 0) {
+        fprintf(stderr, "laf_fold: an empty alignment was folded\n");
+        failed = 1;
+    }
+
+    free(knots);
+    free(pairs);
+    laf_parser_destroy(parser);
+    laf_model_destroy(model);
+    return failed;
+}
@@ -0,0 +1,103 @@
+/* laf_threads: fold with lib/liblinearalifold on several threads at once, one parser per thread
+ * and one model for all (see src/liblinearalifold.h). Every thread folds, in turn, the alignment
+ * of a FASTA file and the alignment of its first half of the rows, and every result (ensemble
+ * free energy and number of pairs) must be the one a single parser gets for it.
+ *
+ *   bin/laf_threads alignment_fasta.fa [THREADS]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "liblinearalifold.h"
+
+#define MAX_ROWS 4096
+#define MAX_LINE 1000000
+#define FOLDS_PER_THREAD 6
+
+typedef struct {
+    char * rows[MAX_ROWS];
+    int n_rows;
+    double energy;  /* of a single parser */
+    size_t n_pairs;
+} alignment;
+
+static alignment alignments[2];
+static laf_model * model;
+static int mismatches = 0;
+static pthread_mutex_t mismatches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int read_rows(const char * path, char ** rows) {
+    static char line[MAX_LINE];
+    FILE * fptr = fopen(path, "r");
+    if (fptr == NULL) return -1;
+    int n_rows = 0;
+    while (n_rows < MAX_ROWS && fgets(line, sizeof(line), fptr) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0 || line[0] == '>' || line[0] == ';') continue;
+        rows[n_rows++] = strdup(line);
+    }
+    fclose(fptr);
+    return n_rows;
+}
+
+/* 0 if the alignment folds with the results of a single parser */
+static int fold(laf_parser * parser, const alignment * a, double * energy, size_t * n_pairs) {
+    if (laf_fold(parser, (const char * const *)a->rows, a->n_rows, strlen(a->rows[0])) != 0) return -1;
+    *energy = laf_ensemble_energy(parser);
+    *n_pairs = laf_bpp(parser, NULL, 0);
+    return 0;
+}
+
+static void * work(void * arg) {
+    long t = (long)arg;
+    laf_parser * parser = laf_parser_create(model, NULL);
+    for (int k = 0; k < FOLDS_PER_THREAD; k++) {
+        const alignment * a = &alignments[(k + t) % 2];
+        double energy;
+        size_t n_pairs;
+        if (fold(parser, a, &energy, &n_pairs) != 0 || energy != a->energy || n_pairs != a->n_pairs) {
+            pthread_mutex_lock(&mismatches_lock);
+            ++mismatches;
+            pthread_mutex_unlock(&mismatches_lock);
+        }
+    }
+    laf_parser_destroy(parser);
+    return NULL;
+}
+
+int main(int argc, char ** argv) {
+    int n_rows = argc > 1 ? read_rows(argv[1], alignments[0].rows) : -1;
+    if (n_rows < 2) {
+        fprintf(stderr, "usage: %s ALIGNMENT.fa [THREADS] (at least 2 rows)\n", argv[0]);
+        return 1;
+    }
+    alignments[0].n_rows = n_rows;
+    alignments[1].n_rows = n_rows / 2;
+    memcpy(alignments[1].rows, alignments[0].rows, (n_rows / 2) * sizeof(char *));
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    if (threads < 1) threads = 1;
+
+    /* a second model is another handle to the same process-global energy model */
+    model = laf_model_create();
+    laf_model_destroy(laf_model_create());
+
+    laf_parser * parser = laf_parser_create(model, NULL);
+    for (int w = 0; w < 2; w++)
+        if (fold(parser, &alignments[w], &alignments[w].energy, &alignments[w].n_pairs) != 0) {
+            fprintf(stderr, "laf_threads: %s\n", laf_error(parser));
+            return 1;
+        }
+    laf_parser_destroy(parser);
+
+    pthread_t * workers = malloc(threads * sizeof(pthread_t));
+    for (long t = 0; t < threads; t++) pthread_create(&workers[t], NULL, work, (void *)t);
+    for (int t = 0; t < threads; t++) pthread_join(workers[t], NULL);
+    free(workers);
+
+    printf("%d threads, %d folds each: ensemble %.2f and %.2f kcal/mol, %d mismatches\n", threads, FOLDS_PER_THREAD,
+           alignments[0].energy, alignments[1].energy, mismatches);
+    laf_model_destroy(model);
+    return mismatches != 0;
+}
@@ -0,0 +1,33 @@
+"""LinearAlifold for Python: both engines folding in-process (see README.md).
+
+PartitionParser  the partition function engine (LinearAlifold_partition): ensemble free
+                 energy, base pair probabilities as COO / CSR arrays, MFE, MEA, ThreshKnot
+MFEParser        the MFE engine (LinearAlifold_MFE)
+read_bpp         reader of the binary bpp files of linearalifold_p --bpp_format binary / binary16
+open_container   reader of the result containers of linearalifold_p --container
+load_forest      loader of the binary forests of linearalifold_p --dumpforest --forest_format binary
+
+Both fold an alignment given as a list of aligned sequences or a 2-d uint8 matrix, and
+release the GIL while they fold; use one parser per thread. The compiled engines (_partition,
+_mfe) are imported on first use, so the readers work without them.
+"""
+
+import importlib
+
+from .bpp import BPPRecord, read_bpp
+from .container import Container, ContainerRecord, open_container
+from .forest import Forest, ForestStates, load_forest
+
+__all__ = ["PartitionParser", "Result", "MFEParser", "BPPRecord", "read_bpp", "Container", "ContainerRecord", "open_container",
+           "Forest", "ForestStates", "load_forest"]
+
+
+_engines = {"PartitionParser": "_partition", "Result": "_partition", "MFEParser": "_mfe"}
+
+
+def __getattr__(name):
+    if name not in _engines:
+        raise AttributeError("module %r has no attribute %r" % (__name__, name))
+    value = getattr(importlib.import_module("." + _engines[name], __name__), name)
+    globals()[name] = value
+    return value
@@ -0,0 +1,85 @@
+"""Reader of the binary base pair probability files of linearalifold_p --bpp_format binary /
+binary16 (the layout is described in LinearAlifold_partition/src/Utils/bpp_binary.h).
+
+    for record in read_bpp("out.bpp"):
+        record.names              # the '>' lines of the alignment
+        record.indptr, record.j   # CSR row offsets (length + 1) and 1-based columns j, by i
+        record.prob               # probabilities, float
+        record.get(i, j)          # one pair, 0.0 if it was not written
+
+The file is mapped, not read: indptr, j and prob are NumPy arrays over the mapping (memoryviews
+if NumPy is not installed; quantised probabilities are then converted to a list).
+"""
+
+import mmap
+import struct
+from bisect import bisect_left
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+__all__ = ["BPPRecord", "read_bpp"]
+
+_MAGIC = b"LAFBPP\0\0"
+_VERSION = 1
+_QUANTISED = 1
+_HEADER = struct.Struct("=8sIIIIQQ")
+
+
+def _pad(size):
+    return (size + 7) & ~7
+
+
+def _array(buffer, offset, count, code, dtype):
+    if numpy is not None:
+        return numpy.frombuffer(buffer, dtype=dtype, count=count, offset=offset)
+    size = struct.calcsize(code)
+    return memoryview(buffer)[offset:offset + count * size].cast(code)
+
+
+class BPPRecord:
+    """The base pair probabilities of one alignment."""
+
+    def __init__(self, buffer, offset):
+        magic, version, flags, length, names_size, num_pairs, record_size = _HEADER.unpack_from(buffer, offset)
+        if magic != _MAGIC or version != _VERSION or offset + record_size > len(buffer):
+            raise ValueError("not a binary bpp record of version %d at offset %d" % (_VERSION, offset))
+        self.length = length
+        self.num_pairs = num_pairs
+        self.quantised = bool(flags & _QUANTISED)
+        self.size = record_size
+
+        cursor = offset + _HEADER.size
+        self.names = bytes(buffer[cursor:cursor + names_size]).decode().splitlines()
+        cursor += _pad(names_size)
+        self.indptr = _array(buffer, cursor, length + 1, "Q", numpy.uint64 if numpy else None)
+        cursor += (length + 1) * 8
+        self.j = _array(buffer, cursor, num_pairs, "I", numpy.uint32 if numpy else None)
+        cursor += _pad(num_pairs * 4)
+        if self.quantised:
+            prob = _array(buffer, cursor, num_pairs, "H", numpy.uint16 if numpy else None)
+            self.prob = prob / 65535.0 if numpy is not None else [q / 65535.0 for q in prob]
+        else:
+            self.prob = _array(buffer, cursor, num_pairs, "f", numpy.float32 if numpy else None)
+
+    def get(self, i, j):
+        if i < 1 or i > self.length:
+            return 0.0
+        begin, end = int(self.indptr[i - 1]), int(self.indptr[i])
+        e = bisect_left(self.j, j, begin, end)
+        return float(self.prob[e]) if e < end and self.j[e] == j else 0.0
+
+
+def read_bpp(path):
+    """The records of the file at path, in order."""
+    with open(path, "rb") as f:
+        buffer = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    records = []
+    offset = 0
+    while offset < len(buffer):
+        record = BPPRecord(buffer, offset)
+        records.append(record)
+        offset += record.size
+    return records
@@ -0,0 +1,119 @@
+"""Reader of the result containers of linearalifold_p --container (the layout is described in
+LinearAlifold_partition/src/Utils/result_container.h).
+
+    container = open_container("results.lafc")
+    container.names()                # the alignment names, sorted
+    record = container["RF00001"]    # by name, from the index (KeyError if there is none)
+    record.ensemble_energy           # kcal/mol
+    record.mfe                       # (structure, energy, free energy, covariance) or None
+    record.mea                       # structure or None
+    record.threshknot                # [(i, j), ...], 1-based
+    record.bpp                       # a bpp.BPPRecord or None (see bpp.py)
+
+The file is mapped, and a record is only read when it is looked up.
+"""
+
+import mmap
+import struct
+
+from .bpp import BPPRecord
+
+__all__ = ["Container", "ContainerRecord", "open_container"]
+
+_MAGIC = b"LAFCONT\0"
+_FOOTER_MAGIC = b"LAFCIDX\0"
+_VERSION = 1
+_HEADER = struct.Struct("=8sII")
+_RECORD = struct.Struct("=QdddIIIIQ")
+_ENTRY = struct.Struct("=QQII")
+_FOOTER = struct.Struct("=QQ8s")
+
+
+def _pad(size):
+    return (size + 7) & ~7
+
+
+class ContainerRecord:
+    """The results of one alignment."""
+
+    def __init__(self, buffer, offset):
+        (size, ensemble, mfe_energy, mfe_covariance, name_size, mfe_size, mea_size,
+         num_threshknot, bpp_size) = _RECORD.unpack_from(buffer, offset)
+        cursor = offset + _RECORD.size
+
+        def text(size):
+            nonlocal cursor
+            value = bytes(buffer[cursor:cursor + size]).decode()
+            cursor += _pad(size)
+            return value
+
+        self.name = text(name_size)
+        self.ensemble_energy = ensemble
+        mfe = text(mfe_size)
+        self.mfe = (mfe, mfe_energy, mfe_energy - mfe_covariance, mfe_covariance) if mfe else None
+        self.mea = text(mea_size) or None
+        knots = struct.unpack_from("=%di" % (2 * num_threshknot), buffer, cursor)
+        self.threshknot = list(zip(knots[0::2], knots[1::2]))
+        cursor += _pad(8 * num_threshknot)
+        self.bpp = BPPRecord(buffer, cursor) if bpp_size else None
+
+
+class Container:
+    """A mapped result container."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self._buffer = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        buffer = self._buffer
+        if len(buffer) < _HEADER.size + _FOOTER.size:
+            raise ValueError("%s is not a result container" % path)
+        magic, version, _ = _HEADER.unpack_from(buffer, 0)
+        index_offset, num_records, footer_magic = _FOOTER.unpack_from(buffer, len(buffer) - _FOOTER.size)
+        if magic != _MAGIC or version != _VERSION or footer_magic != _FOOTER_MAGIC:
+            raise ValueError("%s is not a complete result container of version %d" % (path, _VERSION))
+        self._index_offset = index_offset
+        self._names_offset = index_offset + _pad(num_records * _ENTRY.size)
+        self._count = num_records
+
+    def __len__(self):
+        return self._count
+
+    def _entry(self, k):
+        record_offset, name_offset, name_size, _ = _ENTRY.unpack_from(self._buffer, self._index_offset + k * _ENTRY.size)
+        start = self._names_offset + name_offset
+        return bytes(self._buffer[start:start + name_size]).decode(), record_offset
+
+    def names(self):
+        return [self._entry(k)[0] for k in range(self._count)]
+
+    def __iter__(self):
+        """The records, by name."""
+        for k in range(self._count):
+            yield ContainerRecord(self._buffer, self._entry(k)[1])
+
+    def __contains__(self, name):
+        return self._find(name) is not None
+
+    def __getitem__(self, name):
+        offset = self._find(name)
+        if offset is None:
+            raise KeyError(name)
+        return ContainerRecord(self._buffer, offset)
+
+    def _find(self, name):
+        lo, hi = 0, self._count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self._entry(mid)[0].encode() < name.encode():
+                lo = mid + 1
+            else:
+                hi = mid
+        if lo < self._count:
+            found, offset = self._entry(lo)
+            if found == name:
+                return offset
+        return None
+
+
+def open_container(path):
+    return Container(path)
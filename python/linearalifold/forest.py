@@ -0,0 +1,102 @@
+"""Loader of the binary forests of linearalifold_p --dumpforest FILE --forest_format binary (the
+layout is described in LinearAlifold_partition/src/Utils/forest_binary.h).
+
+    forest = load_forest("forest.bin")
+    forest.seq, forest.columns          # first row; original column of every folded column
+    forest.log_z                        # log partition function
+    forest.E_alpha, forest.E_beta       # per column (E_beta None for an inside-only forest)
+    P = forest.states["P"]              # also "M", "M2" and "Multi"
+    P.offsets, P.i, P.alpha, P.beta     # CSR by column: states (i, j) of column j are
+                                        # offsets[j-1] .. offsets[j]-1, i and j 1-based
+    P.get(i, j)                         # (alpha, beta) of a state, None if it is not kept
+
+Values are float32 log partition functions, -inf where the text dump has -1.8e308 (never set).
+The file is mapped, not read: the arrays are NumPy arrays over the mapping (memoryviews if NumPy
+is not installed).
+"""
+
+import mmap
+import struct
+from bisect import bisect_left
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+__all__ = ["Forest", "ForestStates", "load_forest"]
+
+_MAGIC = b"LAFFORST"
+_VERSION = 1
+_OUTSIDE = 1
+_TYPES = ("P", "M", "M2", "Multi")
+_HEADER = struct.Struct("=8sIIIIff4Q")
+
+
+def _pad(size):
+    return (size + 7) & ~7
+
+
+class _Reader:
+    def __init__(self, buffer, offset):
+        self.buffer = buffer
+        self.cursor = offset
+
+    def array(self, count, code, dtype):
+        size = struct.calcsize(code) * count
+        if numpy is not None:
+            value = numpy.frombuffer(self.buffer, dtype=dtype, count=count, offset=self.cursor)
+        else:
+            value = memoryview(self.buffer)[self.cursor:self.cursor + size].cast(code)
+        self.cursor += _pad(size)
+        return value
+
+
+class ForestStates:
+    """The states of one beam type."""
+
+    def __init__(self, reader, length, count, outside):
+        self.offsets = reader.array(length + 1, "Q", numpy and numpy.uint64)
+        self.i = reader.array(count, "I", numpy and numpy.uint32)
+        self.alpha = reader.array(count, "f", numpy and numpy.float32)
+        self.beta = reader.array(count, "f", numpy and numpy.float32) if outside else None
+
+    def __len__(self):
+        return len(self.i)
+
+    def get(self, i, j):
+        begin, end = int(self.offsets[j - 1]), int(self.offsets[j])
+        e = bisect_left(self.i, i, begin, end)
+        if e == end or self.i[e] != i:
+            return None
+        return (float(self.alpha[e]), float(self.beta[e]) if self.beta is not None else None)
+
+
+class Forest:
+    """A mapped binary forest."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self._buffer = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, version, flags, length, original_length, log_z, threshold, *counts = _HEADER.unpack_from(self._buffer, 0)
+        if magic != _MAGIC or version != _VERSION:
+            raise ValueError("%s is not a binary forest of version %d" % (path, _VERSION))
+        outside = bool(flags & _OUTSIDE)
+        self.outside = outside
+        self.length = length
+        self.log_z = log_z
+        self.threshold = threshold
+
+        reader = _Reader(self._buffer, _HEADER.size)
+        self.seq = bytes(self._buffer[reader.cursor:reader.cursor + original_length]).decode()
+        reader.cursor += _pad(original_length)
+        self.columns = reader.array(length, "i", numpy and numpy.int32)
+        self.E_alpha = reader.array(length, "f", numpy and numpy.float32)
+        self.E_beta = reader.array(length, "f", numpy and numpy.float32) if outside else None
+        self.states = {}
+        for name, count in zip(_TYPES, counts):
+            self.states[name] = ForestStates(reader, length, count, outside)
+
+
+def load_forest(path):
+    return Forest(path)
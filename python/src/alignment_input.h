@@ -0,0 +1,78 @@
+// the alignment argument of the fold methods, shared by both modules (include after Python.h)
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+// the rows of alignment, a sequence of str / bytes or a 2-d uint8 buffer (a NumPy matrix of
+// ASCII codes, copied row by row: the engines fold strings), in upper case with U for T as the
+// engines read them; false with a Python exception set if it is neither or its rows differ in
+// length
+static bool read_alignment(PyObject * alignment, std::vector<std::string> & MSA) {
+    if (PyObject_CheckBuffer(alignment) && !PyBytes_Check(alignment)) {
+        Py_buffer view;
+        if (PyObject_GetBuffer(alignment, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) return false;
+        bool bytes = view.itemsize == 1 && (view.format == NULL || strcmp(view.format, "B") == 0 || strcmp(view.format, "c") == 0);
+        if (view.ndim != 2 || !bytes) {
+            PyBuffer_Release(&view);
+            PyErr_SetString(PyExc_ValueError, "an alignment matrix must be 2-dimensional and of uint8");
+            return false;
+        }
+        Py_ssize_t n_seq = view.shape[0], length = view.shape[1];
+        MSA.resize(n_seq);
+        for (Py_ssize_t s = 0; s < n_seq; s++)
+            MSA[s].assign((const char *)view.buf + s * length, length);
+        PyBuffer_Release(&view);
+    }
+    else {
+        PyObject * rows = PySequence_Fast(alignment, "an alignment is a list of aligned sequences or a uint8 matrix");
+        if (rows == NULL) return false;
+        Py_ssize_t n_seq = PySequence_Fast_GET_SIZE(rows);
+        MSA.resize(n_seq);
+        for (Py_ssize_t s = 0; s < n_seq; s++) {
+            PyObject * row = PySequence_Fast_GET_ITEM(rows, s);
+            const char * data;
+            Py_ssize_t size;
+            if (PyUnicode_Check(row)) data = PyUnicode_AsUTF8AndSize(row, &size);
+            else if (PyBytes_Check(row)) PyBytes_AsStringAndSize(row, (char **)&data, &size);
+            else {
+                PyErr_Format(PyExc_TypeError, "row %zd of the alignment is not str or bytes", s);
+                data = NULL;
+            }
+            if (data == NULL) {
+                Py_DECREF(rows);
+                return false;
+            }
+            MSA[s].assign(data, size);
+        }
+        Py_DECREF(rows);
+    }
+
+    if (MSA.empty() || MSA[0].empty()) {
+        PyErr_SetString(PyExc_ValueError, "empty alignment");
+        return false;
+    }
+    for (auto & row : MSA) {
+        if (row.size() != MSA[0].size()) {
+            PyErr_SetString(PyExc_ValueError, "rows of different lengths");
+            return false;
+        }
+        for (auto & c : row) {
+            c = toupper((unsigned char)c);
+            if (c == 'T') c = 'U';
+            else if (c == '.' || c == '~') c = '-';
+        }
+    }
+    return true;
+}
+
+// a parser folds one alignment at a time; fold methods hold it while the GIL is released
+struct FoldGuard {
+    bool & busy;
+    bool held;
+    FoldGuard(bool & busy_): busy(busy_), held(!busy_) {
+        if (held) busy = true;
+        else PyErr_SetString(PyExc_RuntimeError, "the parser is folding in another thread, use one parser per thread");
+    };
+    ~FoldGuard() { if (held) busy = false; };
+};
@@ -0,0 +1,153 @@
+// linearalifold._mfe: BeamCKYParser of the MFE engine (LinearAlifold_MFE) for Python. The
+// energy parameters are read once, on import, from $LINEARALIFOLD_ENERGY_DATA or else from
+// LinearAlifold_MFE/energy_data next to the directory of the package; MFEParser.fold releases
+// the GIL while it folds.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#define LINEARALIFOLD_LIBRARY
+#include "Linearalifold.cpp"
+#include "alignment_input.h"
+
+// the energy_data file to read: $LINEARALIFOLD_ENERGY_DATA, or ../LinearAlifold_MFE/energy_data
+// from the directory holding the linearalifold package (this module is imported from it)
+static string energy_data_path() {
+    const char * env = getenv("LINEARALIFOLD_ENERGY_DATA");
+    if (env != NULL && env[0] != 0) return env;
+    string path = "energy_data";
+    PyObject * package = PyDict_GetItemString(PyImport_GetModuleDict(), "linearalifold");
+    PyObject * package_path = package != NULL ? PyObject_GetAttrString(package, "__path__") : NULL;
+    if (package_path != NULL) {
+        PyObject * first = PySequence_Size(package_path) > 0 ? PySequence_GetItem(package_path, 0) : NULL;
+        const char * dir = first != NULL && PyUnicode_Check(first) ? PyUnicode_AsUTF8(first) : NULL;
+        if (dir != NULL) path = string(dir) + "/../../LinearAlifold_MFE/energy_data";
+        Py_XDECREF(first);
+        Py_DECREF(package_path);
+    }
+    PyErr_Clear();
+    return path;
+}
+
+typedef struct {
+    PyObject_HEAD
+    int beam;
+    int span;
+    float gap_fraction;
+    vector<string> * MSA; // the rows of the last fold; their buffers are reused by the next one
+    bool busy;
+} ParserObject;
+
+static int Parser_init(ParserObject * self, PyObject * args, PyObject * kwargs) {
+    static const char * keywords[] = {"beam", "span", "compress_gaps", NULL};
+    int beam = 100, span = 0;
+    float compress_gaps = 0.0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iif", (char **)keywords, &beam, &span, &compress_gaps))
+        return -1;
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "the parser is folding in another thread");
+        return -1;
+    }
+    self->beam = beam;
+    self->span = span;
+    self->gap_fraction = compress_gaps;
+    if (self->MSA == NULL) self->MSA = new vector<string>();
+    return 0;
+}
+
+static void Parser_dealloc(ParserObject * self) {
+    delete self->MSA;
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+// as main: the structure in the alignment's columns, and its energy per sequence as free energy + covariance
+static PyObject * Parser_fold(ParserObject * self, PyObject * alignment) {
+    if (self->MSA == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "MFEParser.__init__ was not called");
+        return NULL;
+    }
+    FoldGuard guard(self->busy);
+    if (!guard.held) return NULL;
+    vector<string> & MSA = *self->MSA;
+    if (!read_alignment(alignment, MSA)) return NULL;
+
+    string structure, error;
+    double energy = 0, covariance = 0;
+    Py_BEGIN_ALLOW_THREADS
+    int n_seq = MSA.size();
+    int original_length = MSA[0].size();
+    float ** ribo = get_ribosum(MSA, n_seq, original_length);
+    vector<int> column_map;
+    if (self->gap_fraction > 0) column_map = compress_gap_columns(MSA, self->gap_fraction);
+
+    int length = MSA[0].size();
+    if (length == 0) error = "no columns left to fold";
+    else if (length >= MAX_TRACE_LENGTH) error = "alignment too long to trace back";
+    else {
+        auto pscore = init_pscores_only(length, self->span);
+        vector<float> smart_gap;
+        vector<vector<int>> a2s, s5, s3, SS;
+        a2s_prepare_is(MSA, n_seq, length, a2s, s5, s3, SS, smart_gap);
+
+        BeamCKYParser parser(self->beam, true, false, BEAM_FIXED, 0.0, 0.0, self->span);
+        parser.column_map = column_map;
+        BeamCKYParser::DecoderResult result = parser.parse_alifold(MSA, ribo, pscore, a2s, s5, s3, SS, smart_gap);
+
+        float pscore_f = 0.;
+        for (auto & pair : get_pairs(result.structure))
+            pscore_f += pscore[pair.first][pair.second].ribo_score;
+        covariance = -pscore_f / n_seq / 100.;
+        energy = result.score / -100.0 / n_seq;
+        structure = column_map.empty() ? result.structure : expand_structure(result.structure, column_map, original_length);
+    }
+    for (int i = 0; i < 7; i++) free(ribo[i]);
+    free(ribo);
+    Py_END_ALLOW_THREADS
+
+    if (!error.empty()) {
+        PyErr_SetString(PyExc_ValueError, error.c_str());
+        return NULL;
+    }
+    return Py_BuildValue("(sddd)", structure.c_str(), energy, energy - covariance, covariance);
+}
+
+static PyMethodDef Parser_methods[] = {
+    {"fold", (PyCFunction)Parser_fold, METH_O,
+     "fold(alignment) -> (structure, energy, free energy, covariance)\n\n"
+     "alignment: a list of aligned sequences (str or bytes) or a 2-d uint8 matrix of their ASCII codes"},
+    {NULL}
+};
+
+static PyTypeObject ParserType = {PyVarObject_HEAD_INIT(NULL, 0) "linearalifold._mfe.MFEParser"};
+
+static struct PyModuleDef mfe_module = {PyModuleDef_HEAD_INIT, "_mfe", "LinearAlifold MFE engine", -1, NULL};
+
+PyMODINIT_FUNC PyInit__mfe(void) {
+    string path = energy_data_path();
+    FILE * energy_data = fopen(path.c_str(), "r");
+    if (energy_data == NULL) {
+        PyErr_Format(PyExc_ImportError, "could not read the energy parameters %s (set LINEARALIFOLD_ENERGY_DATA)", path.c_str());
+        return NULL;
+    }
+    fclose(energy_data);
+    parseEnergyData(path, false);
+
+    ParserType.tp_basicsize = sizeof(ParserObject);
+    ParserType.tp_dealloc = (destructor)Parser_dealloc;
+    ParserType.tp_flags = Py_TPFLAGS_DEFAULT;
+    ParserType.tp_init = (initproc)Parser_init;
+    ParserType.tp_new = PyType_GenericNew;
+    ParserType.tp_methods = Parser_methods;
+    ParserType.tp_doc = "MFEParser(beam=100, span=0, compress_gaps=0.0)\n\n"
+                        "options as the flags of the same names of LinearAlifold_MFE/linearalifold";
+    if (PyType_Ready(&ParserType) < 0) return NULL;
+
+    PyObject * module = PyModule_Create(&mfe_module);
+    if (module == NULL) return NULL;
+    Py_INCREF(&ParserType);
+    if (PyModule_AddObject(module, "MFEParser", (PyObject *)&ParserType) != 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
@@ -0,0 +1,319 @@
+// linearalifold._partition: BeamCKYParser of the partition engine (LinearAlifold_partition)
+// for Python. A PartitionParser keeps its parser between folds and releases the GIL while it
+// folds; the pair probabilities of a Result are exported through the buffer protocol, so
+// numpy (if installed) views them without a copy.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+
+#define LINEARALIFOLD_LIBRARY
+#include "linearalifold_p.cpp"
+#include "alignment_input.h"
+
+// the pairs of a fold, 0-based original columns, sorted by i then j; as COO (i, j, prob)
+// and CSR (indptr, j, prob) at once
+struct Pairs {
+    vector<int32_t> i, j, indptr;
+    vector<double> prob;
+};
+
+typedef struct {
+    PyObject_HEAD
+    Pairs * pairs;
+    int length;             // columns of the alignment, also with compress_gaps
+    double ensemble_energy;
+    PyObject * mfe;         // (structure, energy, free energy, covariance) or None
+    PyObject * mea;         // structure or None
+    PyObject * threshknot;  // [(i, j), ...] or None
+} ResultObject;
+
+// one array of a Result, read-only; keeps the Result alive as long as it is viewed
+typedef struct {
+    PyObject_HEAD
+    PyObject * owner;
+    void * data;
+    Py_ssize_t size;
+    Py_ssize_t itemsize;
+    const char * format;
+} ArrayObject;
+
+static PyObject * numpy_module = NULL; // Py_None if numpy cannot be imported
+
+static int Array_getbuffer(ArrayObject * self, Py_buffer * view, int flags) {
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "pair arrays are read-only");
+        view->obj = NULL;
+        return -1;
+    }
+    view->buf = self->data;
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->len = self->size * self->itemsize;
+    view->readonly = 1;
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? (char *)self->format : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &self->size : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &self->itemsize : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static void Array_dealloc(ArrayObject * self) {
+    Py_XDECREF(self->owner);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyBufferProcs Array_buffer = {(getbufferproc)Array_getbuffer, NULL};
+
+static PyTypeObject ArrayType = {PyVarObject_HEAD_INIT(NULL, 0) "linearalifold._partition.Array"};
+
+// data as a numpy array if numpy is installed, as a memoryview otherwise
+template <typename T>
+static PyObject * export_array(PyObject * owner, vector<T> & data, const char * format) {
+    ArrayObject * array = PyObject_New(ArrayObject, &ArrayType);
+    if (array == NULL) return NULL;
+    Py_INCREF(owner);
+    array->owner = owner;
+    array->data = data.data();
+    array->size = data.size();
+    array->itemsize = sizeof(T);
+    array->format = format;
+
+    if (numpy_module == NULL) {
+        numpy_module = PyImport_ImportModule("numpy");
+        if (numpy_module == NULL) {
+            PyErr_Clear();
+            Py_INCREF(Py_None);
+            numpy_module = Py_None;
+        }
+    }
+    PyObject * exported = numpy_module == Py_None ? PyMemoryView_FromObject((PyObject *)array)
+                                                  : PyObject_CallMethod(numpy_module, "asarray", "O", (PyObject *)array);
+    Py_DECREF(array);
+    return exported;
+}
+
+static PyObject * none() {
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static void Result_dealloc(ResultObject * self) {
+    delete self->pairs;
+    Py_XDECREF(self->mfe);
+    Py_XDECREF(self->mea);
+    Py_XDECREF(self->threshknot);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject * Result_coo(ResultObject * self, PyObject *) {
+    PyObject * i = export_array((PyObject *)self, self->pairs->i, "i");
+    PyObject * j = export_array((PyObject *)self, self->pairs->j, "i");
+    PyObject * prob = export_array((PyObject *)self, self->pairs->prob, "d");
+    if (i == NULL || j == NULL || prob == NULL) {
+        Py_XDECREF(i);
+        Py_XDECREF(j);
+        Py_XDECREF(prob);
+        return NULL;
+    }
+    return Py_BuildValue("(NNN)", i, j, prob);
+}
+
+static PyObject * Result_csr(ResultObject * self, PyObject *) {
+    PyObject * prob = export_array((PyObject *)self, self->pairs->prob, "d");
+    PyObject * j = export_array((PyObject *)self, self->pairs->j, "i");
+    PyObject * indptr = export_array((PyObject *)self, self->pairs->indptr, "i");
+    if (prob == NULL || j == NULL || indptr == NULL) {
+        Py_XDECREF(prob);
+        Py_XDECREF(j);
+        Py_XDECREF(indptr);
+        return NULL;
+    }
+    return Py_BuildValue("(NNN)", prob, j, indptr);
+}
+
+static PyObject * Result_shape(ResultObject * self, void *) {
+    return Py_BuildValue("(ii)", self->length, self->length);
+}
+
+static PyMethodDef Result_methods[] = {
+    {"coo", (PyCFunction)Result_coo, METH_NOARGS, "coo() -> (i, j, prob): the pairs (i < j, 0-based columns) by i then j"},
+    {"csr", (PyCFunction)Result_csr, METH_NOARGS, "csr() -> (prob, j, indptr): the pairs as rows i, for scipy.sparse.csr_matrix(result.csr(), shape=result.shape)"},
+    {NULL}
+};
+
+static PyMemberDef Result_members[] = {
+    {(char *)"ensemble_energy", T_DOUBLE, offsetof(ResultObject, ensemble_energy), READONLY, (char *)"free energy of the ensemble, kcal/mol"},
+    {(char *)"mfe", T_OBJECT, offsetof(ResultObject, mfe), READONLY, (char *)"(structure, energy, free energy, covariance) with mfe=True, None otherwise"},
+    {(char *)"mea", T_OBJECT, offsetof(ResultObject, mea), READONLY, (char *)"MEA structure with mea=True, None otherwise"},
+    {(char *)"threshknot", T_OBJECT, offsetof(ResultObject, threshknot), READONLY, (char *)"ThreshKnot pairs [(i, j), ...] with threshknot=True, None otherwise"},
+    {NULL}
+};
+
+static PyGetSetDef Result_getset[] = {
+    {(char *)"shape", (getter)Result_shape, NULL, (char *)"(columns, columns)", NULL},
+    {NULL}
+};
+
+static PyTypeObject ResultType = {PyVarObject_HEAD_INIT(NULL, 0) "linearalifold._partition.Result"};
+
+typedef struct {
+    PyObject_HEAD
+    BeamCKYParser * parser;
+    FoldOptions options;
+    vector<string> * MSA;   // the rows of the last fold; their buffers are reused by the next one
+    bool busy;
+} ParserObject;
+
+static int Parser_init(ParserObject * self, PyObject * args, PyObject * kwargs) {
+    static const char * keywords[] = {"beam", "mea", "gamma", "threshknot", "threshold", "cutoff", "mfe", "span", "compress_gaps", "sharpturn", "linear", NULL};
+    int beam = 100, mea = 0, threshknot = 0, mfe = 0, span = 0, sharpturn = 0, linear = 0;
+    float gamma = 3.0, threshold = 0.3, cutoff = 0.0, compress_gaps = 0.0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|ipfpffpifpp", (char **)keywords, &beam, &mea, &gamma, &threshknot, &threshold, &cutoff, &mfe, &span, &compress_gaps, &sharpturn, &linear))
+        return -1;
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "the parser is folding in another thread");
+        return -1;
+    }
+
+    self->options = {beam, mea != 0, gamma, threshknot != 0, threshold, cutoff, mfe != 0, span, compress_gaps,
+                     sharpturn == 0, BEAM_FIXED, 0.0, 0.0, linear != 0};
+    delete self->parser;
+    self->parser = new BeamCKYParser(beam, sharpturn == 0, false, "", "", false, cutoff, "", mea != 0, gamma, "", false, threshknot != 0, threshold, "", BEAM_FIXED, 0.0, 0.0, span);
+    self->parser->keep_results = true;
+    self->parser->linear_space = linear != 0;
+    if (self->MSA == NULL) self->MSA = new vector<string>();
+    return 0;
+}
+
+static void Parser_dealloc(ParserObject * self) {
+    delete self->parser;
+    delete self->MSA;
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject * Parser_fold(ParserObject * self, PyObject * alignment) {
+    if (self->parser == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "PartitionParser.__init__ was not called");
+        return NULL;
+    }
+    FoldGuard guard(self->busy);
+    if (!guard.held) return NULL;
+    vector<string> & MSA = *self->MSA;
+    if (!read_alignment(alignment, MSA)) return NULL;
+    int length = MSA[0].size();
+
+    BeamCKYParser & parser = *self->parser;
+    Pairs * pairs = new Pairs();
+    string error;
+    bool folded;
+    Py_BEGIN_ALLOW_THREADS
+    folded = parser.fold(MSA, self->options, error);
+    if (folded) {
+        auto sorted = parser.bpp_pairs();
+        pairs->i.reserve(sorted.size());
+        pairs->j.reserve(sorted.size());
+        pairs->prob.reserve(sorted.size());
+        pairs->indptr.assign(length + 1, 0);
+        for (auto & pij : sorted) {
+            pairs->i.push_back(pij.first.first - 1);
+            pairs->j.push_back(pij.first.second - 1);
+            pairs->prob.push_back(pij.second);
+            pairs->indptr[pij.first.first]++;
+        }
+        for (int i = 0; i < length; i++) pairs->indptr[i + 1] += pairs->indptr[i];
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!folded) {
+        delete pairs;
+        PyErr_SetString(PyExc_ValueError, error.c_str());
+        return NULL;
+    }
+
+    ResultObject * result = PyObject_New(ResultObject, &ResultType);
+    if (result == NULL) {
+        delete pairs;
+        return NULL;
+    }
+    result->pairs = pairs;
+    result->length = length;
+    result->ensemble_energy = parser.ensemble_energy;
+    result->mfe = result->mea = result->threshknot = NULL;
+
+    if (self->options.mfe)
+        result->mfe = Py_BuildValue("(sddd)", parser.joint_mfe_structure.c_str(), parser.joint_mfe_energy,
+                                    parser.joint_mfe_energy - parser.joint_mfe_covariance, parser.joint_mfe_covariance);
+    else result->mfe = none();
+    result->mea = self->options.mea ? PyUnicode_FromString(parser.mea_structure.c_str()) : none();
+    if (self->options.threshknot) {
+        result->threshknot = PyList_New(0);
+        for (auto & item : parser.threshknot_pairs) {
+            if (result->threshknot == NULL) break;
+            if (item.first > item.second) continue;
+            PyObject * ij = Py_BuildValue("(ii)", item.first - 1, item.second - 1);
+            if (ij == NULL || PyList_Append(result->threshknot, ij) != 0) Py_CLEAR(result->threshknot);
+            Py_XDECREF(ij);
+        }
+    }
+    else result->threshknot = none();
+
+    if (result->mfe == NULL || result->mea == NULL || result->threshknot == NULL) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return (PyObject *)result;
+}
+
+static PyMethodDef Parser_methods[] = {
+    {"fold", (PyCFunction)Parser_fold, METH_O,
+     "fold(alignment) -> Result\n\nalignment: a list of aligned sequences (str or bytes) or a 2-d uint8 matrix of their ASCII codes"},
+    {NULL}
+};
+
+static PyTypeObject ParserType = {PyVarObject_HEAD_INIT(NULL, 0) "linearalifold._partition.PartitionParser"};
+
+static struct PyModuleDef partition_module = {PyModuleDef_HEAD_INIT, "_partition", "LinearAlifold partition function engine", -1, NULL};
+
+PyMODINIT_FUNC PyInit__partition(void) {
+    initialize();
+
+    ArrayType.tp_basicsize = sizeof(ArrayObject);
+    ArrayType.tp_dealloc = (destructor)Array_dealloc;
+    ArrayType.tp_flags = Py_TPFLAGS_DEFAULT;
+    ArrayType.tp_as_buffer = &Array_buffer;
+    ArrayType.tp_doc = "a read-only array of a Result";
+
+    ResultType.tp_basicsize = sizeof(ResultObject);
+    ResultType.tp_dealloc = (destructor)Result_dealloc;
+    ResultType.tp_flags = Py_TPFLAGS_DEFAULT;
+    ResultType.tp_methods = Result_methods;
+    ResultType.tp_members = Result_members;
+    ResultType.tp_getset = Result_getset;
+    ResultType.tp_doc = "the results of PartitionParser.fold";
+
+    ParserType.tp_basicsize = sizeof(ParserObject);
+    ParserType.tp_dealloc = (destructor)Parser_dealloc;
+    ParserType.tp_flags = Py_TPFLAGS_DEFAULT;
+    ParserType.tp_init = (initproc)Parser_init;
+    ParserType.tp_new = PyType_GenericNew;
+    ParserType.tp_methods = Parser_methods;
+    ParserType.tp_doc = "PartitionParser(beam=100, mea=False, gamma=3.0, threshknot=False, threshold=0.3, cutoff=0.0, "
+                        "mfe=False, span=0, compress_gaps=0.0, sharpturn=False, linear=False)\n\n"
+                        "options as the flags of the same names of LinearAlifold_partition/linearalifold (cutoff: -c)";
+
+    if (PyType_Ready(&ArrayType) < 0 || PyType_Ready(&ResultType) < 0 || PyType_Ready(&ParserType) < 0) return NULL;
+
+    PyObject * module = PyModule_Create(&partition_module);
+    if (module == NULL) return NULL;
+    Py_INCREF(&ParserType);
+    Py_INCREF(&ResultType);
+    if (PyModule_AddObject(module, "PartitionParser", (PyObject *)&ParserType) != 0 || PyModule_AddObject(module, "Result", (PyObject *)&ResultType) != 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}